@@ -3,14 +3,15 @@ RayTracer by AlexD2580 -- where no Harukas were harmed!
 PUBLISHED UNDER THE HAPPY BUNNY LICENSE
 
 material        :: Uint8
-__padding__     :: Uint24
+shape           :: Uint8
+__padding__     :: Uint16
 roughness       :: Float
 -- 0 -> mirror-like; 1 -> diffuse;
 luminescence    :: Float
 -- values can (and for lamps they should) be greater than 1
 color           :: Float3
-payload         :: (Float3,Float3,Float3)
-normal          :: Float3
+payload         :: TRIANGLE => (Float3,Float3,Float3), normal :: Float3
+                   SPHERE   => center :: Float3, radius :: Float
 
 Intersection:
 uchar material;
@@ -19,7 +20,9 @@ float luminescence;
 float roughness;
 */
 
+#ifndef PRIM_SIZE
 #define PRIM_SIZE 18 // floats
+#endif
 
 // Surface types
 #define NONE 0
@@ -28,6 +31,74 @@ float roughness;
 #define MIRROR 3
 #define GLASS 4
 
+// Primitive types
+#define TRIANGLE 1
+#define SPHERE 2
+
+/**
+ * Specialisation, see Renderer::variant. The host leaves out materials and
+ * shapes the scene doesn't use and may fix MAX_BOUNCES. Without these
+ * defines everything is compiled in and max_bounces is read from
+ * general_data.
+ */
+#ifndef HAS_DIFFUSE
+#define HAS_DIFFUSE 1
+#endif
+#ifndef HAS_METALLIC
+#define HAS_METALLIC 1
+#endif
+#ifndef HAS_MIRROR
+#define HAS_MIRROR 1
+#endif
+#ifndef HAS_GLASS
+#define HAS_GLASS 1
+#endif
+#ifndef HAS_TRIANGLE
+#define HAS_TRIANGLE 1
+#endif
+#ifndef HAS_SPHERE
+#define HAS_SPHERE 1
+#endif
+
+// Reprojected pixels keep at most this many samples of history
+#define MAX_HISTORY 16.0f
+
+/**
+ * Instrumented builds count per pixel, summed over all samples:
+ * x: triangle tests, y: sphere tests, z: octree node visits, w: bounces
+ * Without INSTRUMENT the counters and the extra kernel argument vanish.
+ */
+#ifdef INSTRUMENT
+#define COUNT(isec, field) ((isec)->counters.field++)
+#define COUNTERS_ARG , global uint4* counters
+#else
+#define COUNT(isec, field)
+#define COUNTERS_ARG
+#endif
+
+/**
+ * Paged scenes keep only the top of the octree resident, see paging.hpp.
+ * The paging table and the pending flags of the pixels are two extra
+ * kernel arguments.
+ */
+#ifdef PAGING
+#define PAGING_ARG , global uint* paging, global uint* pending
+#define PAGING_RETRY 0
+#define PAGING_COUNT 1
+#define PAGING_SLOTS 2
+#define CLUSTER_ABSENT 0xFFFFFFFFu
+#else
+#define PAGING_ARG
+#endif
+
+// Side of the square tiles trace_persistent hands out
+#ifndef PERSISTENT_TILE
+#define PERSISTENT_TILE 8
+#endif
+
+// Octree traversal, see octree.hpp (OCTREE_MAX_DEPTH 8 -> 8 * 7 + 1)
+#define OCTREE_STACK_SIZE 64
+
 /***  UTIL  ***/
 
 /**
@@ -44,16 +115,24 @@ typedef struct Ray
 } Ray;
 
 /**
- * Aggregation of pointers to the pixel aux buffer.
+ * The closest hit found so far.
  */
 typedef struct Intersection
 {
   /* Pointer to the global object definition */
-  global float* global* object;
+  global float* object;
   /* Position */
-  global float3* pos;
+  float3 pos;
   /* Distance to bounce */
-  float* dist;
+  float dist;
+#ifdef PAGING
+  global uint* paging;
+  /* Closest distance at which an absent cluster was skipped */
+  float missing;
+#endif
+#ifdef INSTRUMENT
+  uint4 counters;
+#endif
 } Intersection;
 
 /**
@@ -115,8 +194,9 @@ inline ulong xorshift1024star(global PRNG* prng)
   s1 ^= s1 << 31; // a
   s1 ^= s1 >> 11; // b
   s0 ^= s0 >> 30; // c
+  /* Odd and distinct per work-item, so no item maps everything to zero */
   return (prng->m_seed[prng->m_p] = s0 ^ s1) * 1181783497276652981L *
-         get_global_id(0) * get_global_id(1);
+         (2 * (get_global_id(1) * get_global_size(0) + get_global_id(0)) + 1);
 }
 
 inline float rand_range(global PRNG* prng, const float min, const float max)
@@ -171,7 +251,7 @@ inline float3 oriented_uniform_sample_hemisphere(global PRNG* prng, float3 dir)
  * @return A random point on the surface of a sphere
  */
 inline float3
-sample_hemisphere(global PRNG* prng, float3 dir, float power, float angle)
+sample_hemisphere_2d(float2 u, float3 dir, float power, float angle)
 {
   // Code by Mikael Hvidtfeldt Christensen
   // from
@@ -180,23 +260,179 @@ sample_hemisphere(global PRNG* prng, float3 dir, float power, float angle)
 
   float3 o1 = normalize(ortho(dir));
   float3 o2 = normalize(cross(dir, o1));
-  float rx = rand_range(prng, 0.0f, 1.0f);
-  float ry = rand_range(prng, cos(angle), 1.0f);
+  float rx = u.x;
+  float ry = mix(cos(angle), 1.0f, u.y);
   rx *= 3.1415f * 2.0f;
   ry = pow(ry, 1.0f / (power + 1.0f));
   float oneminus = sqrt(1.0f - ry * ry);
   return cos(rx) * oneminus * o1 + sin(rx) * oneminus * o2 + ry * dir;
 }
 
+/**
+ * sample_hemisphere_2d with pseudo random numbers.
+ */
+inline float3
+sample_hemisphere(global PRNG* prng, float3 dir, float power, float angle)
+{
+  float2 u = (float2){rand_range(prng, 0.0f, 1.0f),
+                      rand_range(prng, 0.0f, 1.0f)};
+  return sample_hemisphere_2d(u, dir, power, angle);
+}
+
 /*** RANDOM ***/
+/*** SAMPLER ***/
+
+/**
+ * Samplers, see sampler.hpp. The host picks one with SAMPLER, the tables
+ * of the low-discrepancy ones are uploaded once.
+ */
+#define SAMPLER_RANDOM 0
+#define SAMPLER_SOBOL 1
+#define SAMPLER_BLUE_NOISE 2
+
+#ifndef SAMPLER
+#define SAMPLER SAMPLER_RANDOM
+#endif
+#ifndef BLUE_NOISE_SIZE
+#define BLUE_NOISE_SIZE 64
+#endif
+
+#define SOBOL_BITS 32
+#define SAMPLER_SOBOL_OFFSET 1
+#define SAMPLER_BLUE_NOISE_OFFSET (SAMPLER_SOBOL_OFFSET + 2 * SOBOL_BITS)
+
+/**
+ * Dimensions of a path sample. Every one is a 2D point, the sampler
+ * decorrelates them by scrambling each with its own seed.
+ */
+#define DIM_CAMERA 0
+#define DIM_BSDF(bounce) (1 + 2 * (bounce))
+#define DIM_LIGHT(bounce) (2 + 2 * (bounce))
+
+/**
+ * State of the sampler of one pixel sample.
+ */
+typedef struct Sampler
+{
+  global PRNG* prng;
+  global uint* tables;
+  /** Index of the sample in the sequence of its pixel **/
+  uint index;
+  /** Scrambles the sequence, per pixel unless it is blue-noise dithered **/
+  uint seed;
+  uint2 pixel;
+} Sampler;
+
+// lowbias32 by Chris Wellons
+inline uint hash_uint(uint x)
+{
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return x;
+}
+
+inline uint hash_combine(uint seed, uint v)
+{
+  return seed ^ (hash_uint(v) + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+
+inline uint reverse_bits(uint x)
+{
+  x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+  x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+  x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+  x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+  return rotate(x, 16u);
+}
+
+/**
+ * Owen scrambling of a 32 bit fraction: Burley, "Practical Hash-based
+ * Owen Scrambling", JCGT 2020. Every bit is flipped depending on the
+ * seed and all bits above it.
+ */
+inline uint nested_uniform_scramble(uint x, uint seed)
+{
+  x = reverse_bits(x);
+  x ^= x * 0x3d20adeau;
+  x += seed;
+  x *= (seed >> 16) | 1u;
+  x ^= x * 0x05526c56u;
+  x ^= x * 0x53a22864u;
+  return reverse_bits(x);
+}
+
+inline uint sobol(global uint* columns, uint index)
+{
+  uint x = 0;
+  for(uint bit = 0; index != 0; index >>= 1, bit++)
+    if(index & 1)
+      x ^= columns[bit];
+  return x;
+}
+
+inline void sampler_init(Sampler* s,
+                         global PRNG* prng,
+                         global uint* tables,
+                         uint index,
+                         uint2 pixel,
+                         uint width)
+{
+  s->prng = prng;
+  s->tables = tables;
+  s->index = index;
+  s->pixel = pixel;
+#if SAMPLER == SAMPLER_BLUE_NOISE
+  s->seed = tables[0];
+#else
+  s->seed = hash_combine(tables[0], pixel.y * width + pixel.x);
+#endif
+}
+
+/**
+ * The 2D point of dimension *dim* of the current sample, in [0, 1)^2.
+ * The low-discrepancy samplers shuffle the sample index and scramble the
+ * two Sobol dimensions with seeds derived from *dim*, so every dimension
+ * pair is a (0, 2)-sequence independent of the others.
+ */
+inline float2 sample_2d(Sampler* s, uint dim)
+{
+#if SAMPLER == SAMPLER_RANDOM
+  return (float2){rand_range(s->prng, 0.0f, 1.0f),
+                  rand_range(s->prng, 0.0f, 1.0f)};
+#else
+  uint seed = hash_combine(s->seed, dim);
+  uint index = nested_uniform_scramble(s->index, seed);
+  global uint* columns = s->tables + SAMPLER_SOBOL_OFFSET;
+  uint2 u = (uint2){sobol(columns, index),
+                    sobol(columns + SOBOL_BITS, index)};
+  u.x = nested_uniform_scramble(u.x, hash_combine(seed, 1));
+  u.y = nested_uniform_scramble(u.y, hash_combine(seed, 2));
+#if SAMPLER == SAMPLER_BLUE_NOISE
+  /* Toroidal shift of the tile per dimension, along the R2 sequence */
+  const uint mask = BLUE_NOISE_SIZE - 1;
+  global uint* noise = s->tables + SAMPLER_BLUE_NOISE_OFFSET;
+  uint2 shift = (uint2){(uint)(dim * 0.7548777f * BLUE_NOISE_SIZE),
+                        (uint)(dim * 0.5698403f * BLUE_NOISE_SIZE)};
+  uint2 p = (s->pixel + shift) & mask;
+  uint2 q = (s->pixel + shift + (uint2){BLUE_NOISE_SIZE / 2, 0}) & mask;
+  /* Cranley-Patterson rotation, modulo 1 in fixed point */
+  u.x += noise[p.y * BLUE_NOISE_SIZE + p.x];
+  u.y += noise[q.y * BLUE_NOISE_SIZE + q.x];
+#endif
+  return convert_float2(u >> 8) * (1.0f / 16777216.0f);
+#endif
+}
+
+/*** SAMPLER ***/
 /**** MAIN  ****/
 
 /**
  * https://en.wikipedia.org/wiki/M%C3%B6ller%E2%80%93Trumbore_intersection_algorithm
  */
-void test_triangle(const Ray ray,
-                   global float* triangle,
-                   Intersection const isec)
+float hit_triangle(const Ray ray, global float* triangle)
 {
   float3 a = (float3){triangle[6], triangle[7], triangle[8]};
   float3 b = (float3){triangle[9], triangle[10], triangle[11]};
@@ -211,7 +447,7 @@ void test_triangle(const Ray ray,
   float det = dot(atob, P);
 
   if(det < 0.00001f)
-    return;
+    return INFINITY;
 
   float inv_det = 1.0f / det;
   // calculate distance from V1 to ray origin
@@ -221,7 +457,7 @@ void test_triangle(const Ray ray,
   float u = dot(T, P) * inv_det;
   // The intersection lies outside of the triangle
   if(u < 0.0f || u > 1.0f)
-    return;
+    return INFINITY;
 
   // Prepare to test v parameter
   float3 Q = cross(T, atob);
@@ -230,44 +466,298 @@ void test_triangle(const Ray ray,
   float v = dot(ray.dir, Q) * inv_det;
   // The intersection lies outside of the triangle
   if(v < 0.0f || u + v > 1.0f)
-    return;
+    return INFINITY;
 
   float dist = dot(atoc, Q) * inv_det;
-  if(dist > 0.00001f && dist < *isec.dist)
+  return dist > 0.00001f ? dist : INFINITY;
+}
+
+/**
+ * Ray/sphere intersection, starting with the near root and falling back to
+ * the far one when the origin lies inside the sphere.
+ */
+float hit_sphere(const Ray ray, global float* sphere)
+{
+  float3 center = (float3){sphere[6], sphere[7], sphere[8]};
+  float radius = sphere[9];
+
+  float3 to_center = center - ray.pos;
+  float b = dot(to_center, ray.dir);
+  float disc = b * b - dot(to_center, to_center) + radius * radius;
+  if(disc < 0.0f)
+    return INFINITY;
+
+  disc = sqrt(disc);
+  float dist = b - disc;
+  if(dist <= 0.00001f)
+    dist = b + disc;
+
+  return dist > 0.00001f ? dist : INFINITY;
+}
+
+/**
+ * Distance along *ray* to *object*, INFINITY if it misses. Writes nothing
+ * but the counters of *isec*.
+ */
+float hit_primitive(const Ray ray, global float* object, Intersection* isec)
+{
+#if HAS_SPHERE && HAS_TRIANGLE
+  if(((global uchar*)object)[1] == SPHERE)
+  {
+    COUNT(isec, y);
+    return hit_sphere(ray, object);
+  }
+  COUNT(isec, x);
+  return hit_triangle(ray, object);
+#elif HAS_SPHERE
+  COUNT(isec, y);
+  return hit_sphere(ray, object);
+#else
+  COUNT(isec, x);
+  return hit_triangle(ray, object);
+#endif
+}
+
+void test_primitive(const Ray ray, global float* object, Intersection* isec)
+{
+  float dist = hit_primitive(ray, object, isec);
+  if(dist < isec->dist)
+  {
+    isec->pos = ray.pos + dist * ray.dir;
+    isec->dist = dist;
+    isec->object = object;
+  }
+}
+
+/**
+ * Returns the normal of *object* at the surface point *pos*.
+ */
+float3 get_normal(global float* object, float3 pos)
+{
+#if HAS_SPHERE
+  if(!HAS_TRIANGLE || ((global uchar*)object)[1] == SPHERE)
+    return (pos - (float3){object[6], object[7], object[8]}) / object[9];
+#endif
+  return normalize((float3){object[15], object[16], object[17]});
+}
+
+/**
+ * Slab test. Returns the distance at which the ray enters the box,
+ * or INFINITY if it misses it.
+ */
+float test_aabb(const Ray ray, const float3 inv_dir, global float* node)
+{
+  float3 lower = (float3){node[0], node[1], node[2]};
+  float3 upper = (float3){node[3], node[4], node[5]};
+
+  float3 t0 = (lower - ray.pos) * inv_dir;
+  float3 t1 = (upper - ray.pos) * inv_dir;
+  float3 t_near = fmin(t0, t1);
+  float3 t_far = fmax(t0, t1);
+
+  float t_enter = fmax(fmax(t_near.x, t_near.y), t_near.z);
+  float t_exit = fmin(fmin(t_far.x, t_far.y), t_far.z);
+  if(t_exit < fmax(t_enter, 0.0f))
+    return INFINITY;
+  return t_enter;
+}
+
+#ifdef PAGING
+/**
+ * Stub node of cluster -1 - *count* entered at *t_enter*. Marks it used if
+ * it is resident, otherwise requests it from the host and remembers how
+ * close the skipped geometry was.
+ * @return The octree offset of the cluster root, or CLUSTER_ABSENT
+ */
+uint enter_cluster(int count, float t_enter, Intersection* isec)
+{
+  global uint* paging = isec->paging;
+  const uint clusters = paging[PAGING_COUNT];
+  const uint cluster = (uint)(-1 - count);
+  const uint root = paging[PAGING_SLOTS + cluster];
+  if(root == CLUSTER_ABSENT)
   {
-    *isec.pos = ray.pos + dist * ray.dir;
-    *isec.dist = dist;
-    *isec.object = triangle;
+    paging[PAGING_SLOTS + clusters + cluster] = 1;
+    isec->missing = fmin(isec->missing, t_enter);
   }
+  else
+    paging[PAGING_SLOTS + 2 * clusters + cluster] = 1;
+  return root;
 }
+#endif
+
+#ifdef SHARED_PRIMITIVES
+// Primitive ids a ray remembers, see Mailbox
+#define MAILBOX_SIZE 8
 
 /**
- * Lookup loop. Currently running in O(n) on a list of primitives (triangles).
- * TODO Replace by lookup structure.
+ * The last primitives a ray tested. Split primitives are referenced from
+ * several octree nodes (see OctreeOptions), a ray tests them only once
+ * while they are in here.
+ */
+typedef struct Mailbox
+{
+  uint ids[MAILBOX_SIZE];
+  uint next;
+} Mailbox;
+
+void mailbox_clear(Mailbox* box)
+{
+  for(int i = 0; i < MAILBOX_SIZE; i++)
+    box->ids[i] = 0xFFFFFFFFu;
+  box->next = 0;
+}
+
+/**
+ * Whether *id* was tested already, remembers it otherwise.
+ */
+bool mailbox_seen(Mailbox* box, uint id)
+{
+  for(int i = 0; i < MAILBOX_SIZE; i++)
+    if(box->ids[i] == id)
+      return true;
+  box->ids[box->next] = id;
+  box->next = (box->next + 1) % MAILBOX_SIZE;
+  return false;
+}
+#endif
+
+/**
+ * Lookup loop. Walks the flattened octree (see Octree::print_to_array),
+ * skipping every node that lies behind the closest intersection so far.
+ * In paged scenes absent clusters are requested and skipped, see
+ * enter_cluster.
  */
 void run_trace(const Ray ray,
                global float* objects,
-               uint count,
-               Intersection const isec)
+               global float* octree,
+               Intersection* isec)
 {
-  global float* object = objects;
-  for(int index = 0; index < count; index++)
+  const float3 inv_dir = 1.0f / ray.dir;
+  uint stack[OCTREE_STACK_SIZE];
+  int top = 0;
+  stack[top++] = 0;
+#ifdef SHARED_PRIMITIVES
+  Mailbox mailbox;
+  mailbox_clear(&mailbox);
+#endif
+
+  while(top > 0)
   {
-    test_triangle(ray, object, isec);
-    object += PRIM_SIZE;
+    global float* node = octree + stack[--top];
+    COUNT(isec, z);
+    float t_enter = test_aabb(ray, inv_dir, node);
+    if(t_enter > isec->dist)
+      continue;
+
+    global int* node_i = (global int*)node + 6;
+    int count = *node_i++;
+#ifdef PAGING
+    if(count < 0)
+    {
+      uint root = enter_cluster(count, t_enter, isec);
+      if(root != CLUSTER_ABSENT && top < OCTREE_STACK_SIZE)
+        stack[top++] = root;
+      continue;
+    }
+#endif
+    for(int i = 0; i < count; i++)
+    {
+#ifdef SHARED_PRIMITIVES
+      if(mailbox_seen(&mailbox, node_i[i]))
+        continue;
+#endif
+      test_primitive(ray, objects + node_i[i] * PRIM_SIZE, isec);
+    }
+    node_i += count;
+
+    uint node_off = node - octree;
+    for(int i = 0; i < 8; i++)
+      if(node_i[i] != -1 && top < OCTREE_STACK_SIZE)
+        stack[top++] = node_off + node_i[i];
   }
 }
 
+/**
+ * Any-hit variant of run_trace: whether something lies closer than *tmax*
+ * along *ray*. Stops at the first such primitive and writes nothing but
+ * the counters of *isec* (and in paged scenes the skipped clusters).
+ * @param skip_emissive - Let the ray pass through lamps
+ */
+bool run_occlusion(const Ray ray,
+                   const float tmax,
+                   const bool skip_emissive,
+                   global float* objects,
+                   global float* octree,
+                   Intersection* isec)
+{
+  const float3 inv_dir = 1.0f / ray.dir;
+  uint stack[OCTREE_STACK_SIZE];
+  int top = 0;
+  stack[top++] = 0;
+#ifdef SHARED_PRIMITIVES
+  Mailbox mailbox;
+  mailbox_clear(&mailbox);
+#endif
+
+  while(top > 0)
+  {
+    global float* node = octree + stack[--top];
+    COUNT(isec, z);
+    float t_enter = test_aabb(ray, inv_dir, node);
+    if(t_enter >= tmax)
+      continue;
+
+    global int* node_i = (global int*)node + 6;
+    int count = *node_i++;
+#ifdef PAGING
+    if(count < 0)
+    {
+      uint root = enter_cluster(count, t_enter, isec);
+      if(root != CLUSTER_ABSENT && top < OCTREE_STACK_SIZE)
+        stack[top++] = root;
+      continue;
+    }
+#endif
+    for(int i = 0; i < count; i++)
+    {
+#ifdef SHARED_PRIMITIVES
+      if(mailbox_seen(&mailbox, node_i[i]))
+        continue;
+#endif
+      global float* object = objects + node_i[i] * PRIM_SIZE;
+      if(skip_emissive && object[2] > 0.0f)
+        continue;
+      if(hit_primitive(ray, object, isec) < tmax)
+        return true;
+    }
+    node_i += count;
+
+    uint node_off = node - octree;
+    for(int i = 0; i < 8; i++)
+      if(node_i[i] != -1 && top < OCTREE_STACK_SIZE)
+        stack[top++] = node_off + node_i[i];
+  }
+  return false;
+}
+
 void gen_random_point(global PRNG* prng,
                       global float* obj,
                       uint count,
-                      Intersection const isec)
+                      Intersection* isec)
 {
     uint rand = xorshift1024star(prng) % count;
     obj += rand * PRIM_SIZE;
 
-    *isec.object = obj;
-    *isec.dist = 0.0f;
+    isec->object = obj;
+    isec->dist = 0.0f;
+
+    if(((global uchar*)obj)[1] == SPHERE)
+    {
+      float3 center = (float3){obj[6], obj[7], obj[8]};
+      isec->pos = center + obj[9] * uniform_sample_sphere(prng);
+      return;
+    }
 
     float3 a = (float3){obj[6], obj[7], obj[8]};
     float3 to_b = (float3){obj[9], obj[10], obj[11]} - a;
@@ -279,11 +769,155 @@ void gen_random_point(global PRNG* prng,
       r1 = 1.0f - r1;
       r2 = 1.0f - r2;
     }
-    *isec.pos = a + r1 * to_b + r2 * to_c;
+    isec->pos = a + r1 * to_b + r2 * to_c;
 }
 
+/*** DIRECT LIGHT ***/
+
+/**
+ * Surface area of a lamp primitive.
+ */
+float lamp_area(global float* lamp)
+{
+#if HAS_SPHERE
+  if(!HAS_TRIANGLE || ((global uchar*)lamp)[1] == SPHERE)
+    return 4.0f * M_PI_F * lamp[9] * lamp[9];
+#endif
+  float3 a = (float3){lamp[6], lamp[7], lamp[8]};
+  float3 b = (float3){lamp[9], lamp[10], lamp[11]};
+  float3 c = (float3){lamp[12], lamp[13], lamp[14]};
+  return 0.5f * length(cross(b - a, c - a));
+}
+
+/**
+ * Picks one of the *count* lamps at *lamps* uniformly with u.x, then a
+ * point on it uniformly by area with what is left of u.
+ * @return The density of *pos* with respect to area
+ */
+float sample_lamp(float2 u,
+                  global float* lamps,
+                  uint count,
+                  global float** lamp,
+                  float3* pos)
+{
+  float scaled = u.x * (float)count;
+  uint index = min((uint)scaled, count - 1);
+  u.x = scaled - (float)index;
+  *lamp = lamps + index * PRIM_SIZE;
+  global float* l = *lamp;
+
+#if HAS_SPHERE
+  if(!HAS_TRIANGLE || ((global uchar*)l)[1] == SPHERE)
+  {
+    float z = 1.0f - 2.0f * u.x;
+    float r = sqrt(fmax(0.0f, 1.0f - z * z));
+    float phi = 2.0f * M_PI_F * u.y;
+    float3 center = (float3){l[6], l[7], l[8]};
+    *pos = center + l[9] * (float3){r * cos(phi), r * sin(phi), z};
+    return 1.0f / ((float)count * lamp_area(l));
+  }
+#endif
+  float3 a = (float3){l[6], l[7], l[8]};
+  float3 b = (float3){l[9], l[10], l[11]};
+  float3 c = (float3){l[12], l[13], l[14]};
+  float su = sqrt(u.x);
+  *pos = (1.0f - su) * a + su * (1.0f - u.y) * b + su * u.y * c;
+  return 1.0f / ((float)count * lamp_area(l));
+}
+
+/**
+ * Whether nothing blocks the segment from *pos* to *dist* along *dir*.
+ * Tests and node visits are counted into *isec*.
+ */
+bool unoccluded(float3 pos,
+                float3 dir,
+                float dist,
+                global float* objects,
+                global float* octree,
+                Intersection* isec)
+{
+  Ray shadow;
+  shadow.pos = pos;
+  shadow.dir = dir;
+  /* Lamps occlude too, e.g. the far side of a sampled lamp */
+  return !run_occlusion(
+      shadow, dist * 0.9999f, false, objects, octree, isec);
+}
+
+/**
+ * Density of sample_hemisphere_2d(u, dir, 1.0f, angle) returning *wi*.
+ */
+float glossy_pdf(float3 dir, float3 wi, float angle)
+{
+  float c = dot(dir, wi);
+  float cos_angle = cos(angle);
+  if(c * c < cos_angle || c <= 0.0f)
+    return 0.0f;
+  return c / (M_PI_F * (1.0f - cos_angle));
+}
+
+/**
+ * Power heuristic with beta = 2 for the strategy with density *a* against
+ * the one with density *b*.
+ */
+float mis_weight(float a, float b)
+{
+  return a * a / (a * a + b * b);
+}
+
+/*** DIRECT LIGHT ***/
+
 /**
- * Main kernel function.
+ * Direction of the primary ray through the screen position (pos_x, pos_y)
+ * of the camera described by *data_f* (see general_data).
+ */
+float3 camera_dir(global float* data_f, float pos_x, float pos_y)
+{
+  global int* data_i = (global int*)data_f;
+  const float3 dir = (float3){data_f[5], data_f[6], data_f[7]};
+  const float3 up = (float3){data_f[8], data_f[9], data_f[10]};
+  const float3 left = (float3){data_f[11], data_f[12], data_f[13]};
+
+  /** Relative coordinate system [-1..1]x[-1..1] **/
+  float rel_x = (2.0f * pos_x / (float)data_i[14]) - 1.0f;
+  // y on screen goes down, y in coordsys goes up -> invert
+  float rel_y = -((2.0f * pos_y / (float)data_i[15]) - 1.0f);
+
+  float max_u = tan(data_f[0] / 2.0f);
+  float max_r = max_u * data_f[1];
+
+  return normalize(dir + rel_y * max_u * up - rel_x * max_r * left);
+}
+
+/**
+ * Inverse of camera_dir, projects *pos* onto the screen of the camera.
+ * Returns false if *pos* lies behind it.
+ */
+bool camera_project(global float* data_f, float3 pos, float2* screen)
+{
+  global int* data_i = (global int*)data_f;
+  const float3 eye = (float3){data_f[2], data_f[3], data_f[4]};
+  const float3 dir = (float3){data_f[5], data_f[6], data_f[7]};
+  const float3 up = (float3){data_f[8], data_f[9], data_f[10]};
+  const float3 left = (float3){data_f[11], data_f[12], data_f[13]};
+
+  float3 to_pos = pos - eye;
+  float depth = dot(to_pos, dir);
+  if(depth < 0.00001f)
+    return false;
+
+  float max_u = tan(data_f[0] / 2.0f);
+  float max_r = max_u * data_f[1];
+  float rel_x = -dot(to_pos, left) / (depth * max_r);
+  float rel_y = dot(to_pos, up) / (depth * max_u);
+
+  screen->x = (rel_x + 1.0f) * 0.5f * (float)data_i[14];
+  screen->y = (1.0f - rel_y) * 0.5f * (float)data_i[15];
+  return true;
+}
+
+/**
+ * One sample of the pixel (pos_x, pos_y).
  * general_data is an array of 20 4-byte units:
  * fovy, aspect :: Float
  * posx, posy, posz :: Float
@@ -296,47 +930,62 @@ void gen_random_point(global PRNG* prng,
  * off_lamps :: UInt
  * max_bounces :: UInt
  */
-kernel void trace(global void* general_data,
-                  global float* objects,
-                  global float* aux_buffer,
-                  global uint* frame_c,
-                  global float4* frame_f,
-                  global float* samples,
-                  global PRNG* prng)
+void trace_pixel(global void* general_data,
+                 global float* objects,
+                 global float* octree,
+                 global float* aux_buffer,
+                 global uint* frame_c,
+                 global float4* frame_f,
+                 global float* samples,
+                 global PRNG* prng,
+                 global float* depth,
+                 global uint* sampler_tables PAGING_ARG COUNTERS_ARG,
+                 const int pos_x,
+                 const int pos_y)
 {
     global float* data_f = (global float*)general_data;
     global int* data_i = (global int*)general_data;
 
-    const float fovy = data_f[0];
-    const float aspect = data_f[1];
-
     float3 eye_pos = (float3){data_f[2], data_f[3], data_f[4]};
-    float3 eye_dir = (float3){data_f[5], data_f[6], data_f[7]};
-    const float3 eye_up = (float3){data_f[8], data_f[9], data_f[10]};
-    const float3 eye_left = (float3){data_f[11], data_f[12], data_f[13]};
     const int size_w = data_i[14];
     const int size_h = data_i[15];
 
     const uint surf_count = data_i[16];
     const uint lamp_count = data_i[17];
     const uint lamp_off = data_i[18];
+#ifdef MAX_BOUNCES
+    const uint max_bounces = MAX_BOUNCES;
+#else
     const uint max_bounces = data_i[19];
+#endif
+#ifdef AUX_BOUNCES
+    /* The host binds a dummy aux buffer while nothing reads it */
+    const uint aux_bounces = AUX_BOUNCES;
+#else
+    const uint aux_bounces = max_bounces;
+#endif
 
-    /** Pixel coordinates **/
-    const int pos_x = get_global_id(0);
-    const int pos_y = get_global_id(1);
     const int id = pos_y * size_w + pos_x;
-    /** Relative coordinate system [-1..1]x[-1..1] **/
-    float rel_x = (2.0f * (float)pos_x / (float)size_w) - 1.0f;
-    // y on screen goes down, y in coordsys goes up -> invert
-    float rel_y = -((2.0f * (float)pos_y / (float)size_h) - 1.0f);
-
-    float max_u = tan(fovy / 2.0f);
-    float max_r = max_u * aspect;
 
-    eye_dir += (rel_y * max_u * eye_up - rel_x * max_r * eye_left);
-    eye_dir = normalize(eye_dir); // TODO FIX THIS!!
-    eye_dir = sample_hemisphere(prng, eye_dir, 0.0f, 0.001f);
+#ifdef PAGING
+    /* Retry launches trace only the samples that waited for clusters */
+    if(paging[PAGING_RETRY] && !pending[id])
+      return;
+    bool deferred = false;
+#endif
+
+    /* render() counts the sample before launching it */
+    Sampler sampler;
+    sampler_init(&sampler,
+                 prng,
+                 sampler_tables,
+                 (uint)samples[0] - 1,
+                 (uint2)((uint)pos_x, (uint)pos_y),
+                 size_w);
+
+    float3 eye_dir = camera_dir(data_f, (float)pos_x, (float)pos_y);
+    eye_dir = sample_hemisphere_2d(
+        sample_2d(&sampler, DIM_CAMERA), eye_dir, 0.0f, 0.001f);
 
     /**
     * Size of a float/an aux_buffer frame in float-units (4byte-segments)
@@ -351,15 +1000,21 @@ kernel void trace(global void* general_data,
     * First eye-bounce point is NOT the eye itself
     * First lamp-bounce point is the random lamp-point
     */
-    const global float* base_ptr = aux_buffer + 2 * max_bounces * id * unit_size;
+    const global float* base_ptr = aux_buffer + 2 * aux_bounces * id * unit_size;
     global float* global* object_ptrs = (global float* global*)base_ptr;
     global float3* positions =
-      (global float3*)(base_ptr + 2 * max_bounces * float_ptr_size);
+      (global float3*)(base_ptr + 2 * aux_bounces * float_ptr_size);
     float3 normal;
 
     Intersection intersection;
-    float dist = 0.0f;
-    intersection.dist = &dist;
+    intersection.object = 0;
+    intersection.dist = INFINITY;
+#ifdef PAGING
+    intersection.paging = paging;
+#endif
+#ifdef INSTRUMENT
+    intersection.counters = (uint4)(0);
+#endif
 
     //--------------------------------------------------------------------------//
 
@@ -372,24 +1027,183 @@ kernel void trace(global void* general_data,
     ray.pos = eye_pos;
     ray.dir = eye_dir;
 
-    int eye_bounces = 0;
-
+    float3 frag = (float3){0.0f, 0.0f, 0.0f};
+    float3 throughput = (float3){1.0f, 1.0f, 1.0f};
+    /* Density of the last bounce direction, 0 for the eye and delta ones */
+    float bsdf_pdf = 0.0f;
+    global float* lamps = objects + lamp_off;
 
+    /* The primary hit and up to max_bounces more */
+    for(uint eye_bounces = 0; eye_bounces <= max_bounces; eye_bounces++)
+    {
+      intersection.object = 0;
+      intersection.dist = INFINITY;
+#ifdef PAGING
+      intersection.missing = INFINITY;
+#endif
+      run_trace(ray, objects, octree, &intersection);
+#ifdef PAGING
+      /* An absent cluster could hold a closer hit */
+      if(intersection.missing < intersection.dist)
+      {
+        deferred = true;
+        break;
+      }
+      intersection.missing = INFINITY;
+#endif
+
+      object = intersection.object;
+      if(eye_bounces == 0)
+        depth[id] = intersection.dist;
+      if(object == 0)
+        break; // nothing hit
+      COUNT(&intersection, w);
+
+      material = ((global uchar*)object)[0];
+      float3 color = (float3){object[3], object[4], object[5]};
+
+      ray.pos = intersection.pos;
+      normal = get_normal(object, ray.pos);
+
+      /**
+       * A lamp hit by a sampled bounce could also have been reached by
+       * light sampling at the previous vertex, weight the two by MIS.
+       */
+      float emission_weight = 1.0f;
+      if(bsdf_pdf > 0.0f && object >= lamps &&
+         object < lamps + lamp_count * PRIM_SIZE)
+      {
+        float light_pdf = intersection.dist * intersection.dist /
+                          ((float)lamp_count * lamp_area(object) *
+                           fabs(dot(normal, ray.dir)));
+        emission_weight = mis_weight(bsdf_pdf, light_pdf);
+      }
+      frag += throughput * color * object[2] * emission_weight;
+
+      /* Triangles and lamps can be hit from either side */
+      if(dot(normal, ray.dir) > 0.0f)
+        normal = -normal;
+
+#if HAS_DIFFUSE || HAS_METALLIC
+      /**
+       * Next-event estimation: a shadow ray toward a point on a lamp.
+       * After the last vertex no bounce follows that could reach the lamp,
+       * so there light sampling gets the full weight.
+       */
+      if(lamp_count > 0 && (material == DIFFUSE || material == METALLIC))
+      {
+        global float* lamp;
+        float3 lamp_pos;
+        float area_pdf = sample_lamp(sample_2d(&sampler,
+                                               DIM_LIGHT(eye_bounces)),
+                                     lamps,
+                                     lamp_count,
+                                     &lamp,
+                                     &lamp_pos);
+        float3 to_lamp = lamp_pos - ray.pos;
+        float dist = length(to_lamp);
+        float3 wi = to_lamp / dist;
+        float cos_lamp = fabs(dot(get_normal(lamp, lamp_pos), wi));
+
+        /* BSDF times cosine toward the lamp, and its sampling density */
+        float3 f_cos = (float3){0.0f, 0.0f, 0.0f};
+        float pdf = 0.0f;
+        if(material == DIFFUSE && dot(normal, wi) > 0.0f)
+        {
+          f_cos = color * M_1_PI_F * dot(normal, wi);
+          pdf = 0.5f * M_1_PI_F;
+        }
+        else if(material == METALLIC)
+        {
+          pdf = glossy_pdf(reflect(ray.dir, normal), wi, 1.0f);
+          f_cos = color * pdf;
+        }
+
+        if(pdf > 0.0f && cos_lamp > 0.0f &&
+           unoccluded(ray.pos, wi, dist, objects, octree, &intersection))
+        {
+#ifdef PAGING
+          /* Unless an absent cluster blocks the shadow ray */
+          if(intersection.missing < INFINITY)
+          {
+            deferred = true;
+            break;
+          }
+#endif
+          float light_pdf = area_pdf * dist * dist / cos_lamp;
+          float weight = eye_bounces < max_bounces
+                             ? mis_weight(light_pdf, pdf)
+                             : 1.0f;
+          float3 lamp_color = (float3){lamp[3], lamp[4], lamp[5]};
+          frag += throughput * f_cos * lamp_color * lamp[2] * weight /
+                  light_pdf;
+        }
+      }
+#endif
+
+      switch(material)
+      {
+#if HAS_DIFFUSE
+      case DIFFUSE:
+        ray.dir = sample_hemisphere_2d(sample_2d(&sampler,
+                                                 DIM_BSDF(eye_bounces)),
+                                       normal,
+                                       0.0f,
+                                       M_PI_F / 2.0f);
+        throughput *= 2.0f * color * dot(normal, ray.dir);
+        bsdf_pdf = 0.5f * M_1_PI_F;
+        break;
+#endif
+#if HAS_MIRROR
+      case MIRROR:
+        ray.dir = reflect(ray.dir, normal);
+        throughput *= color;
+        bsdf_pdf = 0.0f;
+        break;
+#endif
+#if HAS_METALLIC
+      case METALLIC:
+      {
+        float3 mirror = reflect(ray.dir, normal);
+        ray.dir = sample_hemisphere_2d(
+            sample_2d(&sampler, DIM_BSDF(eye_bounces)), mirror, 1.0f, 1.0f);
+        throughput *= color;
+        bsdf_pdf = glossy_pdf(mirror, ray.dir, 1.0f);
+        break;
+      }
+#endif
+#if HAS_GLASS
+      case GLASS:
+        /* No refraction yet, the ray passes straight through */
+        throughput *= color;
+        bsdf_pdf = 0.0f;
+        break;
+#endif
+      default:
+        /* Not compiled into this variant, end the path */
+        eye_bounces = max_bounces;
+        break;
+      }
+    }
 
+#ifdef INSTRUMENT
+    counters[id] += intersection.counters;
+#endif
 
-    run_trace(ray, objects, surf_count, intersection);
-    object = *intersection.object;
+#ifdef PAGING
+    /* Traced again once the host has loaded the clusters */
+    pending[id] = deferred;
+    if(deferred)
+      return;
+#endif
 
-    float3 frag = (float3){0.0f, 0.0f, 0.0f};
-    if(object != 0)
-    frag = (float3){object[3], object[4], object[5]};
-
-    float4 total = frame_f[id] + (float4){frag.x, frag.y, frag.z, 0.0};
+    /** w counts the samples of this pixel, see reproject **/
+    float4 total = frame_f[id] + (float4){frag.x, frag.y, frag.z, 1.0f};
     frame_f[id] = total;
 
-    uchar frag_r = (uchar)clamp(255.1f * total.x / *samples, 0.0f, 255.0f);
-    uchar frag_g = (uchar)clamp(255.1f * total.y / *samples, 0.0f, 255.0f);
-    uchar frag_b = (uchar)clamp(255.1f * total.z / *samples, 0.0f, 255.0f);
+    uchar frag_r = (uchar)clamp(255.1f * total.x / total.w, 0.0f, 255.0f);
+    uchar frag_g = (uchar)clamp(255.1f * total.y / total.w, 0.0f, 255.0f);
+    uchar frag_b = (uchar)clamp(255.1f * total.z / total.w, 0.0f, 255.0f);
     uint frag_i = frag_r << 24 | frag_g << 16 | frag_b << 8 | 255;
     frame_c[id] = frag_i;
 
@@ -399,42 +1213,6 @@ kernel void trace(global void* general_data,
 
 
 
-  /*while(eye_bounces < max_bounces)
-  {
-    intersection.object = object_ptrs + eye_bounces;
-    intersection.pos = positions + eye_bounces;
-
-    *intersection.object = 0;
-    *intersection.dist = 1.0f / 0.0f;
-
-    run_trace(ray, objects, surf_count, intersection);
-    run_trace(ray, objects + lamp_off, lamp_count, intersection);
-
-    object = *intersection.object;
-    if(object == 0)
-      break; // nothing hit
-    eye_bounces++;
-
-    material = ((global uchar*)object)[0];
-    roughness = object[1];
-    ray.pos = *intersection.pos;
-    normal = (float3){object[15], object[16], object[17]};
-
-    switch(material)
-    {
-    case DIFFUSE:
-      ray.dir = oriented_uniform_sample_hemisphere(prng, normal);
-      break;
-    case MIRROR:
-      ray.dir = reflect(ray.dir, normal);
-      break;
-    case METALLIC:
-      ray.dir = reflect(ray.dir, normal);
-      ray.dir = sample_hemisphere(prng, ray.dir, 1.0f, 1.0f);
-      break;
-    }
-  }*/
-
   /*intersection.object = object_ptrs + max_bounces;
   intersection.pos = positions + max_bounces;
 
@@ -443,7 +1221,7 @@ kernel void trace(global void* general_data,
 */
   /* Compute light bounces *//*
   ray.pos = *intersection.pos;
-  normal = (float3){object[15], object[16], object[17]};
+  normal = get_normal(object, ray.pos);
   ray.dir = oriented_uniform_sample_hemisphere(prng, normal);
 
   int lamp_bounces = 1;
@@ -455,8 +1233,7 @@ kernel void trace(global void* general_data,
     *intersection.object = 0;
     *intersection.dist = 1.0f / 0.0f;
 
-    run_trace(ray, objects, surf_count, intersection);
-    run_trace(ray, objects + lamp_off, lamp_count, intersection);
+    run_trace(ray, objects, octree, intersection);
 
     object = *intersection.object;
     if(object == 0)
@@ -466,7 +1243,7 @@ kernel void trace(global void* general_data,
     material = ((global uchar*)object)[0];
     roughness = object[1];
     ray.pos = *intersection.pos;
-    normal = (float3){object[15], object[16], object[17]};
+    normal = get_normal(object, ray.pos);
 
     switch(material)
     {
@@ -506,6 +1283,216 @@ kernel void trace(global void* general_data,
   frame_c[id] = frag_i;*/
 }
 
+/**
+ * Main kernel function, one work-item per pixel.
+ */
+kernel void trace(global void* general_data,
+                  global float* objects,
+                  global float* octree,
+                  global float* aux_buffer,
+                  global uint* frame_c,
+                  global float4* frame_f,
+                  global float* samples,
+                  global PRNG* prng,
+                  global float* depth,
+                  global uint* sampler_tables PAGING_ARG COUNTERS_ARG)
+{
+  global int* data_i = (global int*)general_data;
+  const int pos_x = get_global_id(0);
+  const int pos_y = get_global_id(1);
+
+  /* The global size is rounded up to the local size */
+  if(pos_x >= data_i[14] || pos_y >= data_i[15])
+    return;
+
+  trace_pixel(general_data,
+              objects,
+              octree,
+              aux_buffer,
+              frame_c,
+              frame_f,
+              samples,
+              prng,
+              depth,
+              sampler_tables,
+#ifdef PAGING
+              paging,
+              pending,
+#endif
+#ifdef INSTRUMENT
+              counters,
+#endif
+              pos_x,
+              pos_y);
+}
+
+/**
+ * Inverse of the Morton code of *code*: the even bits give x,
+ * the odd bits y.
+ */
+uint2 morton_decode(uint code)
+{
+  uint2 pos = (uint2){code, code >> 1} & 0x55555555u;
+  pos = (pos | (pos >> 1)) & 0x33333333u;
+  pos = (pos | (pos >> 2)) & 0x0F0F0F0Fu;
+  pos = (pos | (pos >> 4)) & 0x00FF00FFu;
+  pos = (pos | (pos >> 8)) & 0x0000FFFFu;
+  return pos;
+}
+
+/**
+ * Persistent threads variant of trace. The host launches only about as
+ * many work-groups as the device runs at once. Every group pulls
+ * PERSISTENT_TILE x PERSISTENT_TILE tiles from *counter* (zeroed by the host
+ * before every launch) until the frame is done, so groups that got cheap
+ * tiles take over the rest instead of idling. Tiles are handed out in
+ * Morton order, neighbouring tiles are traced close in time.
+ */
+kernel void trace_persistent(global void* general_data,
+                             global float* objects,
+                             global float* octree,
+                             global float* aux_buffer,
+                             global uint* frame_c,
+                             global float4* frame_f,
+                             global float* samples,
+                             global PRNG* prng,
+                             global float* depth,
+                             global uint* sampler_tables,
+                             global uint* counter PAGING_ARG COUNTERS_ARG)
+{
+  global int* data_i = (global int*)general_data;
+  const uint size_w = data_i[14];
+  const uint size_h = data_i[15];
+
+  const uint tiles_x = (size_w + PERSISTENT_TILE - 1) / PERSISTENT_TILE;
+  const uint tiles_y = (size_h + PERSISTENT_TILE - 1) / PERSISTENT_TILE;
+  /* Morton codes cover a power of two square */
+  uint side = 1;
+  while(side < max(tiles_x, tiles_y))
+    side *= 2;
+  const uint tile_count = side * side;
+
+  local uint next;
+  const uint lid = get_local_id(0);
+  while(true)
+  {
+    if(lid == 0)
+      next = atomic_inc(counter);
+    barrier(CLK_LOCAL_MEM_FENCE);
+    const uint code = next;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if(code >= tile_count)
+      return;
+
+    const uint2 tile = morton_decode(code);
+    if(tile.x >= tiles_x || tile.y >= tiles_y)
+      continue;
+
+    for(uint p = lid; p < PERSISTENT_TILE * PERSISTENT_TILE;
+        p += get_local_size(0))
+    {
+      const uint x = tile.x * PERSISTENT_TILE + p % PERSISTENT_TILE;
+      const uint y = tile.y * PERSISTENT_TILE + p / PERSISTENT_TILE;
+      if(x < size_w && y < size_h)
+        trace_pixel(general_data,
+                    objects,
+                    octree,
+                    aux_buffer,
+                    frame_c,
+                    frame_f,
+                    samples,
+                    prng,
+                    depth,
+                    sampler_tables,
+#ifdef PAGING
+                    paging,
+                    pending,
+#endif
+#ifdef INSTRUMENT
+                    counters,
+#endif
+                    (int)x,
+                    (int)y);
+    }
+  }
+}
+
+/**
+ * Temporal reprojection after a camera move.
+ * general_data holds the new camera, prev_data the one *history* and
+ * *prev_depth* were accumulated with. The primary hit of every new pixel is
+ * looked up in the previous frame, and if the previous camera saw the same
+ * surface there its accumulation is kept. The kept weight is clamped to
+ * MAX_HISTORY samples, so new samples quickly outweigh stale ones.
+ */
+kernel void reproject(global void* general_data,
+                      global void* prev_data,
+                      global float* objects,
+                      global float* octree,
+                      global float4* history,
+                      global float* prev_depth,
+                      global float4* frame_f,
+                      global float* depth PAGING_ARG)
+{
+  global float* data_f = (global float*)general_data;
+  global float* prev_f = (global float*)prev_data;
+  global int* data_i = (global int*)general_data;
+
+  const int size_w = data_i[14];
+  const int size_h = data_i[15];
+  const int pos_x = get_global_id(0);
+  const int pos_y = get_global_id(1);
+  if(pos_x >= size_w || pos_y >= size_h)
+    return;
+  const int id = pos_y * size_w + pos_x;
+
+  Ray ray;
+  ray.pos = (float3){data_f[2], data_f[3], data_f[4]};
+  ray.dir = camera_dir(data_f, (float)pos_x, (float)pos_y);
+
+  Intersection intersection;
+  intersection.object = 0;
+  intersection.dist = INFINITY;
+#ifdef PAGING
+  intersection.paging = paging;
+  intersection.missing = INFINITY;
+#endif
+#ifdef INSTRUMENT
+  intersection.counters = (uint4)(0);
+#endif
+  run_trace(ray, objects, octree, &intersection);
+#ifdef PAGING
+  /* Without the closest hit there is nothing to match, drop the history */
+  if(intersection.missing < intersection.dist)
+    intersection.object = 0;
+#endif
+  depth[id] = intersection.dist;
+
+  float4 result = (float4){0.0f, 0.0f, 0.0f, 0.0f};
+  float2 screen;
+  if(intersection.object != 0 &&
+     camera_project(prev_f, intersection.pos, &screen))
+  {
+    int prev_x = (int)round(screen.x);
+    int prev_y = (int)round(screen.y);
+    if(prev_x >= 0 && prev_x < size_w && prev_y >= 0 && prev_y < size_h)
+    {
+      int prev_id = prev_y * size_w + prev_x;
+      float3 prev_eye = (float3){prev_f[2], prev_f[3], prev_f[4]};
+      float expected = distance(prev_eye, intersection.pos);
+      /* Disocclusions fail the depth test and start over */
+      if(fabs(prev_depth[prev_id] - expected) < 0.05f * expected + 0.01f)
+      {
+        result = history[prev_id];
+        if(result.w > MAX_HISTORY)
+          result *= MAX_HISTORY / result.w;
+      }
+    }
+  }
+  frame_f[id] = result;
+}
+
 
   /*
     float3 d;
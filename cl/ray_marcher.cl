@@ -55,11 +55,33 @@ float getRadius(global float* vertex)
 
 
 constant int vertex_size = 3*sizeof(float);
-constant float min_dist = 0.1f;
 constant float max_dist = 500.0f;
 constant int max_steps = 100;
 
+/**
+ * A ray hits once the distance estimate drops below the footprint of its
+ * pixel at the current distance, times footprint_scale. min_dist is the
+ * floor for rays that hit right in front of the eye.
+ */
+constant float min_dist = 0.0001f;
+constant float footprint_scale = 0.5f;
+
+/**
+ * The cone pre-pass marches one cone per block of CONE_BLOCK x CONE_BLOCK
+ * pixels, see cone_march.
+ */
+#ifndef CONE_BLOCK
+#define CONE_BLOCK 8
+#endif
+
+/**
+ * Every iteration of the fractal resolves detail about 1/scale the size of
+ * the previous one. Past the pixel footprint more iterations only cost
+ * time, so their number is picked per evaluation, see lodIterations.
+ */
+constant int min_iterations = 4;
 constant int max_iterations = 100;
+constant float fractal_extent = 2.0f * 20.0f; // 2 * foldingLimit
 constant float scale = 20.0f;
 constant float fixedRadius2 = 10.0f;
 constant float minRadius2 = 5.0f;
@@ -89,11 +111,21 @@ float3 boxFold(float3 z)
 	return(clamp(z, -foldingLimit, foldingLimit) * 2.0f - z);
 }
 
-float estimateMandelbox(float3 z)
+/**
+ * Iterations needed to resolve detail of size *footprint*.
+ */
+int lodIterations(float footprint)
+{
+	float levels = log(fractal_extent / max(footprint, min_dist)) /
+	               log(fabs(scale));
+	return clamp((int)ceil(levels) + 2, min_iterations, max_iterations);
+}
+
+float estimateMandelbox(float3 z, int iterations)
 {
 	float3 offset = z;
 	float dr = 1.0f;
-	for(int n=0; n<max_iterations; n++)
+	for(int n=0; n<iterations; n++)
 	{
 		z = boxFold(z);         // Reflect
 		z = sphereFold(z, &dr);    // Sphere Inversion
@@ -149,14 +181,19 @@ float estimateSphere(private float3 eyePos, global uchar* object)
 
 /**
  * Returns estimated min-dist one can move forward
+ * @param footprint - Size of a pixel at eyePos, limits the fractal detail
  */
 private float estimateDist
 (
     private float3 eyePos,
+    private float footprint,
     global uchar* objects,
     global int* offsets
 )
 {
+#ifdef MANDELBOX
+    return estimateMandelbox(eyePos, lodIterations(footprint));
+#else
     private int offset;
     global uchar* object;
     private uchar type;
@@ -184,34 +221,135 @@ private float estimateDist
         }
     }
     return dist;
+#endif
 }
 
 /**
- * Returns the number of steps for the given ray, until min_dist is reached
+ * Returns the number of steps for the given ray, until it is closer to a
+ * surface than the footprint of its pixel
+ * @param start - Distance along the ray known to be empty, see cone_march
+ * @param pixelTan - Size of a pixel at distance 1
  */
 int march
 (
     private float3 eyePos,
     private float3 eyeDir, //normalized
+    private float start,
+    private float pixelTan,
     global uchar* objects,
     global int* offsets
 )
 {
     private float s = max_dist;
+    private float t = start;
+    private float footprint = max(min_dist, t * pixelTan);
     private int itr;
       
-    for(itr = 0; s > min_dist && itr < max_steps; itr++)
+    for(itr = 0; s > footprint_scale * footprint && itr < max_steps; itr++)
     {
-        s = estimateDist(eyePos, objects, offsets);
-        //s = estimateMandelbox(eyePos);
-        eyePos += s*eyeDir;
-        if(s >= max_dist) 
+        s = estimateDist(eyePos + t*eyeDir, footprint, objects, offsets);
+        t += s;
+        footprint = max(min_dist, t * pixelTan);
+        if(s >= max_dist || t >= max_dist) 
             itr = max_steps;
     }
     
     return itr;
 }
 
+/**
+ * Direction of the ray through the (fractional) pixel (x, y).
+ */
+float3 pixelDir(global float* fov, float x, float y)
+{
+    private float fovy = fov[0];
+    private float aspect = fov[1];
+    
+    private float3 eyeDir = (float3){ fov[5], fov[6], fov[7] };
+    private float3 eyeUp = (float3){ fov[8], fov[9], fov[10] };
+    private float3 eyeLeft = (float3){ fov[11], fov[12], fov[13] };
+    private int size_x = ((int*)(fov+14))[0];
+    private int size_y = ((int*)(fov+14))[1];
+    
+    //x on screen == x in coordsystem
+    private float rel_x = (2.0f * x / (float)size_x) - 1.0f;
+    //y on screen goes down, y in coordsys goes up -> invert
+    private float rel_y = (2.0f * -y / (float)size_y) + 1.0f;
+    
+    float max_u = tan(fovy/2.0f);
+    float max_r = max_u*aspect;
+    
+    eyeDir += (rel_y*max_u*eyeUp - rel_x*max_r*eyeLeft);
+    return normalize(eyeDir);
+}
+
+/**
+ * Size of a pixel at distance 1 from the eye.
+ */
+float pixelTan(global float* fov)
+{
+    private int size_y = ((int*)(fov+14))[1];
+    return 2.0f * tan(fov[0]/2.0f) / (float)size_y;
+}
+
+/*
+fov should be an array of floats:
+fovy, aspect, 
+posx, posy, posz,
+dirx, diry, dirz,
+upx, upy, upz,
+leftx, lefty, leftz,
+size_x, size_y <-- OMG IT'S TWO INTS!!
+*/
+    
+/**
+ * Coarse pre-pass: marches one cone through the centre of every block of
+ * CONE_BLOCK x CONE_BLOCK pixels, wide enough to contain all of their rays.
+ * The cone stops as soon as a surface may intersect it, everything in
+ * front of that is empty for every pixel of the block.
+ * coneBuf :: float[ceil(size_x / CONE_BLOCK) * ceil(size_y / CONE_BLOCK)]
+ */
+kernel void cone_march
+(
+    global float* fov,
+    global uchar* objects,
+    global int* offsets,
+    global float* coneBuf
+)
+{
+    const int id = get_global_id(0);
+    private int size_x = ((int*)(fov+14))[0];
+    private int size_y = ((int*)(fov+14))[1];
+    private int blocks_x = (size_x + CONE_BLOCK - 1) / CONE_BLOCK;
+    private int blocks_y = (size_y + CONE_BLOCK - 1) / CONE_BLOCK;
+    if(id >= blocks_x * blocks_y)
+        return;
+
+    private float centre_x = ((float)(id % blocks_x) + 0.5f) * CONE_BLOCK;
+    private float centre_y = ((float)(id / blocks_x) + 0.5f) * CONE_BLOCK;
+    private float3 eyePos = (float3){ fov[2], fov[3], fov[4] };
+    private float3 eyeDir = pixelDir(fov, centre_x, centre_y);
+    private float pixel = pixelTan(fov);
+    /* Half the block diagonal, plus the half pixel of the outermost rays */
+    private float coneTan = pixel * (0.7072f * CONE_BLOCK + 0.5f);
+
+    private float t = 0.0f;
+    private float safe = 0.0f;
+    for(int itr = 0; itr < max_steps && t < max_dist; itr++)
+    {
+        float s = estimateDist(eyePos + t*eyeDir,
+                               max(min_dist, t * coneTan),
+                               objects,
+                               offsets);
+        if(s < t * coneTan)
+            break; // the cone may touch a surface from here on
+        safe = t;
+        t += s;
+    }
+
+    coneBuf[id] = safe;
+}
+
 /*
 fov should be an array of floats:
 fovy, aspect, 
@@ -230,43 +368,29 @@ kernel void trace //main
     global int* offsets,
     global uchar* frameBuf,
     global float* depthBuf,
-    global char* lights
+    global char* lights,
+    global float* coneBuf
 )
 {
     const int id = *startID + get_global_id(0);
         
-    private float fovy = fov[0];
-    private float aspect = fov[1];
-    
     private float3 eyePos = (float3){ fov[2], fov[3], fov[4] };
-    private float3 eyeDir = (float3){ fov[5], fov[6], fov[7] };
-    private float3 eyeUp = (float3){ fov[8], fov[9], fov[10] };
-    private float3 eyeLeft = (float3){ fov[11], fov[12], fov[13] };
     private int size_x = ((int*)(fov+14))[0];
-    private int size_y = ((int*)(fov+14))[1];
     //don't. think. about. it.
     private int pos_x = id % size_x;
     private int pos_y = id / size_x;
-    
-    //x on screen == x in coordsystem
-    private float rel_x = (2.0f * (float)pos_x / (float)size_x) - 1.0f;
-    //y on screen goes down, y in coordsys goes up -> invert
-    private float rel_y = (2.0f * (float)-pos_y / (float)size_y) + 1.0f;
-    
-    float max_u = tan(fovy/2.0f);
-    float max_r = max_u*aspect;
-    
-    eyeDir += (rel_y*max_u*eyeUp - rel_x*max_r*eyeLeft);
-    eyeDir = normalize(eyeDir);
+    private int blocks_x = (size_x + CONE_BLOCK - 1) / CONE_BLOCK;
+
+    private float3 eyeDir = pixelDir(fov, (float)pos_x, (float)pos_y);
     
     /* DONE COMPUTING EYEDIR */
 
     private int steps = 0;
-    private float depth = depthBuf[id];
-    private float res[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+    private float start =
+        coneBuf[(pos_y / CONE_BLOCK) * blocks_x + pos_x / CONE_BLOCK];
 
     //------------------------------------------------------------------------//
-      steps = march(eyePos, eyeDir, objects, offsets);
+      steps = march(eyePos, eyeDir, start, pixelTan(fov), objects, offsets);
     //------------------------------------------------------------------------//
     
     frameBuf[id] = (uchar)floor((255.1f*(float)steps)/(float)max_steps);
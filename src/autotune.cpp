@@ -0,0 +1,81 @@
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <sys/stat.h>
+
+#include "autotune.hpp"
+#include "file.hpp"
+
+using namespace std;
+
+WorkGroupTuner::WorkGroupTuner(string const& p) : path(p)
+{
+  ifstream file(path);
+  string line;
+  while(getline(file, line))
+  {
+    stringstream fields(line);
+    LocalSize size;
+    string key;
+    if(fields >> size.x >> size.y >> size.ms && getline(fields >> ws, key))
+      table[key] = size;
+  }
+}
+
+string WorkGroupTuner::key(string const& device,
+                           string const& kernel,
+                           unsigned int width,
+                           unsigned int height)
+{
+  return device + " | " + kernel + " | " + to_string(width) + "x" +
+         to_string(height);
+}
+
+bool WorkGroupTuner::lookup(string const& key, LocalSize& size) const
+{
+  auto entry = table.find(key);
+  if(entry == table.end())
+    return false;
+  size = entry->second;
+  return true;
+}
+
+void WorkGroupTuner::store(string const& key, LocalSize const& size)
+{
+  table[key] = size;
+
+  stringstream lines;
+  for(auto i = table.begin(); i != table.end(); i++)
+    lines << i->second.x << " " << i->second.y << " " << i->second.ms << " "
+          << i->first << "\n";
+  string const text = lines.str();
+
+  /* Workers may tune at once, the last one to finish wins */
+  mkdir(KERNEL_CACHE_DIR, 0755);
+  if(!write_atomically(path, [&](int fd) {
+       return write_all(fd, text.data(), text.size());
+     }))
+    cerr << "[WorkGroupTuner] Could not write " << path << endl;
+}
+
+vector<LocalSize> WorkGroupTuner::candidates(OpenCL::KernelResources const& res,
+                                             unsigned int width,
+                                             unsigned int height)
+{
+  vector<LocalSize> sizes;
+  sizes.push_back({0, 0, INFINITY});
+
+  size_t const multiple =
+      res.preferred_multiple > 0 ? res.preferred_multiple : 1;
+  for(size_t x = 1; x <= 64 && x <= width; x *= 2)
+    for(size_t y = 1; y <= 64 && y <= height; y *= 2)
+    {
+      size_t const items = x * y;
+      if(items <= res.work_group_size && items % multiple == 0)
+        sizes.push_back({x, y, INFINITY});
+    }
+  return sizes;
+}
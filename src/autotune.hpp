@@ -0,0 +1,63 @@
+#ifndef __AUTOTUNE_H__
+#define __AUTOTUNE_H__
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "cl.hpp"
+
+#define WORK_GROUP_CACHE KERNEL_CACHE_DIR "/work_groups.txt"
+
+struct LocalSize
+{
+  size_t x;
+  size_t y;
+  /** Kernel time of a probe sample **/
+  float ms;
+};
+
+/**
+ * Persisted table of the fastest local sizes, per device, kernel variant
+ * and resolution.
+ * File format, one line per entry: x y ms key
+ */
+class WorkGroupTuner
+{
+private:
+  std::string const path;
+  std::map<std::string, LocalSize> table;
+
+public:
+  /**
+   * Loads the table from *path*, a missing file is an empty table.
+   */
+  WorkGroupTuner(std::string const& path = WORK_GROUP_CACHE);
+  virtual ~WorkGroupTuner(void) {}
+
+  static std::string key(std::string const& device,
+                         std::string const& kernel,
+                         unsigned int width,
+                         unsigned int height);
+
+  /**
+   * @return false if *key* hasn't been tuned yet
+   */
+  bool lookup(std::string const& key, LocalSize& size) const;
+
+  /**
+   * Adds or replaces an entry and writes the table back.
+   */
+  void store(std::string const& key, LocalSize const& size);
+
+  /**
+   * Two-dimensional local sizes worth probing: powers of two within the
+   * work-group limit of the kernel, whole multiples of its preferred
+   * multiple. The first one, 0 x 0, is the driver's choice.
+   */
+  static std::vector<LocalSize> candidates(OpenCL::KernelResources const& res,
+                                           unsigned int width,
+                                           unsigned int height);
+};
+
+#endif
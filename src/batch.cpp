@@ -0,0 +1,346 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <glm/gtc/constants.hpp>
+
+#include "autotune.hpp"
+#include "batch.hpp"
+#include "image.hpp"
+#include "scene_cache.hpp"
+
+/** Suffix of job files in a queue directory **/
+#define JOB_SUFFIX ".job"
+/** Milliseconds between two scans of a watched, empty directory **/
+#define WATCH_INTERVAL_MS 1000
+
+using namespace std;
+using namespace OpenCL;
+
+namespace Batch
+{
+
+bool parse_job(string const& line, Job& job)
+{
+  istringstream fields(line);
+  float degrees;
+  Sequence::Keyframe& v = job.view;
+  if(!(fields >> job.scene >> v.pos.x >> v.pos.y >> v.pos.z >> v.dir.x >>
+       v.dir.y >> v.dir.z >> degrees >> job.width >> job.height >>
+       job.samples >> job.output) ||
+     glm::length(v.dir) <= 0.0f || job.width == 0 || job.height == 0 ||
+     job.samples == 0)
+    return false;
+  v.time = 0.0f;
+  v.dir = glm::normalize(v.dir);
+  v.fov = glm::radians(degrees);
+  return true;
+}
+
+Queue::Queue(string const& source, bool watch_)
+    : directory(source == "-" ? "" : source), watch(watch_),
+      file_failed(false), rejected_lines(0)
+{
+}
+
+Queue::~Queue(void) { close_file(); }
+
+bool Queue::read_line(string const& line)
+{
+  if(line.empty() || line[0] == '#')
+    return false;
+
+  Job job;
+  if(!parse_job(line, job))
+  {
+    cerr << "[Batch] Skipping malformed job \"" << line << "\"." << endl;
+    rejected_lines++;
+    file_failed = true;
+    return false;
+  }
+  jobs.push_back(job);
+  return true;
+}
+
+void Queue::close_file(void)
+{
+  if(file.empty())
+    return;
+  string const path = directory + "/" + file;
+  string const done = path + (file_failed ? ".failed" : ".done");
+  if(rename(path.c_str(), done.c_str()) != 0)
+    cerr << "[Batch] Could not rename " << path << "." << endl;
+  file.clear();
+}
+
+/**
+ * Takes the first job file of the directory, in name order.
+ * @return false if there is none
+ */
+bool Queue::open_file(void)
+{
+  DIR* dir = opendir(directory.c_str());
+  if(dir == nullptr)
+  {
+    cerr << "[Batch] Could not open " << directory << "." << endl;
+    return false;
+  }
+
+  vector<string> names;
+  string const suffix(JOB_SUFFIX);
+  while(dirent* entry = readdir(dir))
+  {
+    string const name(entry->d_name);
+    if(name.size() > suffix.size() &&
+       name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0)
+      names.push_back(name);
+  }
+  closedir(dir);
+  if(names.empty())
+    return false;
+
+  file = *min_element(names.begin(), names.end());
+  file_failed = false;
+  ifstream in(directory + "/" + file);
+  string line;
+  while(getline(in, line))
+    read_line(line);
+  return true;
+}
+
+bool Queue::next(Job& job)
+{
+  while(jobs.empty())
+  {
+    if(directory.empty())
+    {
+      string line;
+      if(!getline(cin, line))
+        return false;
+      read_line(line);
+      continue;
+    }
+
+    close_file();
+    if(open_file())
+      continue;
+    if(!watch)
+      return false;
+    this_thread::sleep_for(chrono::milliseconds(WATCH_INTERVAL_MS));
+  }
+
+  job = jobs.front();
+  jobs.pop_front();
+  return true;
+}
+
+void Queue::report(bool ok)
+{
+  if(!ok)
+    file_failed = true;
+}
+
+/**
+ * Identifies the data of a scene cache by the checksums of its sections,
+ * which the header carries.
+ */
+__attribute__((const)) static uint64_t data_key(uint64_t surf_checksum,
+                                                uint64_t lamp_checksum,
+                                                uint64_t octree_checksum,
+                                                unsigned int lamp_float_index)
+{
+  uint64_t const parts[4] = {
+      surf_checksum, lamp_checksum, octree_checksum, lamp_float_index};
+  return checksum(parts, sizeof(parts));
+}
+
+/**
+ * Device, inode, size and modification time of the file at *path*. A
+ * stored scene cache is renamed into place, so a new one differs.
+ */
+static string file_identity(string const& path)
+{
+  struct stat st;
+  if(stat(path.c_str(), &st) != 0)
+    return "";
+  return to_string(st.st_dev) + ":" + to_string(st.st_ino) + ":" +
+         to_string(st.st_size) + ":" + to_string(st.st_mtime);
+}
+
+/**
+ * The scene *name* of a job: the built-in one, or mapped into *cache*
+ * unless that file is mapped already. A file that was replaced since it
+ * was mapped is mapped again.
+ * @return false if the scene cache can't be loaded
+ */
+static bool open_scene(string const& name,
+                       SceneData const& builtin,
+                       unique_ptr<SceneCache>& cache,
+                       string& cache_file,
+                       SceneData& scene)
+{
+  if(name == "-")
+  {
+    scene.obj.surf_count = builtin.obj.surf_count;
+    scene.obj.lamp_count = builtin.obj.lamp_count;
+    scene.obj.surf_float_index = builtin.obj.surf_float_index;
+    scene.obj.lamp_float_index = builtin.obj.lamp_float_index;
+    scene.surfaces = builtin.surfaces;
+    scene.lamps = builtin.lamps;
+    scene.octree = builtin.octree;
+    scene.octree_size = builtin.octree_size;
+    scene.key = builtin.key;
+    return true;
+  }
+
+  string const file = name + "@" + file_identity(name);
+  if(cache_file != file)
+  {
+    cache_file.clear();
+    cache.reset(new SceneCache());
+    if(!cache->load(name, builtin.obj.max_count))
+      return false;
+    cache_file = file;
+  }
+
+  SceneCacheHeader const& h = cache->header();
+  scene.obj.surf_count = h.surf_count;
+  scene.obj.lamp_count = h.lamp_count;
+  scene.obj.surf_float_index = h.surf_count * PRIM_SIZE;
+  scene.obj.lamp_float_index = h.lamp_float_index;
+  scene.surfaces = cache->surfaces();
+  scene.lamps = cache->lamps();
+  scene.octree = cache->octree();
+  scene.octree_size = h.octree_size;
+  scene.key = data_key(
+      h.surf_checksum, h.lamp_checksum, h.octree_checksum, h.lamp_float_index);
+  return true;
+}
+
+int run(Environment const& env,
+        Queue& queue,
+        Settings const& settings,
+        SceneData const& builtin)
+{
+  unique_ptr<Renderer> renderer;
+  /** Buffer sizes of the renderer, only ever grown **/
+  unsigned int max_w = 0;
+  unsigned int max_h = 0;
+  unsigned int max_octree = 0;
+
+  unique_ptr<SceneCache> cache;
+  /** Path and file_identity of the mapped cache **/
+  string cache_file;
+  /**
+   * Key of the scene in the renderer: an edited scene is uploaded again,
+   * the same data under another name is not
+   */
+  uint64_t uploaded = 0;
+  bool has_scene = false;
+  WorkGroupTuner tuner;
+  string tuned;
+
+  unsigned int jobs = 0;
+  unsigned int failures = 0;
+  unsigned int renderers = 0;
+  auto const begin = chrono::steady_clock::now();
+  Job job;
+  while(queue.next(job))
+  {
+    auto const job_begin = chrono::steady_clock::now();
+    jobs++;
+
+    SceneData scene = builtin;
+    if(!open_scene(job.scene, builtin, cache, cache_file, scene))
+    {
+      cerr << "[Batch] Could not load the scene of " << job.output << "."
+           << endl;
+      failures++;
+      queue.report(false);
+      continue;
+    }
+
+    if(!renderer || !renderer->fits(job.width,
+                                    job.height,
+                                    scene.obj.max_count,
+                                    scene.octree_size))
+    {
+      max_w = max(max_w, job.width);
+      max_h = max(max_h, job.height);
+      max_octree = max(max_octree, scene.octree_size);
+      renderer.reset(); // release the buffers first
+      renderer.reset(new Renderer(env,
+                                  max_w,
+                                  max_h,
+                                  scene.obj.max_count,
+                                  max_octree,
+                                  settings.max_bounces,
+                                  settings.fast_math));
+      renderer->set_sampler(settings.sampler);
+      renderer->set_persistent(settings.persistent);
+      has_scene = false;
+      renderers++;
+    }
+
+    if(!has_scene || uploaded != scene.key)
+    {
+      renderer->upload_scene(scene.obj,
+                             scene.surfaces,
+                             scene.lamps,
+                             scene.octree,
+                             scene.octree_size,
+                             scene.key);
+      uploaded = scene.key;
+      has_scene = true;
+      tuned.clear();
+    }
+
+    renderer->set_resolution(job.width, job.height);
+    string const resolution =
+        to_string(job.width) + "x" + to_string(job.height);
+    if(tuned != resolution)
+    {
+      renderer->tune(tuner, settings.tune);
+      tuned = resolution;
+    }
+
+    renderer->seed(settings.seed);
+    renderer->set_camera(Sequence::camera_at({job.view}, 0.0f));
+    for(unsigned int s = 0; s < job.samples; s++)
+      renderer->render();
+
+    vector<float> rgbw((size_t)job.width * job.height * 4);
+    renderer->read_accumulation(rgbw.data());
+    bool const ok =
+        write_png(job.output, resolve(rgbw.data(), job.width, job.height));
+    if(!ok)
+    {
+      cerr << "[Batch] Could not write " << job.output << "." << endl;
+      failures++;
+    }
+    queue.report(ok);
+
+    cout << "[Batch] " << job.output << ": " << job.width << "x"
+         << job.height << ", " << job.samples << " samples in "
+         << chrono::duration<double>(chrono::steady_clock::now() - job_begin)
+                .count()
+         << " s" << endl;
+  }
+
+  double const seconds =
+      chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+  cout << "[Batch] " << jobs << " jobs in " << seconds << " s on "
+       << renderers << " renderers, " << failures << " failed, "
+       << queue.rejected() << " malformed" << endl;
+  return failures > 0 || queue.rejected() > 0 ? 1 : 0;
+}
+}
@@ -0,0 +1,125 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include <cstdint>
+#include <deque>
+#include <string>
+
+#include "cl.hpp"
+#include "renderer.hpp"
+#include "sequence.hpp"
+
+namespace Batch
+{
+
+/**
+ * One still image of a batch.
+ */
+struct Job
+{
+  /** Scene cache file (see SceneCache), "-" for the built-in scene **/
+  std::string scene;
+  /** Only pos, dir and fov are used **/
+  Sequence::Keyframe view;
+  unsigned int width;
+  unsigned int height;
+  unsigned int samples;
+  std::string output;
+};
+
+/**
+ * Reads a job from a plain line
+ * "scene px py pz dx dy dz fov width height samples output", the field of
+ * view in degrees.
+ * @return false if the line is malformed
+ */
+bool parse_job(std::string const& line, Job& job);
+
+/**
+ * Jobs read from stdin, one per line, or from the *.job files of a
+ * directory in name order. A file is renamed to .done once all of its jobs
+ * rendered, to .failed otherwise. Lines starting with '#' are comments.
+ */
+class Queue
+{
+private:
+  /** Empty for stdin **/
+  std::string const directory;
+  bool const watch;
+  /** The rest of the current file **/
+  std::deque<Job> jobs;
+  std::string file;
+  bool file_failed;
+  unsigned int rejected_lines;
+
+  bool read_line(std::string const& line);
+  void close_file(void);
+  bool open_file(void);
+
+public:
+  /**
+   * @param source - A directory, or "-" for stdin
+   * @param watch - Wait for new files when the directory is empty
+   */
+  Queue(std::string const& source, bool watch);
+  virtual ~Queue(void);
+
+  /**
+   * Blocks until there is a job.
+   * @return false when there are no more
+   */
+  bool next(Job& job);
+
+  /**
+   * Result of the job last returned by next.
+   */
+  void report(bool ok);
+
+  /** Malformed lines that were skipped **/
+  unsigned int rejected(void) const { return rejected_lines; }
+};
+
+/**
+ * A scene as Renderer::upload_scene takes it.
+ */
+struct SceneData
+{
+  ObjectsBuffer obj;
+  float const* surfaces;
+  float const* lamps;
+  float const* octree;
+  unsigned int octree_size;
+  /** Identifies the data, see Renderer::upload_scene **/
+  uint64_t key;
+};
+
+/**
+ * What every renderer of a batch is set up with.
+ */
+struct Settings
+{
+  unsigned int max_bounces;
+  bool fast_math;
+  unsigned int sampler;
+  bool persistent;
+  /** Probe work-group sizes that haven't been tuned yet **/
+  bool tune;
+  /** Seed of every job, so a job renders the same whenever it runs **/
+  uint64_t seed;
+};
+
+/**
+ * Renders the jobs of *queue* on one device context. The renderer, with
+ * its compiled kernels and buffers, is kept while the jobs fit into it and
+ * only grown when one doesn't. A scene is only uploaded when it differs
+ * from the one of the last job.
+ * @param builtin - The scene of jobs with scene "-"
+ * @return The exit status: nonzero if a job failed
+ */
+int run(OpenCL::Environment const& env,
+        Queue& queue,
+        Settings const& settings,
+        SceneData const& builtin);
+}
+
+#endif
@@ -0,0 +1,90 @@
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include "checkpoint.hpp"
+#include "file.hpp"
+#include "scene_cache.hpp"
+
+using namespace std;
+
+namespace Checkpoint
+{
+
+bool save(string const& path, RenderState const& state, uint64_t job)
+{
+  size_t const data_bytes = state.rgbw.size() * sizeof(float);
+
+  CheckpointHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+  h.version = CHECKPOINT_VERSION;
+  h.width = state.width;
+  h.height = state.height;
+  h.scramble = state.scramble;
+  h.samples = state.samples;
+  h.first_sample = state.first_sample;
+  h.key = state.key;
+  h.job = job;
+  memcpy(h.prng, state.prng, sizeof(h.prng));
+  h.data_checksum = checksum(state.rgbw.data(), data_bytes);
+  h.header_checksum = checksum(&h, offsetof(CheckpointHeader, header_checksum));
+
+  if(!write_atomically(path, [&](int fd) {
+       return write_all(fd, &h, sizeof(h)) &&
+              write_all(fd, state.rgbw.data(), data_bytes);
+     }))
+  {
+    cerr << "[Checkpoint] Could not write " << path << "." << endl;
+    return false;
+  }
+  return true;
+}
+
+bool load(string const& path, uint64_t job, RenderState& state)
+{
+  ifstream file(path.c_str(), ifstream::binary);
+  if(!file.is_open())
+    return false;
+
+  CheckpointHeader h;
+  string reason;
+  if(!file.read((char*)&h, sizeof(h)))
+    reason = "truncated";
+  else if(memcmp(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic)) != 0 ||
+          h.version != CHECKPOINT_VERSION)
+    reason = "unknown format";
+  else if(h.header_checksum !=
+          checksum(&h, offsetof(CheckpointHeader, header_checksum)))
+    reason = "header checksum mismatch";
+  else if(h.job != job)
+    reason = "saved for another job";
+
+  if(reason.empty())
+  {
+    state.rgbw.resize((size_t)h.width * h.height * 4);
+    size_t const data_bytes = state.rgbw.size() * sizeof(float);
+    if(!file.read((char*)state.rgbw.data(), (streamsize)data_bytes))
+      reason = "truncated";
+    else if(checksum(state.rgbw.data(), data_bytes) != h.data_checksum)
+      reason = "checksum mismatch";
+  }
+
+  if(!reason.empty())
+  {
+    cerr << "[Checkpoint] Ignoring " << path << ": " << reason << "."
+         << endl;
+    return false;
+  }
+
+  state.key = h.key;
+  state.width = h.width;
+  state.height = h.height;
+  state.samples = h.samples;
+  state.first_sample = h.first_sample;
+  memcpy(state.prng, h.prng, sizeof(state.prng));
+  state.scramble = h.scramble;
+  return true;
+}
+}
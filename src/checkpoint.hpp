@@ -0,0 +1,55 @@
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+#include <cstdint>
+#include <string>
+
+#include "renderer.hpp"
+
+#define CHECKPOINT_MAGIC "HBCHKPT"
+#define CHECKPOINT_VERSION 1
+
+/**
+ * A saved RenderState, so a long render survives the process.
+ *
+ * header
+ * rgbw :: (width * height * 4) floats
+ */
+struct CheckpointHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint32_t scramble;
+  float samples;
+  float first_sample;
+  /** RenderState::key **/
+  uint64_t key;
+  /** Chosen by the caller, e.g. the sample range of a worker **/
+  uint64_t job;
+  uint64_t prng[17];
+
+  uint64_t data_checksum;
+  /** Over all of the above **/
+  uint64_t header_checksum;
+};
+
+namespace Checkpoint
+{
+
+/**
+ * Writes *state* to *path*, replacing the file atomically: a crash leaves
+ * either the old or the new checkpoint.
+ * @return false on I/O errors
+ */
+bool save(std::string const& path, RenderState const& state, uint64_t job);
+
+/**
+ * Reads the checkpoint at *path* if it was saved for *job*.
+ * @return false if the file is missing, of another job or corrupt
+ */
+bool load(std::string const& path, uint64_t job, RenderState& state);
+}
+
+#endif
@@ -1,8 +1,19 @@
 #include "cl.hpp"
+#include "file.hpp"
 
+#include <algorithm>
 #include <iostream>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+#include <sys/stat.h>
 
 using namespace std;
 
@@ -118,6 +129,60 @@ void OpenCLException::print(void)
 /******************************************************************************/
 /******************************************************************************/
 
+MemoryTracker::MemoryTracker(size_t global, size_t max_allocation)
+    : global_size(global), max_alloc(max_allocation), total{0, 0, 0}
+{
+}
+
+void MemoryTracker::add(string const& role, size_t bytes)
+{
+  Usage& u = roles[role];
+  u.live += bytes;
+  u.peak = max(u.peak, u.live);
+  u.buffers++;
+
+  total.live += bytes;
+  total.peak = max(total.peak, total.live);
+  total.buffers++;
+}
+
+void MemoryTracker::remove(string const& role, size_t bytes)
+{
+  Usage& u = roles[role];
+  u.live -= bytes;
+  u.buffers--;
+
+  total.live -= bytes;
+  total.buffers--;
+}
+
+__attribute__((pure)) size_t MemoryTracker::budget(void) const
+{
+  return total.live < global_size ? global_size - total.live : 0;
+}
+
+__attribute__((pure)) bool MemoryTracker::fits(size_t bytes) const
+{
+  return bytes <= max_alloc && bytes <= budget();
+}
+
+void MemoryTracker::print(void) const
+{
+  cout << "[Memory] " << (total.live >> 10) << " KiB live, "
+       << (total.peak >> 10) << " KiB peak in " << total.buffers
+       << " buffers, " << (global_size >> 20) << " MiB global, "
+       << (max_alloc >> 20) << " MiB max allocation" << endl;
+  for(auto i = roles.begin(); i != roles.end(); i++)
+  {
+    cout << "[Memory]   " << i->first << ": " << (i->second.live >> 10)
+         << " KiB live, " << (i->second.peak >> 10) << " KiB peak in "
+         << i->second.buffers << " buffers" << endl;
+  }
+}
+
+/******************************************************************************/
+/******************************************************************************/
+
 Environment::Environment(unsigned int platform_num, cl_device_type dev_type)
 {
   cout << "[OpenCL] Initializing." << endl;
@@ -158,16 +223,67 @@ Environment::Environment(unsigned int platform_num, cl_device_type dev_type)
     throw OpenCLException(error, msg);
   }
 
+  m_memory = make_shared<MemoryTracker>(
+      get_device_info_(m_devices[0], CL_DEVICE_GLOBAL_MEM_SIZE, cl_ulong),
+      get_device_info_(m_devices[0], CL_DEVICE_MAX_MEM_ALLOC_SIZE, cl_ulong));
+
   cout << "[OpenCL] Done." << endl;
 }
 
-RemoteBuffer Environment::allocate(size_t byte_size) const
+/**
+ * Keeps a buffer accounted until the last copy of its RemoteBuffer is gone.
+ */
+struct Registration
 {
+  shared_ptr<MemoryTracker> tracker;
+  string role;
+  size_t bytes;
+
+  ~Registration(void) { tracker->remove(role, bytes); }
+};
+
+static string mib(size_t bytes)
+{
+  return std::to_string((bytes + (1 << 20) - 1) >> 20) + " MiB";
+}
+
+shared_ptr<void> Environment::reserve(size_t byte_size,
+                                      string const& role) const
+{
+  if(byte_size > m_memory->max_allocation())
+  {
+    string msg("Buffer \"" + role + "\" of " + mib(byte_size) +
+               " exceeds the maximum allocation of " +
+               mib(m_memory->max_allocation()) + ".");
+    throw OpenCLException(CL_INVALID_BUFFER_SIZE, msg);
+  }
+  if(byte_size > m_memory->budget())
+  {
+    m_memory->print();
+    string msg("Buffer \"" + role + "\" of " + mib(byte_size) +
+               " exceeds the remaining " + mib(m_memory->budget()) +
+               " of device memory.");
+    throw OpenCLException(CL_MEM_OBJECT_ALLOCATION_FAILURE, msg);
+  }
+
+  m_memory->add(role, byte_size);
+  shared_ptr<Registration> r = make_shared<Registration>();
+  r->tracker = m_memory;
+  r->role = role;
+  r->bytes = byte_size;
+  return r;
+}
+
+RemoteBuffer Environment::allocate(size_t byte_size,
+                                   string const& role) const
+{
+  shared_ptr<void> registration = reserve(byte_size, role);
   cl::Buffer remote_buffer(
       m_context, CL_MEM_READ_WRITE | 0, byte_size, nullptr, &error);
   if(error != CL_SUCCESS)
   {
-    string msg("Could not create remote buffer of size " +
+    m_memory->print();
+    string msg("Could not create remote buffer \"" + role + "\" of size " +
                std::to_string(byte_size) + ".");
     throw OpenCLException(error, msg);
   }
@@ -175,11 +291,15 @@ RemoteBuffer Environment::allocate(size_t byte_size) const
   RemoteBuffer rb;
   rb.size = byte_size;
   rb.buffer = remote_buffer;
+  rb.registration = registration;
   return rb;
 }
 
-RemoteBuffer Environment::allocate(size_t byte_size, void* bytes) const
+RemoteBuffer Environment::allocate(size_t byte_size,
+                                   void* bytes,
+                                   string const& role) const
 {
+  shared_ptr<void> registration = reserve(byte_size, role);
   cl::Buffer remote_buffer(m_context,
                            CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
                            byte_size,
@@ -187,7 +307,8 @@ RemoteBuffer Environment::allocate(size_t byte_size, void* bytes) const
                            &error);
   if(error != CL_SUCCESS)
   {
-    string msg("Could not create remote buffer of size " +
+    m_memory->print();
+    string msg("Could not create remote buffer \"" + role + "\" of size " +
                std::to_string(byte_size) + ".");
     throw OpenCLException(error, msg);
   }
@@ -195,12 +316,20 @@ RemoteBuffer Environment::allocate(size_t byte_size, void* bytes) const
   RemoteBuffer rb;
   rb.size = byte_size;
   rb.buffer = remote_buffer;
+  rb.registration = registration;
   return rb;
 }
 
-cl::CommandQueue Environment::create_queue(void) const
+string Environment::device_id(void) const
+{
+  return get_device_info_(m_devices[0], CL_DEVICE_NAME, string) + " " +
+         get_device_info_(m_devices[0], CL_DRIVER_VERSION, string);
+}
+
+cl::CommandQueue
+Environment::create_queue(cl_command_queue_properties properties) const
 {
-  cl::CommandQueue queue(m_context, m_devices[0], 0, &error);
+  cl::CommandQueue queue(m_context, m_devices[0], properties, &error);
   if(error != CL_SUCCESS)
   {
     string msg("Could not create command queue.");
@@ -223,6 +352,67 @@ void writeBufferBlocking(cl::CommandQueue const& queue,
   }
 }
 
+void writeBufferBlocking(cl::CommandQueue const& queue,
+                         RemoteBuffer const& remote,
+                         size_t offset,
+                         size_t size,
+                         void const* data)
+{
+  if(offset + size > remote.size)
+  {
+    string msg("Write of " + std::to_string(size) + " bytes at offset " +
+               std::to_string(offset) + " exceeds buffer size " +
+               std::to_string(remote.size) + ".");
+    throw OpenCLException(CL_INVALID_VALUE, msg);
+  }
+
+  queue.finish();
+  error = queue.enqueueWriteBuffer(
+      remote.buffer, CL_TRUE, offset, size, data, nullptr, nullptr);
+  if(error != CL_SUCCESS)
+  {
+    string msg("Could not write to buffer.");
+    throw OpenCLException(error, msg);
+  }
+}
+
+void clearBufferBlocking(cl::CommandQueue const& queue,
+                         RemoteBuffer const& remote)
+{
+  queue.finish();
+  error = queue.enqueueFillBuffer(
+      remote.buffer, (cl_uchar)0, 0, remote.size, nullptr, nullptr);
+  if(error == CL_SUCCESS)
+    error = queue.finish();
+  if(error != CL_SUCCESS)
+  {
+    string msg("Could not clear buffer.");
+    throw OpenCLException(error, msg);
+  }
+}
+
+void copyBufferBlocking(cl::CommandQueue const& queue,
+                        RemoteBuffer const& src,
+                        RemoteBuffer const& dst)
+{
+  if(src.size != dst.size)
+  {
+    string msg("Can't copy " + std::to_string(src.size) + " into " +
+               std::to_string(dst.size) + " bytes.");
+    throw OpenCLException(CL_INVALID_VALUE, msg);
+  }
+
+  error = queue.enqueueCopyBuffer(
+      src.buffer, dst.buffer, 0, 0, src.size, nullptr, nullptr);
+  if(error == CL_SUCCESS)
+    error = queue.finish();
+  if(error != CL_SUCCESS)
+  {
+    string msg("Could not copy buffer.");
+    throw OpenCLException(error, msg);
+  }
+}
+
 void readBufferBlocking(cl::CommandQueue const& queue,
                         RemoteBuffer const& remote,
                         void* data)
@@ -237,25 +427,101 @@ void readBufferBlocking(cl::CommandQueue const& queue,
   }
 }
 
+void readBufferBlocking(cl::CommandQueue const& queue,
+                        RemoteBuffer const& remote,
+                        size_t offset,
+                        size_t size,
+                        void* data)
+{
+  if(offset + size > remote.size)
+  {
+    string msg("Read of " + std::to_string(size) + " bytes at offset " +
+               std::to_string(offset) + " exceeds buffer size " +
+               std::to_string(remote.size) + ".");
+    throw OpenCLException(CL_INVALID_VALUE, msg);
+  }
+
+  queue.finish();
+  error = queue.enqueueReadBuffer(
+      remote.buffer, CL_TRUE, offset, size, data, nullptr, nullptr);
+  if(error != CL_SUCCESS)
+  {
+    string msg("Could not read from buffer.");
+    throw OpenCLException(error, msg);
+  }
+}
+
+/******************************************************************************/
+/******************************************************************************/
+
+BuildOptions& BuildOptions::define(string const& name, string const& value)
+{
+  defines[name] = value;
+  return *this;
+}
+
+BuildOptions& BuildOptions::define(string const& name, unsigned int value)
+{
+  return define(name, to_string(value));
+}
+
+BuildOptions& BuildOptions::flag(string const& f)
+{
+  flags.insert(f);
+  return *this;
+}
+
+string BuildOptions::str(void) const
+{
+  stringstream options;
+  for(auto d = defines.begin(); d != defines.end(); d++)
+  {
+    options << "-D " << d->first;
+    if(!d->second.empty())
+      options << "=" << d->second;
+    options << " ";
+  }
+  for(auto f = flags.begin(); f != flags.end(); f++)
+    options << *f << " ";
+  return options.str();
+}
+
+__attribute__((pure)) bool BuildOptions::operator==(
+    BuildOptions const& other) const
+{
+  return defines == other.defines && flags == other.flags;
+}
+
+__attribute__((pure)) bool BuildOptions::operator!=(
+    BuildOptions const& other) const
+{
+  return !(*this == other);
+}
+
 /******************************************************************************/
 /******************************************************************************/
 
 Kernel::Kernel(string const& fpath, string const& mname)
-    : file_path(fpath), main_function(mname)
+    : file_path(fpath), main_function(mname), m_resources(), m_local_x(0),
+      m_local_y(0)
 {
   m_kernel = nullptr;
   m_program = nullptr;
 }
 
-void Kernel::load(Environment const& context)
+string Kernel::id(void) const
 {
-  string kernel_string;
-  if(!load_file(file_path, kernel_string))
-  {
-    string msg("Could not read file " + file_path + ".");
-    throw OpenCLException(0, msg);
-  }
+  return file_path + ":" + main_function + " " + m_options.str();
+}
+
+void Kernel::set_local_size(size_t x, size_t y)
+{
+  m_local_x = x;
+  m_local_y = y;
+}
 
+void Kernel::load(Environment const& context, string const& kernel_string)
+{
   char const* kernel_string_ptr = kernel_string.c_str();
   vector<pair<const char*, size_t>> sources;
   sources.push_back(
@@ -268,9 +534,59 @@ void Kernel::load(Environment const& context)
   }
 }
 
+bool Kernel::load_binary(Environment const& context, string const& path)
+{
+  ifstream file(path, ios::binary);
+  vector<char> binary((istreambuf_iterator<char>(file)),
+                      istreambuf_iterator<char>());
+  if(binary.empty())
+    return false;
+
+  cl::Program::Binaries binaries;
+  binaries.push_back(make_pair((void const*)binary.data(), binary.size()));
+  vector<cl_int> status;
+  m_program = cl::Program(
+      context.m_context, context.m_devices, binaries, &status, &error);
+  if(error != CL_SUCCESS || status.empty() || status[0] != CL_SUCCESS)
+    return false;
+
+  /* Binaries still have to be built, but that is only linking */
+  error = m_program.build(context.m_devices, m_options.str().c_str());
+  if(error != CL_SUCCESS)
+    return false;
+
+  cout << "[" << file_path << "] Loaded " << path << endl;
+  return true;
+}
+
+void Kernel::store_binary(string const& path) const
+{
+  size_t size = 0;
+  error = clGetProgramInfo(
+      m_program(), CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, nullptr);
+  if(error != CL_SUCCESS || size == 0)
+    return;
+
+  vector<unsigned char> binary(size);
+  unsigned char* binary_ptr = binary.data();
+  error = clGetProgramInfo(m_program(),
+                           CL_PROGRAM_BINARIES,
+                           sizeof(binary_ptr),
+                           &binary_ptr,
+                           nullptr);
+  if(error != CL_SUCCESS)
+    return;
+
+  mkdir(KERNEL_CACHE_DIR, 0755);
+  if(!write_atomically(path, [&](int fd) {
+       return write_all(fd, binary.data(), binary.size());
+     }))
+    cerr << "[" << file_path << "] Could not write " << path << endl;
+}
+
 void Kernel::build(Environment const& context)
 {
-  error = m_program.build(context.m_devices);
+  error = m_program.build(context.m_devices, m_options.str().c_str());
   switch(error)
   {
   case CL_SUCCESS:
@@ -290,7 +606,7 @@ void Kernel::build(Environment const& context)
   }
 }
 
-void Kernel::create_kernel(void)
+void Kernel::create_kernel(Environment const& c)
 {
   m_kernel = cl::Kernel(m_program, main_function.c_str(), &error);
   if(error != CL_SUCCESS)
@@ -299,39 +615,105 @@ void Kernel::create_kernel(void)
     throw OpenCLException(error, msg);
   }
 
-  /*cl_ulong local_mem;
-  error = m_kernel.getWorkGroupInfo(CL_KERNEL_LOCAL_MEM_SIZE, &local_mem);
+  cl::Device const& device = c.m_devices[0];
+  error = m_kernel.getWorkGroupInfo(
+      device, CL_KERNEL_WORK_GROUP_SIZE, &m_resources.work_group_size);
   if(error != CL_SUCCESS)
   {
-    string msg("Could not get kernel local mem size.");
+    string msg("Could not get kernel work group size.");
     throw OpenCLException(error, msg);
   }
 
-  cout << "[" << file_path << "] Local mem size: " << (long)local_mem << endl;*/
+  error =
+      m_kernel.getWorkGroupInfo(device,
+                                CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+                                &m_resources.preferred_multiple);
+  if(error != CL_SUCCESS)
+    m_resources.preferred_multiple = 1;
 
-  // pocl ** * ******* ***** ** **** (private mem unimplemented, would fail)
-  /*cl_ulong private_mem;
-  error = clGetKernelWorkGroupInfo(m_kernel,
-                                   context.device_ids[0],
-                                   CL_KERNEL_PRIVATE_MEM_SIZE,
-                                   sizeof(cl_ulong),
-                                   &private_mem,
-                                   nullptr);
-  if (error != CL_SUCCESS)
-  {
-    string msg("Could not create kernel private mem size.");
-    throw OpenCLException(error, msg);
-  }
+  error = m_kernel.getWorkGroupInfo(
+      device, CL_KERNEL_LOCAL_MEM_SIZE, &m_resources.local_mem);
+  if(error != CL_SUCCESS)
+    m_resources.local_mem = 0;
 
-  cout << "[" << file_path << "] Private memory size: " << private_mem <<
-  endl;*/
+  // pocl doesn't implement the private memory query
+  error = m_kernel.getWorkGroupInfo(
+      device, CL_KERNEL_PRIVATE_MEM_SIZE, &m_resources.private_mem);
+  if(error != CL_SUCCESS)
+    m_resources.private_mem = 0;
+
+  cout << "[" << file_path << "] " << main_function
+       << ": work group size " << m_resources.work_group_size
+       << ", preferred multiple " << m_resources.preferred_multiple
+       << ", local mem " << m_resources.local_mem << " byte"
+       << ", private mem " << m_resources.private_mem << " byte" << endl;
 }
 
-void Kernel::make(Environment const& c)
+/**
+ * Programs built in this process, by file, options and context. Kernels
+ * made again, e.g. by a new renderer, skip the compiler and the binary
+ * cache. A program keeps its context alive, so the handle stays unique.
+ */
+static map<string, cl::Program> built_programs;
+static mutex built_programs_lock;
+
+void Kernel::make(Environment const& c, BuildOptions const& options)
 {
-  load(c);
-  build(c);
-  create_kernel();
+  m_options = options;
+
+  string const built_key = file_path + '\0' + m_options.str() + '\0' +
+                           to_string((uintptr_t)c.m_context());
+  {
+    lock_guard<mutex> guard(built_programs_lock);
+    auto const built = built_programs.find(built_key);
+    if(built != built_programs.end())
+    {
+      m_program = built->second;
+      create_kernel(c);
+      return;
+    }
+  }
+
+  string source;
+  if(!load_file(file_path, source))
+  {
+    string msg("Could not read file " + file_path + ".");
+    throw OpenCLException(0, msg);
+  }
+
+  /* Binaries are per device, only single device contexts are cached */
+  string cache_path;
+  if(c.m_devices.size() == 1)
+  {
+    string const identity =
+        source + '\0' + m_options.str() + '\0' + c.device_id();
+    char key[17];
+    snprintf(key,
+             sizeof(key),
+             "%016llx",
+             (unsigned long long)hash<string>()(identity));
+
+    size_t const slash = file_path.find_last_of('/');
+    string const name =
+        slash == string::npos ? file_path : file_path.substr(slash + 1);
+    cache_path = string(KERNEL_CACHE_DIR) + "/" + name + "-" + key + ".bin";
+  }
+
+  if(cache_path.empty() || !load_binary(c, cache_path))
+  {
+    load(c, source);
+    build(c);
+    if(!cache_path.empty())
+      store_binary(cache_path);
+  }
+  {
+    lock_guard<mutex> guard(built_programs_lock);
+    built_programs[built_key] = m_program;
+  }
+
+  cout << "[" << file_path << "] " << main_function << " built with \""
+       << m_options.str() << "\"" << endl;
+  create_kernel(c);
 }
 
 void Kernel::set_argument(unsigned int nr, RemoteBuffer const& buf)
@@ -348,12 +730,15 @@ cl::Event Kernel::enqueue(size_t const width,
                           cl::CommandQueue const& queue) const
 {
   cl::Event event;
-  error = queue.enqueueNDRangeKernel(m_kernel,
-                                     cl::NullRange,
-                                     cl::NDRange(width, 0, 0),
-                                     cl::NullRange, // cl::NDRange(width, 0, 0),
-                                     nullptr,
-                                     &event);
+  cl::NDRange global(width);
+  cl::NDRange local = cl::NullRange;
+  if(m_local_x > 0)
+  {
+    global = cl::NDRange((width + m_local_x - 1) / m_local_x * m_local_x);
+    local = cl::NDRange(m_local_x);
+  }
+  error = queue.enqueueNDRangeKernel(
+      m_kernel, cl::NullRange, global, local, nullptr, &event);
 
   if(error != CL_SUCCESS)
   {
@@ -368,12 +753,16 @@ cl::Event Kernel::enqueue(size_t const width,
                           cl::CommandQueue const& queue) const
 {
   cl::Event event;
-  error = queue.enqueueNDRangeKernel(m_kernel,
-                                     cl::NDRange(0, 0),
-                                     cl::NDRange(width, height),
-                                     cl::NullRange, // cl::NDRange(width, 1),
-                                     nullptr,
-                                     &event);
+  cl::NDRange global(width, height);
+  cl::NDRange local = cl::NullRange;
+  if(m_local_x > 0 && m_local_y > 0)
+  {
+    global = cl::NDRange((width + m_local_x - 1) / m_local_x * m_local_x,
+                         (height + m_local_y - 1) / m_local_y * m_local_y);
+    local = cl::NDRange(m_local_x, m_local_y);
+  }
+  error = queue.enqueueNDRangeKernel(
+      m_kernel, cl::NDRange(0, 0), global, local, nullptr, &event);
   if(error != CL_SUCCESS)
   {
     string msg("Could not enqueue kernel.");
@@ -482,4 +871,18 @@ cl_int getEventStatus(cl_event& e)
   }
   return stat;
 }
+
+float getEventDuration(cl::Event const& e)
+{
+  cl_ulong start, end;
+  error = e.getProfilingInfo(CL_PROFILING_COMMAND_START, &start);
+  if(error == CL_SUCCESS)
+    error = e.getProfilingInfo(CL_PROFILING_COMMAND_END, &end);
+  if(error != CL_SUCCESS)
+  {
+    string msg("Could not get event profiling info.");
+    throw OpenCLException(error, msg);
+  }
+  return (float)(end - start) * 1e-6f;
+}
 }
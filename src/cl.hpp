@@ -2,6 +2,9 @@
 #define __CL_OCGL_H__
 
 #include <CL/cl.hpp>
+#include <map>
+#include <memory>
+#include <set>
 #include <string>
 
 // gcc -std=c99 openCLTest.c -o openCLTest -lOpenCL
@@ -32,6 +35,58 @@ struct RemoteBuffer
 {
   size_t size;
   cl::Buffer buffer;
+  /** Counted by the MemoryTracker for as long as any copy is alive **/
+  std::shared_ptr<void> registration;
+};
+
+/**
+ * Device memory in use, by buffer role. The limits are those reported by
+ * the first device, the driver may still fail earlier.
+ */
+class MemoryTracker
+{
+public:
+  struct Usage
+  {
+    size_t live;
+    size_t peak;
+    unsigned int buffers;
+  };
+
+private:
+  size_t const global_size;
+  size_t const max_alloc;
+  Usage total;
+  std::map<std::string, Usage> roles;
+
+public:
+  MemoryTracker(size_t global, size_t max_allocation);
+
+  void add(std::string const& role, size_t bytes);
+  void remove(std::string const& role, size_t bytes);
+
+  /**
+   * Bytes of global memory not taken by live buffers.
+   */
+  size_t budget(void) const;
+
+  /**
+   * Whether a single buffer of *bytes* bytes can still be allocated.
+   */
+  bool fits(size_t bytes) const;
+
+  size_t global_memory(void) const { return global_size; }
+  size_t max_allocation(void) const { return max_alloc; }
+  Usage const& usage(void) const { return total; }
+  std::map<std::string, Usage> const& usage_by_role(void) const
+  {
+    return roles;
+  }
+
+  /**
+   * Logs live and peak usage of every role.
+   */
+  void print(void) const;
 };
 
 /**
@@ -43,6 +98,36 @@ void writeBufferBlocking(cl::CommandQueue const& queue,
                          RemoteBuffer const& remote_buffer,
                          void const* data);
 
+/**
+ * Writes only the range [offset, offset + size) of the remote buffer.
+ * @param queue - The work queue
+ * @param remote_buffer - The remote buffer to write to
+ * @param offset - Byte offset into the remote buffer
+ * @param size - Number of bytes to write
+ * @param data -> A pointer to *size* bytes of data
+ */
+void writeBufferBlocking(cl::CommandQueue const& queue,
+                         RemoteBuffer const& remote_buffer,
+                         size_t offset,
+                         size_t size,
+                         void const* data);
+
+/**
+ * Sets every byte of the remote buffer to zero.
+ * @param queue - The work queue
+ * @param remote_buffer - The remote buffer to clear
+ */
+void clearBufferBlocking(cl::CommandQueue const& queue,
+                         RemoteBuffer const& remote_buffer);
+
+/**
+ * Copies *src* into *dst* on the device. Both have to be of the same size.
+ * @param queue - The work queue
+ */
+void copyBufferBlocking(cl::CommandQueue const& queue,
+                        RemoteBuffer const& src,
+                        RemoteBuffer const& dst);
+
 /**
  * @param queue - The work queue
  * @param remote_buffer - The remote buffer to write to
@@ -52,6 +137,16 @@ void readBufferBlocking(cl::CommandQueue const& queue,
                         RemoteBuffer const& remote_buffer,
                         void* data);
 
+/**
+ * Reads only the range [offset, offset + size) of the remote buffer.
+ * @param data -> A pointer to *size* bytes
+ */
+void readBufferBlocking(cl::CommandQueue const& queue,
+                        RemoteBuffer const& remote_buffer,
+                        size_t offset,
+                        size_t size,
+                        void* data);
+
 class Environment
 {
 public:
@@ -64,28 +159,103 @@ public:
 
   /**
    * Creates a remote buffer of *byte_size* bytes size and fills it with *bytes*
+   * @param role - What the buffer is for, memory is accounted by role
    */
-  RemoteBuffer allocate(size_t byte_size) const;
-  RemoteBuffer allocate(size_t byte_size, void* bytes) const;
+  RemoteBuffer allocate(size_t byte_size,
+                        std::string const& role = "other") const;
+  RemoteBuffer allocate(size_t byte_size,
+                        void* bytes,
+                        std::string const& role = "other") const;
+
+  /**
+   * Usage and limits of the device memory.
+   */
+  MemoryTracker const& memory(void) const { return *m_memory; }
 
   /**
    * Creates a command queue.
+   * @param properties - e.g. CL_QUEUE_PROFILING_ENABLE
    * @return A new command queue object
    */
-  cl::CommandQueue create_queue(void) const;
+  cl::CommandQueue
+  create_queue(cl_command_queue_properties properties = 0) const;
+
+  /**
+   * Name and driver version of the first device, identifies it in caches.
+   */
+  std::string device_id(void) const;
+
+private:
+  /** Shared with the registration of every buffer, which may outlive us **/
+  std::shared_ptr<MemoryTracker> m_memory;
+
+  /**
+   * Checks *byte_size* against the limits and registers it under *role*.
+   * @throw OpenCLException if it does not fit
+   */
+  std::shared_ptr<void> reserve(size_t byte_size,
+                                std::string const& role) const;
 };
 
+/**
+ * What a compiled kernel needs per work-item and work-group on the device.
+ * Limits the work-group size and with it the occupancy.
+ */
+struct KernelResources
+{
+  size_t work_group_size;
+  size_t preferred_multiple;
+  cl_ulong local_mem;
+  /** 0 if the driver can't tell **/
+  cl_ulong private_mem;
+};
+
+/**
+ * Options passed to the OpenCL compiler: -D defines and plain flags such as
+ * -cl-fast-relaxed-math. str() is ordered, equal options give equal strings.
+ */
+class BuildOptions
+{
+private:
+  std::map<std::string, std::string> defines;
+  std::set<std::string> flags;
+
+public:
+  /**
+   * Adds -D *name*=*value*, or -D *name* if *value* is empty.
+   */
+  BuildOptions& define(std::string const& name, std::string const& value = "");
+  BuildOptions& define(std::string const& name, unsigned int value);
+  BuildOptions& flag(std::string const& flag);
+
+  std::string str(void) const;
+  bool operator==(BuildOptions const& other) const;
+  bool operator!=(BuildOptions const& other) const;
+};
+
+/**
+ * Compiled programs are kept here, one binary per source, options and
+ * device, so every variant is only built once.
+ */
+#define KERNEL_CACHE_DIR "./cl/cache"
+
 class Kernel
 {
 private:
   std::string const file_path;
   std::string const main_function;
+  BuildOptions m_options;
   cl::Program m_program;
   cl::Kernel m_kernel;
+  KernelResources m_resources;
+  size_t m_local_x;
+  size_t m_local_y;
 
-  void load(Environment const& c);
+  void load(Environment const& c, std::string const& source);
+  bool load_binary(Environment const& c, std::string const& path);
+  void store_binary(std::string const& path) const;
   void build(Environment const& c);
-  void create_kernel(void);
+  void create_kernel(Environment const& c);
 
 public:
   /**
@@ -97,10 +267,32 @@ public:
   virtual ~Kernel(void){};
 
   /**
-   * Loads the program and compiles it to a kernel
+   * Loads the program and compiles it to a kernel. The binary is taken
+   * from KERNEL_CACHE_DIR if this variant has been built before.
    * @param c - The OpenCL context
+   * @param options - Defines and compiler flags of this variant
    */
-  void make(Environment const& c);
+  void make(Environment const& c, BuildOptions const& options = BuildOptions());
+
+  BuildOptions const& options(void) const { return m_options; }
+
+  /**
+   * Queried when the kernel is made.
+   */
+  KernelResources const& resources(void) const { return m_resources; }
+
+  /**
+   * Identifies the kernel in caches: file, main function and options.
+   */
+  std::string id(void) const;
+
+  /**
+   * Local size of launches, one-dimensional ones only use *x*.
+   * 0 leaves it to the driver. Otherwise the global size is rounded up to a
+   * multiple of it, so the kernel has to ignore work-items outside of the
+   * requested range.
+   */
+  void set_local_size(size_t x, size_t y);
 
   /**
    * Assigns the kernel parameters.
@@ -152,6 +344,12 @@ void waitForEvent(cl_event& e);
  * Returns the status code of the event. non-blocking.
  */
 cl_int getEventStatus(cl_event& e);
+
+/**
+ * Returns the execution time of a finished command in milliseconds.
+ * The queue has to be created with CL_QUEUE_PROFILING_ENABLE.
+ */
+float getEventDuration(cl::Event const& e);
 }
 
 #endif
@@ -0,0 +1,112 @@
+#ifndef __EXCHANGE_H__
+#define __EXCHANGE_H__
+
+#include <atomic>
+#include <cstddef>
+
+/**
+ * Lock-free hand-over of the newest value from one producer thread to one
+ * consumer thread. The producer fills back() and publishes it, the
+ * consumer takes the newest published value with update(). Neither side
+ * ever waits; values the consumer was too slow for are overwritten.
+ */
+template <typename T> class TripleBuffer
+{
+private:
+  /** Set in shared while it holds a value the consumer hasn't taken **/
+  static unsigned int const FRESH = 4;
+  static unsigned int const INDEX = 3;
+
+  T slots[3];
+  std::atomic<unsigned int> shared;
+  /** Owned by the producer and the consumer respectively **/
+  unsigned int back_index;
+  unsigned int front_index;
+
+public:
+  /**
+   * @param initial - Copied into all three slots, e.g. preallocated
+   */
+  explicit TripleBuffer(T const& initial)
+      : slots{initial, initial, initial}, shared(1), back_index(0),
+        front_index(2)
+  {
+  }
+
+  /** Producer side **/
+  T& back(void) { return slots[back_index]; }
+
+  /**
+   * Producer side: makes back() the newest value and hands out a new back().
+   */
+  void publish(void)
+  {
+    back_index =
+        shared.exchange(back_index | FRESH, std::memory_order_acq_rel) &
+        INDEX;
+  }
+
+  /**
+   * Consumer side: takes the newest value into front(), if there is one.
+   * @return false if nothing was published since the last update
+   */
+  bool update(void)
+  {
+    if(!(shared.load(std::memory_order_relaxed) & FRESH))
+      return false;
+    front_index =
+        shared.exchange(front_index, std::memory_order_acq_rel) & INDEX;
+    return true;
+  }
+
+  /** Consumer side **/
+  T const& front(void) const { return slots[front_index]; }
+};
+
+/**
+ * Lock-free bounded queue from one producer thread to one consumer thread.
+ * Holds up to N - 1 items.
+ */
+template <typename T, size_t N> class RingQueue
+{
+private:
+  T items[N];
+  /** Next item to pop, owned by the consumer **/
+  std::atomic<size_t> head;
+  /** Next free place, owned by the producer **/
+  std::atomic<size_t> tail;
+
+public:
+  RingQueue(void) : head(0), tail(0) {}
+
+  /**
+   * Producer side.
+   * @return false if the queue is full
+   */
+  bool push(T const& item)
+  {
+    size_t const t = tail.load(std::memory_order_relaxed);
+    size_t const next = (t + 1) % N;
+    if(next == head.load(std::memory_order_acquire))
+      return false;
+    items[t] = item;
+    tail.store(next, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * Consumer side.
+   * @return false if the queue is empty
+   */
+  bool pop(T& item)
+  {
+    size_t const h = head.load(std::memory_order_relaxed);
+    if(h == tail.load(std::memory_order_acquire))
+      return false;
+    item = items[h];
+    head.store((h + 1) % N, std::memory_order_release);
+    return true;
+  }
+};
+
+#endif
@@ -0,0 +1,49 @@
+#include <cerrno>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "file.hpp"
+
+using namespace std;
+
+bool write_all(int fd, void const* data, size_t size)
+{
+  char const* bytes = (char const*)data;
+  while(size > 0)
+  {
+    ssize_t written = write(fd, bytes, size);
+    if(written < 0 && errno == EINTR)
+      continue;
+    if(written <= 0)
+      return false;
+    bytes += written;
+    size -= (size_t)written;
+  }
+  return true;
+}
+
+bool write_at(int fd, uint64_t offset, void const* data, size_t size)
+{
+  return lseek(fd, (off_t)offset, SEEK_SET) == (off_t)offset &&
+         write_all(fd, data, size);
+}
+
+bool write_atomically(string const& path, function<bool(int fd)> const& write)
+{
+  string const tmp_path = path + "." + to_string(getpid()) + ".tmp";
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0)
+    return false;
+
+  bool ok = write(fd) && fsync(fd) == 0;
+  if(close(fd) != 0)
+    ok = false;
+  if(!ok || rename(tmp_path.c_str(), path.c_str()) != 0)
+  {
+    remove(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
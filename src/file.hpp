@@ -0,0 +1,30 @@
+#ifndef __FILE_H__
+#define __FILE_H__
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <string>
+
+/**
+ * Writes all of *size* bytes to *fd*, retrying short writes.
+ */
+bool write_all(int fd, void const* data, size_t size);
+
+/**
+ * Writes all of *size* bytes to *fd* at byte *offset* of the file. Gaps
+ * before *offset* read as zeros.
+ */
+bool write_at(int fd, uint64_t offset, void const* data, size_t size);
+
+/**
+ * Replaces the file at *path* by what *write* writes to the descriptor it
+ * gets. The data goes to a temp file of this process first, which is
+ * synced and renamed over *path*: readers and other processes storing the
+ * same file see either the old or the new one, even after a crash.
+ * @return false if *write* or any file operation failed, *path* is kept
+ */
+bool write_atomically(std::string const& path,
+                      std::function<bool(int fd)> const& write);
+
+#endif
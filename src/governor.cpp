@@ -0,0 +1,74 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#include "governor.hpp"
+
+using namespace std;
+
+/** Don't go below this fraction of the window resolution **/
+#define GOVERNOR_MIN_SCALE 0.25f
+/** Frames to wait after a change, so the measurement can settle **/
+#define GOVERNOR_COOLDOWN 8
+#define GOVERNOR_MAX_SAMPLES 16
+/** Resolutions are rounded to multiples of this **/
+#define GOVERNOR_STEP 4
+
+Governor::Governor(unsigned int max_w_, unsigned int max_h_, float target_ms_)
+    : max_w(max_w_), max_h(max_h_), target_ms(target_ms_), scale(1.0f),
+      samples(1), cooldown(0), w(max_w_), h(max_h_)
+{
+}
+
+void Governor::apply_scale(void)
+{
+  auto scaled = [this](unsigned int size) {
+    unsigned int res = (unsigned int)((float)size * scale);
+    res = res / GOVERNOR_STEP * GOVERNOR_STEP;
+    return max(min(res, size), (unsigned int)GOVERNOR_STEP);
+  };
+  w = scaled(max_w);
+  h = scaled(max_h);
+}
+
+bool Governor::update(float frame_ms)
+{
+  if(cooldown > 0)
+  {
+    cooldown--;
+    return false;
+  }
+
+  float const ratio = target_ms / max(frame_ms, 0.001f);
+  if(ratio > 0.85f && ratio < 1.15f)
+    return false; // close enough
+
+  /** Samples per frame are the cheaper knob, they keep the accumulation **/
+  if(ratio < 1.0f && samples > 1)
+  {
+    samples = max(1u, (unsigned int)((float)samples * ratio));
+    cooldown = GOVERNOR_COOLDOWN;
+    return false;
+  }
+  if(ratio > 2.0f && scale >= 1.0f && samples < GOVERNOR_MAX_SAMPLES)
+  {
+    samples = min((unsigned int)GOVERNOR_MAX_SAMPLES, samples * 2);
+    cooldown = GOVERNOR_COOLDOWN;
+    return false;
+  }
+
+  /** Kernel time is about proportional to the pixel count **/
+  float const new_scale =
+      min(1.0f, max(GOVERNOR_MIN_SCALE, scale * sqrt(ratio)));
+  unsigned int const old_w = w;
+  unsigned int const old_h = h;
+  scale = 0.5f * (scale + new_scale);
+  apply_scale();
+  cooldown = GOVERNOR_COOLDOWN;
+
+  if(w == old_w && h == old_h)
+    return false;
+
+  cout << "[Governor] " << frame_ms << " ms => " << w << "x" << h << endl;
+  return true;
+}
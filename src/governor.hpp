@@ -0,0 +1,48 @@
+#ifndef __GOVERNOR_H__
+#define __GOVERNOR_H__
+
+/**
+ * Picks the internal render resolution (and the number of samples per
+ * frame) so that the measured kernel time stays close to a target.
+ * The resolution is scaled uniformly, the aspect ratio is kept.
+ */
+class Governor
+{
+private:
+  unsigned int const max_w;
+  unsigned int const max_h;
+  float const target_ms;
+
+  float scale;
+  unsigned int samples;
+  unsigned int cooldown;
+
+  unsigned int w;
+  unsigned int h;
+
+  void apply_scale(void);
+
+public:
+  /**
+   * @param max_w, max_h - The window (and buffer) resolution
+   * @param target_ms - Kernel time per frame to aim for
+   */
+  Governor(unsigned int max_w, unsigned int max_h, float target_ms);
+  virtual ~Governor(void) {}
+
+  /**
+   * Feeds the kernel time of the last frame.
+   * @return true if the resolution changed (accumulation is invalid)
+   */
+  bool update(float frame_ms);
+
+  unsigned int width(void) const { return w; }
+  unsigned int height(void) const { return h; }
+
+  /**
+   * Number of samples to dispatch per frame.
+   */
+  unsigned int samples_per_frame(void) const { return samples; }
+};
+
+#endif
@@ -0,0 +1,110 @@
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <png.h>
+
+#include "image.hpp"
+
+using namespace std;
+
+Image resolve(float const* rgbw, unsigned int width, unsigned int height)
+{
+  Image image;
+  image.width = width;
+  image.height = height;
+  image.rgb.resize(width * height * 3);
+
+  for(size_t i = 0; i < (size_t)width * height; i++)
+  {
+    float const* pixel = rgbw + 4 * i;
+    float const n = pixel[3] > 0.0f ? pixel[3] : 1.0f;
+    for(size_t c = 0; c < 3; c++)
+    {
+      float v = 255.1f * pixel[c] / n;
+      v = v < 0.0f ? 0.0f : (v > 255.0f ? 255.0f : v);
+      image.rgb[3 * i + c] = (uint8_t)v;
+    }
+  }
+  return image;
+}
+
+bool write_png(string const& path, Image const& image)
+{
+  FILE* file = fopen(path.c_str(), "wb");
+  if(file == nullptr)
+  {
+    cerr << "[Image] Could not open " << path << "." << endl;
+    return false;
+  }
+
+  png_structp png =
+      png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+  png_infop info = png != nullptr ? png_create_info_struct(png) : nullptr;
+  if(info == nullptr || setjmp(png_jmpbuf(png)))
+  {
+    png_destroy_write_struct(&png, &info);
+    fclose(file);
+    cerr << "[Image] Could not encode " << path << "." << endl;
+    return false;
+  }
+
+  png_init_io(png, file);
+  png_set_IHDR(png,
+               info,
+               image.width,
+               image.height,
+               8,
+               PNG_COLOR_TYPE_RGB,
+               PNG_INTERLACE_NONE,
+               PNG_COMPRESSION_TYPE_DEFAULT,
+               PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png, info);
+  for(unsigned int y = 0; y < image.height; y++)
+    png_write_row(png, image.rgb.data() + y * image.width * 3);
+  png_write_end(png, nullptr);
+  png_destroy_write_struct(&png, &info);
+
+  return fclose(file) == 0;
+}
+
+bool read_png(string const& path, Image& image)
+{
+  png_image png;
+  memset(&png, 0, sizeof(png));
+  png.version = PNG_IMAGE_VERSION;
+  if(!png_image_begin_read_from_file(&png, path.c_str()))
+  {
+    cerr << "[Image] Could not read " << path << ": " << png.message << endl;
+    return false;
+  }
+
+  png.format = PNG_FORMAT_RGB;
+  image.width = png.width;
+  image.height = png.height;
+  image.rgb.resize(PNG_IMAGE_SIZE(png));
+  if(!png_image_finish_read(&png, nullptr, image.rgb.data(), 0, nullptr))
+  {
+    cerr << "[Image] Could not decode " << path << ": " << png.message
+         << endl;
+    png_image_free(&png);
+    return false;
+  }
+  return true;
+}
+
+__attribute__((pure)) double rmse(Image const& a, Image const& b)
+{
+  double sum = 0.0;
+  for(size_t i = 0; i < a.rgb.size(); i++)
+  {
+    double d = ((double)a.rgb[i] - (double)b.rgb[i]) / 255.0;
+    sum += d * d;
+  }
+  return a.rgb.empty() ? 0.0 : sqrt(sum / (double)a.rgb.size());
+}
+
+__attribute__((const)) double psnr(double rmse)
+{
+  return rmse > 0.0 ? -20.0 * log10(rmse) : HUGE_VAL;
+}
@@ -0,0 +1,47 @@
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * 8 bit RGB image, rows top to bottom, tightly packed.
+ */
+struct Image
+{
+  unsigned int width;
+  unsigned int height;
+  std::vector<uint8_t> rgb;
+};
+
+/**
+ * Divides the color sums of an accumulation buffer by the sample count of
+ * each pixel. Pixels without samples are black.
+ * @param rgbw -> width * height * 4 floats, see Renderer::read_accumulation
+ */
+Image resolve(float const* rgbw, unsigned int width, unsigned int height);
+
+/**
+ * @return false on I/O or encoder errors
+ */
+bool write_png(std::string const& path, Image const& image);
+
+/**
+ * Reads any PNG, converted to 8 bit RGB.
+ * @return false if the file is missing or not a PNG
+ */
+bool read_png(std::string const& path, Image& image);
+
+/**
+ * Root mean square error over all channels, on a [0, 1] scale.
+ * Both images have to be of the same size.
+ */
+double rmse(Image const& a, Image const& b);
+
+/**
+ * Peak signal-to-noise ratio in dB for an rmse on a [0, 1] scale.
+ */
+double psnr(double rmse);
+
+#endif
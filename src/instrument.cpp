@@ -0,0 +1,127 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "instrument.hpp"
+
+using namespace std;
+
+char const* const counter_names[COUNTER_COUNT] = {
+    "triangles", "spheres", "nodes", "bounces"};
+
+/** Number of log2 histogram buckets, the last one is open **/
+#define HISTOGRAM_BUCKETS 24
+
+/**
+ * Blue - cyan - green - yellow - red, *t* in [0, 1]
+ */
+static void false_color(float t, uint8_t* rgb)
+{
+  static float const stops[5][3] = {{0.0f, 0.0f, 0.5f},
+                                    {0.0f, 1.0f, 1.0f},
+                                    {0.0f, 1.0f, 0.0f},
+                                    {1.0f, 1.0f, 0.0f},
+                                    {1.0f, 0.0f, 0.0f}};
+  t = min(max(t, 0.0f), 1.0f) * 4.0f;
+  unsigned int const i = min((unsigned int)t, 3u);
+  float const f = t - (float)i;
+  for(unsigned int c = 0; c < 3; c++)
+  {
+    float const v = stops[i][c] + f * (stops[i + 1][c] - stops[i][c]);
+    rgb[c] = (uint8_t)(255.0f * v + 0.5f);
+  }
+}
+
+/**
+ * Per pixel and sample averages of one counter.
+ */
+static vector<float> averages(uint32_t const* counters,
+                              unsigned int channel,
+                              size_t pixels,
+                              unsigned int samples)
+{
+  float const n = samples > 0 ? (float)samples : 1.0f;
+  vector<float> values(pixels);
+  for(size_t i = 0; i < pixels; i++)
+    values[i] = (float)counters[COUNTER_COUNT * i + channel] / n;
+  return values;
+}
+
+Image heatmap(uint32_t const* counters,
+              unsigned int channel,
+              unsigned int width,
+              unsigned int height,
+              unsigned int samples)
+{
+  vector<float> const values =
+      averages(counters, channel, (size_t)width * height, samples);
+  float const peak =
+      values.empty() ? 0.0f : *max_element(values.begin(), values.end());
+
+  Image image;
+  image.width = width;
+  image.height = height;
+  image.rgb.resize(values.size() * 3);
+  for(size_t i = 0; i < values.size(); i++)
+    false_color(peak > 0.0f ? values[i] / peak : 0.0f, &image.rgb[3 * i]);
+  return image;
+}
+
+bool write_instrumentation(string const& prefix,
+                           uint32_t const* counters,
+                           unsigned int width,
+                           unsigned int height,
+                           unsigned int samples)
+{
+  size_t const pixels = (size_t)width * height;
+  ofstream report(prefix + "-histograms.txt");
+  report << "# " << width << "x" << height << ", " << samples
+         << " samples. Values are per pixel and sample." << endl;
+
+  for(unsigned int c = 0; c < COUNTER_COUNT; c++)
+  {
+    string const path = prefix + "-" + counter_names[c] + ".png";
+    if(!write_png(path, heatmap(counters, c, width, height, samples)))
+      return false;
+
+    vector<float> const values = averages(counters, c, pixels, samples);
+    if(values.empty())
+      continue;
+
+    double sum = 0.0;
+    size_t histogram[HISTOGRAM_BUCKETS] = {0};
+    for(auto v = values.begin(); v != values.end(); v++)
+    {
+      sum += (double)*v;
+      /* Bucket 0 holds [0, 1), bucket k [2^(k-1), 2^k) */
+      int bucket = *v < 1.0f ? 0 : 1 + (int)floor(log2f(*v));
+      histogram[min(bucket, HISTOGRAM_BUCKETS - 1)]++;
+    }
+
+    auto range = minmax_element(values.begin(), values.end());
+    report << endl
+           << counter_names[c] << ": min " << *range.first << ", mean "
+           << sum / (double)pixels << ", max " << *range.second
+           << ", frame total " << sum << endl;
+
+    int last = HISTOGRAM_BUCKETS - 1;
+    while(last > 0 && histogram[last] == 0)
+      last--;
+    for(int b = 0; b <= last; b++)
+    {
+      double const lower = b == 0 ? 0.0 : ldexp(1.0, b - 1);
+      report << "  [" << lower << ", ";
+      if(b == HISTOGRAM_BUCKETS - 1)
+        report << "inf)";
+      else
+        report << ldexp(1.0, b) << ")";
+      report << "\t" << histogram[b] << endl;
+    }
+  }
+
+  cout << "[Instrument] Wrote " << prefix << "-*.png and " << prefix
+       << "-histograms.txt" << endl;
+  return report.good();
+}
@@ -0,0 +1,40 @@
+#ifndef __INSTRUMENT_H__
+#define __INSTRUMENT_H__
+
+#include <cstdint>
+#include <string>
+
+#include "image.hpp"
+
+#define COUNTER_COUNT 4
+
+/**
+ * Names of the per-pixel counters of an instrumented build, in the order
+ * of Renderer::read_counters.
+ */
+extern char const* const counter_names[COUNTER_COUNT];
+
+/**
+ * False-color map of counter *channel*, averaged per sample: dark blue for
+ * the cheapest pixels up to red for the most expensive one.
+ * @param counters -> width * height * COUNTER_COUNT values
+ */
+Image heatmap(uint32_t const* counters,
+              unsigned int channel,
+              unsigned int width,
+              unsigned int height,
+              unsigned int samples);
+
+/**
+ * Writes <prefix>-<counter>.png for every counter, and
+ * <prefix>-histograms.txt with min/mean/max per pixel and sample and a
+ * log2 histogram of every counter.
+ * @return false on I/O errors
+ */
+bool write_instrumentation(std::string const& prefix,
+                           uint32_t const* counters,
+                           unsigned int width,
+                           unsigned int height,
+                           unsigned int samples);
+
+#endif
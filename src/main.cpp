@@ -2,7 +2,17 @@
 #include <cmath>
 #include <glm/glm.hpp>
 #include <glm/gtc/constants.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <chrono>
 #include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdexcept>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <thread>
 
 #define __USE_BSD // to get usleep
 #include <unistd.h>
@@ -14,67 +24,344 @@ pthread_cond_timedwait(&notifier, &mutex, &abstime);*/
 
 #include "scene_helper.hpp"
 #include "sdl.hpp"
+#include "exchange.hpp"
 #include "cl.hpp"
+#include "scene_cache.hpp"
+#include "paging.hpp"
+#include "governor.hpp"
+#include "renderer.hpp"
+#include "parallel.hpp"
+#include "quality.hpp"
+#include "instrument.hpp"
+#include "sampler.hpp"
+#include "sequence.hpp"
+#include "batch.hpp"
+#include "raycast.hpp"
 
 using namespace std;
 using namespace OpenCL;
 
-void push_camera(cl::CommandQueue const& queue,
-                 Camera const& camera,
-                 int const size_w,
-                 int const size_h,
-                 ObjectsBuffer const& obj,
-                 RemoteBuffer const& data_mem)
+/** Capacity of the objects buffer, in primitives **/
+static unsigned int const max_primitives = 1000;
+/**
+ * Generators of the built-in and the random scene, see scene_key. Change
+ * the version with the scene, so stale caches are rebuilt.
+ */
+static char const* const builtin_generator = "builtin 1";
+static char const* const random_generator = "random 1";
+static unsigned int const max_bounces = 3;
+/** Input the presentation loop can queue before the render thread drains it **/
+#define COMMAND_QUEUE_SIZE 64
+
+/** Resident clusters of a paged scene, unless --paging-slots says else **/
+static unsigned int const default_paging_slots = 64;
+
+/**
+ * Command line options shared by the interactive and headless modes.
+ */
+struct Options
 {
-  /**
-  * Main kernel function.
-  * general_data is an array of 19 4-byte units:
-  * fovy, aspect :: Float
-  * posx, posy, posz :: Float
-  * dirx, diry, dirz :: Float
-  * upx, upy, upz :: Float
-  * leftx, lefty, leftz :: Float
-  * size_w, size_h :: UInt
-  * num_surfs :: UInt
-  * num_lamps :: UInt
-  * off_lamps :: UInt
-   */
-  float data[17];
-  data[0] = camera.fov;
-  data[1] = float(size_w) / float(size_h);
-  data[2] = camera.pos.x;
-  data[3] = camera.pos.y;
-  data[4] = camera.pos.z;
-  data[5] = camera.dir.x;
-  data[6] = camera.dir.y;
-  data[7] = camera.dir.z;
-  data[8] = camera.up.x;
-  data[9] = camera.up.y;
-  data[10] = camera.up.z;
-  data[11] = camera.left.x;
-  data[12] = camera.left.y;
-  data[13] = camera.left.z;
-
-  int* data_i = (int*)(data + 14);
-  data_i[0] = size_w;
-  data_i[1] = size_h;
-  data_i[2] = obj.surf_count;
-  data_i[3] = obj.lamp_count;
-  data_i[4] = obj.lamp_float_index;
-
-  writeBufferBlocking(queue, data_mem, data);
+  string scene_cache_path;
+  bool fast_math = false;
+  /** Probe work-group sizes that haven't been tuned yet **/
+  bool tune = false;
+  /** Persistent work-groups instead of one work-item per pixel **/
+  bool persistent = false;
+  /** Build the kernels with per-pixel counters **/
+  bool instrument = false;
+  unsigned int sampler = SAMPLER_SOBOL;
+  /** Clustered scene file, empty to upload the whole scene **/
+  string paging_path;
+  unsigned int paging_slots = default_paging_slots;
+  /** How straddling primitives are placed in the octree **/
+  OctreeOptions octree;
+  /** Triangles of the random scene built instead of the built-in one **/
+  unsigned int random_triangles = 0;
+};
+
+/**
+ * The scene as it is uploaded: either built here or mapped from the cache.
+ */
+struct SceneSource
+{
+  SceneCache cache;
+  Octree* octree = nullptr;
+  vector<float> octree_array;
+  unordered_multimap<unsigned int, Octree*> prim_nodes;
+  /** The object moved by --animate **/
+  unsigned int ball = 0;
+
+  float const* surfaces = nullptr;
+  float const* lamps = nullptr;
+  float const* octree_data = nullptr;
+  unsigned int octree_size = 0;
+  /** scene_key of a built scene, the caches are checked against it **/
+  uint64_t key = 0;
+
+  /** Paged scenes only, see prepare_paging **/
+  ClusterCache clusters;
+  unsigned int paging_slots = 0;
+  /** Buffer sizes the renderer is constructed with **/
+  unsigned int capacity = 0;
+
+  ~SceneSource(void) { delete octree; }
+};
+
+unsigned int create_scene(Scene& scene);
+
+/**
+ * Capacity of the objects buffer the scene of *options* is built in.
+ */
+__attribute__((pure)) unsigned int scene_capacity(Options const& options)
+{
+  return options.random_triangles > 0
+             ? options.random_triangles + RANDOM_SCENE_EXTRA
+             : max_primitives;
+}
+
+/**
+ * Maps the scene of *options* from its scene cache if that was stored for
+ * the same generator, octree options and buffer capacity. Then the scene
+ * isn't built at all: *obuf* only gets the layout of the mapped one.
+ * Otherwise the scene and its octree are built and the cache stored.
+ */
+void load_scene(Scene& scene,
+                ObjectsBuffer& obuf,
+                Options const& options,
+                SceneSource& source)
+{
+  string const& cache_path = options.scene_cache_path;
+  string const generator =
+      options.random_triangles > 0
+          ? random_generator + string(" ") +
+                to_string(options.random_triangles)
+          : builtin_generator;
+  source.key = scene_key(generator, options.octree, obuf.max_count);
+  source.capacity = obuf.max_count;
+  if(!cache_path.empty() &&
+     source.cache.load(cache_path, obuf.max_count, source.key))
+  {
+    SceneCacheHeader const& h = source.cache.header();
+    obuf.surf_count = h.surf_count;
+    obuf.lamp_count = h.lamp_count;
+    obuf.surf_float_index = h.surf_count * PRIM_SIZE;
+    obuf.lamp_float_index = h.lamp_float_index;
+    source.surfaces = source.cache.surfaces();
+    source.lamps = source.cache.lamps();
+    source.octree_data = source.cache.octree();
+    source.octree_size = h.octree_size;
+  }
+  else
+  {
+    if(options.random_triangles > 0)
+      random_scene(scene, options.random_triangles);
+    else
+      source.ball = create_scene(scene);
+    source.surfaces = obuf.buffer;
+    source.lamps = obuf.buffer + obuf.lamp_float_index;
+
+    source.octree = scene.build_octree(options.octree);
+    source.octree_size = source.octree->array_size();
+    source.octree_array.resize(source.octree_size);
+    source.octree->print_to_array(source.octree_array.data());
+    source.octree->index(source.prim_nodes);
+    source.octree_data = source.octree_array.data();
+
+    if(!cache_path.empty())
+      SceneCache::store(
+          cache_path, obuf, source.octree_data, source.octree_size, source.key);
+  }
+
+  cout << "[Main] Size of octree: " << source.octree_size << " floats"
+       << endl;
+}
+
+/**
+ * Maps the clustered scene at *path*, see split_scene. The scene isn't
+ * built: the renderer buffers are sized from the file for *slots* resident
+ * clusters.
+ * @return false if the file is missing or invalid
+ */
+bool prepare_paging(string const& path, unsigned int slots, SceneSource& source)
+{
+  if(!source.clusters.load(path))
+  {
+    cerr << "[Main] No cluster file at " << path
+         << ", make one with --split-scene." << endl;
+    return false;
+  }
+
+  source.paging_slots =
+      max(1u, min(slots, source.clusters.header().cluster_count));
+  source.capacity = source.clusters.max_primitives(source.paging_slots);
+  source.octree_size = source.clusters.octree_size(source.paging_slots);
+  cout << "[Main] Paged octree: " << source.octree_size << " floats with "
+       << source.paging_slots << " resident clusters" << endl;
+  return true;
+}
+
+/**
+ * The scene of *options*: mapped from its cluster file if it is paged,
+ * otherwise built in *obuf* or loaded from the scene cache.
+ * @return false if a paged scene can't be mapped
+ */
+bool prepare_scene(Scene& scene,
+                   ObjectsBuffer& obuf,
+                   Options const& options,
+                   SceneSource& source)
+{
+  if(!options.paging_path.empty())
+    return prepare_paging(options.paging_path, options.paging_slots, source);
+  load_scene(scene, obuf, options, source);
+  return true;
+}
+
+/**
+ * Builds the scene of *options*, or maps it from the scene cache, and
+ * stores it split into clusters at *path* for --paging. Needs no device,
+ * so large scenes can be split offline once.
+ * @return The exit status
+ */
+int split_scene(Options const& options, string const& path)
+{
+  unsigned int const capacity = scene_capacity(options);
+  vector<float> primitive_buffer((size_t)capacity * PRIM_SIZE);
+  ObjectsBuffer obuf(primitive_buffer.data(), capacity);
+  Scene scene(obuf);
+  SceneSource source;
+  load_scene(scene, obuf, options, source);
+  return ClusterCache::store(path,
+                             obuf,
+                             source.surfaces,
+                             source.lamps,
+                             source.octree_data)
+             ? 0
+             : 1;
+}
+
+/**
+ * Uploads *source* whole, or its resident part if it is paged.
+ */
+void upload(Renderer& renderer,
+            ObjectsBuffer const& obuf,
+            SceneSource const& source)
+{
+  if(source.paging_slots > 0)
+    renderer.upload_paged_scene(source.clusters, source.paging_slots);
+  else
+    renderer.upload_scene(obuf,
+                          source.surfaces,
+                          source.lamps,
+                          source.octree_data,
+                          source.octree_size,
+                          source.key);
+}
+
+/**
+ * Moves object *handle* and uploads only what changed: the primitive ranges
+ * of the object and the bounds of the refitted octree nodes.
+ */
+void update_object(Renderer& renderer,
+                   Scene& scene,
+                   unordered_multimap<unsigned int, Octree*> const& prim_nodes,
+                   unsigned int handle,
+                   glm::mat4 const& transform,
+                   ObjectsBuffer const& obj)
+{
+  vector<unsigned int> changed;
+  scene.set_transform(handle, transform, changed);
+
+  vector<Octree*> nodes;
+  for(auto i = changed.begin(); i != changed.end(); i++)
+  {
+    auto const range = prim_nodes.equal_range(*i);
+    for(auto n = range.first; n != range.second; n++)
+      nodes.push_back(n->second);
+  }
+  nodes = Octree::refit(nodes, [&scene](unsigned int prim) {
+    return scene.bounds(prim);
+  });
+
+  renderer.upload_object(obj, scene.object(handle), nodes);
 }
 
-void push_data(cl::CommandQueue const& queue,
-               ObjectsBuffer const& obj,
-               RemoteBuffer const& objects_mem)
+/**
+ * Input the presentation loop hands to the render thread.
+ */
+struct Command
 {
-  // TODO fix writeBuffer, so that is doesn't copy EVERYTHING
+  bool quit;
+  /** Held keys, and the mouse movement since the last command **/
+  SDL::Motion motion;
+};
+
+/**
+ * A finished frame on its way to the presentation loop.
+ */
+struct Frame
+{
+  vector<uint32_t> pixels;
+  int width;
+  int height;
+};
+
+__attribute__((const)) Camera default_camera(void)
+{
+  Camera c;
+  c.pos = glm::vec3(-0.3f, 1.2f, 0.0f);
+  c.dir = glm::vec3(0.5f, -0.2f, -1.0f);
+  c.up = glm::vec3(0.0f, 1.0f, 0.0f);
+
+  c.fov = glm::quarter_pi<float>();
+
+  c.dir = glm::normalize(c.dir);
+  c.up = glm::normalize(c.up);
+  c.left = glm::cross(c.up, c.dir);
+  c.up = glm::cross(c.dir, c.left);
+  return c;
+}
 
-  writeBufferBlocking(queue, objects_mem, obj.buffer);
+/**
+ * Flies the camera: WASD/QE move along dir/left/up, the mouse turns it.
+ * @param dt - Seconds since the last frame
+ * @return true if the camera has moved
+ */
+bool move_camera(Camera& camera, SDL::Motion const& motion, float dt)
+{
+  float const speed = 1.0f;         // units per second
+  float const sensitivity = 0.004f; // radians per pixel
+
+  bool const moved = fabs(motion.forward) + fabs(motion.right) +
+                         fabs(motion.up) + fabs(motion.yaw) +
+                         fabs(motion.pitch) >
+                     0.0f;
+  if(!moved)
+    return false;
+
+  glm::vec3 const world_up(0.0f, 1.0f, 0.0f);
+  camera.pos += speed * dt * (motion.forward * camera.dir -
+                              motion.right * camera.left +
+                              motion.up * camera.up);
+
+  glm::mat4 turn = glm::rotate(
+      glm::mat4(1.0f), -sensitivity * motion.yaw, world_up);
+  turn = glm::rotate(turn, sensitivity * motion.pitch, camera.left);
+  glm::vec3 dir =
+      glm::normalize(glm::vec3(turn * glm::vec4(camera.dir, 0.0f)));
+
+  /* Don't flip over the poles */
+  if(fabs(glm::dot(dir, world_up)) < 0.99f)
+    camera.dir = dir;
+
+  camera.left = glm::normalize(glm::cross(world_up, camera.dir));
+  camera.up = glm::cross(camera.dir, camera.left);
+  return true;
 }
 
-void create_scene(Scene& scene)
+/**
+ * @return The handle of the object moved by --animate
+ */
+unsigned int create_scene(Scene& scene)
 {
   cout << "[Main] Queueing models." << endl;
 
@@ -88,37 +375,427 @@ void create_scene(Scene& scene)
 
   Material const white(DIFFUSE, 1.0f, 0.0f, glm::vec3(1.0f));
 
-  scene.push_matrix();
-  scene.translate(1.5f, 1.5f, -1.5f);
-  room(scene, 3.f, 3.f, 3.f, white);
-  scene.pop_matrix();
+  /** Parts of the scene, built on threads of their own and merged in order **/
+  enum Part
+  {
+    ROOM,
+    LAMP,
+    TABLE,
+    SPHERES,
+    PARTS
+  };
+
+  auto const build = [&](Scene& part, unsigned int p) {
+    switch((Part)p)
+    {
+    case ROOM:
+      part.translate(1.5f, 1.5f, -1.5f);
+      room(part, 3.f, 3.f, 3.f, white);
+      break;
+    case LAMP:
+      part.translate(2.8f, 2.8f, -1.5f);
+      box(part, 0.4f, 0.4f, 0.4f, lamp);
+      break;
+    case TABLE:
+      part.translate(0.2f, 0.0f, -3.f + 0.85f);
+      Table::render(part);
+      break;
+    case SPHERES:
+      part.sphere(mirror, glm::vec3(0.5f, 0.85f, -2.5f), 0.1f);
+      part.begin_object();
+      part.sphere(red, glm::vec3(0.85f, 0.83f, -2.4f), 0.08f);
+      part.end_object();
+      break;
+    case PARTS:
+    default:
+      break;
+    }
+  };
+  vector<unsigned int> const handles = scene.build_parallel(PARTS, build);
+  /* The first and only object of its part */
+  unsigned int const ball = handles[SPHERES];
 
-  scene.push_matrix();
-  scene.translate(2.8f, 2.8f, -1.5f);
-  box(scene, 0.4f, 0.4f, 0.4f, lamp);
-  scene.pop_matrix();
+  cout << "[Main] Done." << endl;
+  return ball;
+}
 
-  scene.push_matrix();
-  scene.translate(0.2f, 0.0f, -3.f + 0.85f);
-  Table::render(scene);
-  scene.pop_matrix();
+/**
+ * Sets up an OpenCL context, the scene and a renderer without a window and
+ * hands the renderer to *body*.
+ * @return The exit status returned by *body*, 1 on errors
+ */
+int run_headless(unsigned int width,
+                 unsigned int height,
+                 Options const& options,
+                 function<int(Renderer&)> const& body)
+{
+  unsigned int const capacity = scene_capacity(options);
+  vector<float> primitive_buffer((size_t)capacity * PRIM_SIZE);
+  ObjectsBuffer obuf(primitive_buffer.data(), capacity);
+  Scene scene(obuf);
+  SceneSource source;
 
-  cout << "[Main] Done." << endl;
+  try
+  {
+    Environment env(1, CL_DEVICE_TYPE_ALL);
+    if(!prepare_scene(scene, obuf, options, source))
+      return 1;
+
+    Renderer renderer(env,
+                      width,
+                      height,
+                      source.capacity,
+                      source.octree_size,
+                      max_bounces,
+                      options.fast_math);
+    renderer.set_instrumented(options.instrument);
+    renderer.set_sampler(options.sampler);
+    upload(renderer, obuf, source);
+    renderer.set_camera(default_camera());
+
+    WorkGroupTuner tuner;
+    renderer.tune(tuner, options.tune);
+    renderer.set_persistent(options.persistent);
+    return body(renderer);
+  }
+  catch(OpenCLException& e)
+  {
+    e.print();
+  }
+  catch(std::exception& e)
+  {
+    cerr << e.what() << endl;
+  }
+  return 1;
 }
 
-int main(void)
+/**
+ * Renders the jobs of *source* (see Batch::Queue) on one device context,
+ * with the scene of the options as the built-in one.
+ * @return The exit status of Batch::run, 1 on errors
+ */
+int run_batch(string const& source, bool watch, Options const& options)
+{
+  unsigned int const capacity = scene_capacity(options);
+  vector<float> primitive_buffer((size_t)capacity * PRIM_SIZE);
+  ObjectsBuffer obuf(primitive_buffer.data(), capacity);
+  Scene scene(obuf);
+  SceneSource builtin;
+
+  try
+  {
+    Environment env(1, CL_DEVICE_TYPE_ALL);
+    load_scene(scene, obuf, options, builtin);
+
+    Batch::Settings settings;
+    settings.max_bounces = max_bounces;
+    settings.fast_math = options.fast_math;
+    settings.sampler = options.sampler;
+    settings.persistent = options.persistent;
+    settings.tune = options.tune;
+    settings.seed = 0;
+
+    Batch::Queue queue(source, watch);
+    return Batch::run(env,
+                      queue,
+                      settings,
+                      {obuf,
+                       builtin.surfaces,
+                       builtin.lamps,
+                       builtin.octree_data,
+                       builtin.octree_size,
+                       builtin.key});
+  }
+  catch(OpenCLException& e)
+  {
+    e.print();
+  }
+  catch(std::exception& e)
+  {
+    cerr << e.what() << endl;
+  }
+  return 1;
+}
+
+/**
+ * Prints the command line options to stderr.
+ */
+void print_usage(char const* name)
+{
+  cerr << "Usage: " << name
+       << " [--scene-cache <file>] [--animate] [--target-ms <ms>]"
+       << " [--fast-math] [--tune] [--persistent]\n"
+       << "       [--sampler random|sobol|blue-noise]"
+       << " [--paging <file> [--paging-slots <n>]]\n"
+       << "       [--loose <factor>] [--split-refs <max>]"
+       << " [--random-scene <triangles>] [--split-scene <file>]\n"
+       << "       [--workers <n> [--samples <spp>] [--export-every <spp>]"
+       << " [--seed <n>] [--size <w> <h>] [--output <png>]\n"
+       << "        [--checkpoint <file> [--checkpoint-every <s>]"
+       << " [--resume] [--time-limit <s>]]]\n"
+       << "       [--batch <dir>|- [--watch]]\n"
+       << "       [--sequence <keyframes> --frames <n> [--encoders <n>]"
+       << " [--samples <spp>] [--size <w> <h>] [--output <png>]]\n"
+       << "       [--reference <png> [--update-reference]"
+       << " [--reference-samples <spp>] [--threshold <rmse>]"
+       << " [--tolerance <fraction>]]\n"
+       << "       [--instrument <prefix> [--samples <spp>]]\n"
+       << "       [--raycast-bench <triangles> <rays>]" << endl;
+}
+
+int main(int argc, char** argv)
 {
   cout << "[Main] Entry." << endl;
 
+  Options options;
+  string instrument_prefix;
+  bool animate = false;
+  float target_ms = 0.0f;
+
+  Parallel::Job job;
+  job.width = 100;
+  job.height = 100;
+  job.samples = 256;
+  job.workers = 0;
+  job.export_every = 16;
+  job.seed = 0;
+  job.output = "render.png";
+  job.checkpoint_every = 600;
+  job.resume = false;
+  job.time_limit = 0;
+
+  Quality::Job quality;
+  quality.reference_samples = 4096;
+  quality.check_every = 4;
+  quality.threshold = 0.05;
+  quality.tolerance = 0.2;
+  quality.update = false;
+
+  string batch_source;
+  bool watch = false;
+
+  /** Cluster file to write for --paging **/
+  string split_path;
+
+  /** Host ray query benchmark, see Raycast::benchmark **/
+  unsigned int bench_triangles = 0;
+  size_t bench_rays = 0;
+
+  string sequence_path;
+  Sequence::Job sequence;
+  sequence.frames = 0;
+  sequence.encoders = 0;
+
+  /** Option being parsed, to report values stoul and stof reject **/
+  string arg;
+  try
+  {
+    for(int i = 1; i < argc; i++)
+    {
+      arg = argv[i];
+      if(arg == "--scene-cache" && i + 1 < argc)
+        options.scene_cache_path = argv[++i];
+      else if(arg == "--animate")
+        animate = true;
+      else if(arg == "--fast-math")
+        options.fast_math = true;
+      else if(arg == "--tune")
+        options.tune = true;
+      else if(arg == "--persistent")
+        options.persistent = true;
+      else if(arg == "--sampler" && i + 1 < argc &&
+              parse_sampler(argv[i + 1], options.sampler))
+        i++;
+      else if(arg == "--paging" && i + 1 < argc)
+        options.paging_path = argv[++i];
+      else if(arg == "--paging-slots" && i + 1 < argc)
+        options.paging_slots = (unsigned int)stoul(argv[++i]);
+      else if(arg == "--loose" && i + 1 < argc)
+        options.octree.looseness = max(1.0f, stof(argv[++i]));
+      else if(arg == "--split-refs" && i + 1 < argc)
+        options.octree.max_refs = max(1u, (unsigned int)stoul(argv[++i]));
+      else if(arg == "--random-scene" && i + 1 < argc)
+        options.random_triangles = (unsigned int)stoul(argv[++i]);
+      else if(arg == "--split-scene" && i + 1 < argc)
+        split_path = argv[++i];
+      else if(arg == "--instrument" && i + 1 < argc)
+        instrument_prefix = argv[++i];
+      else if(arg == "--target-ms" && i + 1 < argc)
+        target_ms = stof(argv[++i]);
+      else if(arg == "--workers" && i + 1 < argc)
+        job.workers = (unsigned int)stoul(argv[++i]);
+      else if(arg == "--samples" && i + 1 < argc)
+        job.samples = (unsigned int)stoul(argv[++i]);
+      else if(arg == "--export-every" && i + 1 < argc)
+        job.export_every = max(1u, (unsigned int)stoul(argv[++i]));
+      else if(arg == "--checkpoint" && i + 1 < argc)
+        job.checkpoint = argv[++i];
+      else if(arg == "--checkpoint-every" && i + 1 < argc)
+        job.checkpoint_every = (unsigned int)stoul(argv[++i]);
+      else if(arg == "--resume")
+        job.resume = true;
+      else if(arg == "--time-limit" && i + 1 < argc)
+        job.time_limit = (unsigned int)stoul(argv[++i]);
+      else if(arg == "--seed" && i + 1 < argc)
+        job.seed = stoull(argv[++i]);
+      else if(arg == "--size" && i + 2 < argc)
+      {
+        job.width = (unsigned int)stoul(argv[++i]);
+        job.height = (unsigned int)stoul(argv[++i]);
+      }
+      else if(arg == "--batch" && i + 1 < argc)
+        batch_source = argv[++i];
+      else if(arg == "--watch")
+        watch = true;
+      else if(arg == "--sequence" && i + 1 < argc)
+        sequence_path = argv[++i];
+      else if(arg == "--frames" && i + 1 < argc)
+        sequence.frames = (unsigned int)stoul(argv[++i]);
+      else if(arg == "--encoders" && i + 1 < argc)
+        sequence.encoders = (unsigned int)stoul(argv[++i]);
+      else if(arg == "--output" && i + 1 < argc)
+        job.output = argv[++i];
+      else if(arg == "--reference" && i + 1 < argc)
+        quality.reference = argv[++i];
+      else if(arg == "--update-reference")
+        quality.update = true;
+      else if(arg == "--reference-samples" && i + 1 < argc)
+        quality.reference_samples = (unsigned int)stoul(argv[++i]);
+      else if(arg == "--threshold" && i + 1 < argc)
+        quality.threshold = stod(argv[++i]);
+      else if(arg == "--tolerance" && i + 1 < argc)
+        quality.tolerance = stod(argv[++i]);
+      else if(arg == "--raycast-bench" && i + 2 < argc)
+      {
+        bench_triangles = (unsigned int)stoul(argv[++i]);
+        bench_rays = stoull(argv[++i]);
+      }
+      else
+      {
+        print_usage(argv[0]);
+        return 1;
+      }
+    }
+  }
+  catch(logic_error const&)
+  {
+    cerr << "[Main] Invalid value for " << arg << "." << endl;
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  if(animate && options.random_triangles > 0)
+  {
+    cout << "[Main] Only the built-in scene can be animated." << endl;
+    animate = false;
+  }
+  if(animate && !options.scene_cache_path.empty())
+  {
+    cout << "[Main] Animated scenes are built, not loaded from the cache."
+         << endl;
+    options.scene_cache_path.clear();
+  }
+  if(animate && !options.paging_path.empty())
+  {
+    cout << "[Main] Animated scenes can't be paged." << endl;
+    options.paging_path.clear();
+  }
+  if(!options.paging_path.empty() && options.random_triangles > 0 &&
+     split_path.empty())
+  {
+    cout << "[Main] A paged scene is the one of its cluster file." << endl;
+    options.random_triangles = 0;
+  }
+
+  /** Scene split for --paging, no device needed **/
+  if(!split_path.empty())
+    return split_scene(options, split_path);
+
+  /** Host ray queries, no device needed **/
+  if(bench_triangles > 0 && bench_rays > 0)
+    return Raycast::benchmark(
+        bench_triangles, bench_rays, options.octree, 0);
+
+  /** Headless still frame, split over worker processes **/
+  if(job.workers > 0)
+  {
+    return Parallel::coordinate(job, [&](unsigned int worker, int fd) {
+      return run_headless(
+          job.width, job.height, options, [&](Renderer& r) {
+            return Parallel::work(r, job, worker, fd);
+          });
+    });
+  }
+
+  /** Queue of renders on one device context **/
+  if(!batch_source.empty())
+  {
+    if(!options.paging_path.empty())
+      cout << "[Main] Batch jobs are not paged." << endl;
+    return run_batch(batch_source, watch, options);
+  }
+
+  /** Camera path rendered to numbered PNGs **/
+  if(!sequence_path.empty())
+  {
+    if(!Sequence::load_path(sequence_path, sequence.path) ||
+       sequence.frames == 0)
+    {
+      cerr << "[Main] Need a valid keyframe file and --frames." << endl;
+      return 1;
+    }
+    sequence.samples = job.samples;
+    sequence.seed = job.seed;
+    sequence.output = job.output;
+    return run_headless(job.width, job.height, options, [&](Renderer& r) {
+      return Sequence::run(r, sequence);
+    });
+  }
+
+  /** Time-to-quality check against a reference image **/
+  if(!quality.reference.empty())
+  {
+    quality.max_samples = job.samples;
+    quality.seed = job.seed;
+    return run_headless(job.width, job.height, options, [&](Renderer& r) {
+      return Quality::run(r, quality);
+    });
+  }
+
+  /** Per-pixel cost heatmaps and histograms **/
+  if(!instrument_prefix.empty())
+  {
+    options.instrument = true;
+    return run_headless(job.width, job.height, options, [&](Renderer& r) {
+      for(unsigned int s = 0; s < job.samples; s++)
+        r.render();
+
+      size_t const pixels = r.width() * r.height();
+      vector<float> rgbw(pixels * 4);
+      r.read_accumulation(rgbw.data());
+      write_png(instrument_prefix + "-image.png",
+                resolve(rgbw.data(), r.width(), r.height()));
+
+      vector<uint32_t> counters(pixels * COUNTER_COUNT);
+      r.read_counters(counters.data());
+      return write_instrumentation(instrument_prefix,
+                                   counters.data(),
+                                   r.width(),
+                                   r.height(),
+                                   r.sample_count())
+                 ? 0
+                 : 1;
+    });
+  }
+
   unsigned int const size_w = 100;
   unsigned int const size_h = 100;
 
-  uint32_t* frame_buffer = new uint32_t[size_w * size_h];
-  size_t const max_primitives = 1000;
-  float* primitive_buffer = new float[max_primitives * PRIM_SIZE];
-  ObjectsBuffer obuf(primitive_buffer, max_primitives);
+  unsigned int const capacity = scene_capacity(options);
+  float* primitive_buffer = new float[(size_t)capacity * PRIM_SIZE];
+  ObjectsBuffer obuf(primitive_buffer, capacity);
 
-  if(frame_buffer == nullptr || primitive_buffer == nullptr)
+  if(primitive_buffer == nullptr)
   {
     cerr << "[Main] Coundn't allocate local buffers" << endl;
     return 1;
@@ -136,120 +813,172 @@ int main(void)
     /** OpenCL **/
     Environment env(1, CL_DEVICE_TYPE_ALL);
 
-    /** Kernel **/
-    string tracer("./cl/ray_frag.cl");
-    string tracer_main("trace");
-    OpenCL::Kernel path_tracer(tracer, tracer_main);
-
     /** Scene **/
     Scene scene(obuf);
+    SceneSource source;
+    if(!prepare_scene(scene, obuf, options, source))
+      throw std::runtime_error("[Main] Could not page the scene.");
+
+    /** Kernel and buffers **/
+    Renderer renderer(env,
+                      size_w,
+                      size_h,
+                      source.capacity,
+                      source.octree_size,
+                      max_bounces,
+                      options.fast_math);
+    renderer.set_sampler(options.sampler);
 
-    create_scene(scene);
+    /** Camera **/
+    Camera c = default_camera();
 
     /**
-     * PRNG
-     * adapted from svenstaro's trac0r
-     * 01.01.2016 => github.com/svenstaro/trac0r
+     * Internal resolution. Buffers are allocated for the window size, or
+     * less if it doesn't fit device memory. The governor may render less
+     * still and have it scaled up.
      */
-    unsigned long prng[17];
-    for(int i = 0; i < 16; i++)
-      prng[i] = (unsigned long)rand() << 32 | (unsigned long)rand();
-    prng[16] = 0;
-
-    unsigned int max_bounces = 3;
-    unsigned int float_size = 4; // byte. as defined in specification
-    unsigned int global_float_ptr_size =
-        get_device_info_(env.m_devices[0], CL_DEVICE_ADDRESS_BITS, cl_uint) / 8;
-
-    /**
-    * Total size for bdpt_buffer in bytes.
-    * float3 has to be aligned to float4 =/
-    */
-    size_t aux_bytes_per_pixel = global_float_ptr_size // size of a float ptr
-                                 + 4 * float_size; // size of bounce position
-
-    cout << "[Main] Size of aux pixel unit: " << aux_bytes_per_pixel << " byte"
-         << endl;
-
-    size_t bdpt_byte = max_bounces       // how many bounces
-                       * size_w * size_h // per pixel (per id)
-                       * 2               // from eye and from lamp
-                       * aux_bytes_per_pixel;
-
-    size_t bdpt_kib = bdpt_byte / 1024;
-    size_t bdpt_printed = bdpt_kib >= 1024 ? bdpt_kib / 1024 : bdpt_kib;
-    string unit = bdpt_kib >= 1024 ? " MiB" : " KiB";
-    cout << "[Main] Size of aux buffer: " << bdpt_printed << unit << endl;
-
-    /** Buffers **/
-    RemoteBuffer /*float */ data_mem = env.allocate(19 * sizeof(float));
-    RemoteBuffer /*float */ objects_mem =
-        env.allocate(max_primitives * PRIM_SIZE * sizeof(float));
-    RemoteBuffer /*float */ octree_mem = env.allocate(bdpt_byte);
-    RemoteBuffer /*char4 */ frame_c_mem =
-        env.allocate(size_h * size_w * sizeof(uint32_t));
-    RemoteBuffer /*float4*/ frame_f_mem =
-        env.allocate(size_h * size_w * 4 * sizeof(float));
-    RemoteBuffer /*float */ samples_mem = env.allocate(sizeof(float));
-    RemoteBuffer /*PRNG  */ prng_mem =
-        env.allocate(17 * sizeof(unsigned long), prng);
-
-    /** Prepare Kernel **/
-    path_tracer.make(env);
-    path_tracer.set_argument(0, data_mem);
-    path_tracer.set_argument(1, objects_mem);
-    path_tracer.set_argument(2, octree_mem);
-    path_tracer.set_argument(3, frame_c_mem);
-    path_tracer.set_argument(4, frame_f_mem);
-    path_tracer.set_argument(5, samples_mem);
-    path_tracer.set_argument(6, prng_mem);
-
-    cout << "[Main] PathTracer compiled" << endl;
-
-    /** Camera **/
-    Camera c;
-    c.pos = glm::vec3(-0.3f, 1.2f, 0.0f);
-    c.dir = glm::vec3(0.5f, -0.2, -1);
-    c.up = glm::vec3(0.0f, 1.0f, 0.0f);
-
-    c.fov = glm::quarter_pi<float>();
-
-    c.dir = glm::normalize(c.dir);
-    c.up = glm::normalize(c.up);
-    c.left = glm::cross(c.up, c.dir);
-    c.up = glm::cross(c.dir, c.left);
-
-    /** CommandQueue **/
-    cl::CommandQueue queue = env.create_queue();
+    Governor governor(renderer.width(), renderer.height(), target_ms);
 
     /** Push data to remote buffers **/
-    push_camera(queue, c, size_w, size_h, obuf, data_mem);
-    push_data(queue, obuf, objects_mem);
+    upload(renderer, obuf, source);
+    renderer.set_camera(c);
 
-    float samples = 0.0f;
-    while(!SDL::die)
+    /** Local size, per resolution **/
+    WorkGroupTuner tuner;
+    renderer.tune(tuner, options.tune);
+    renderer.set_persistent(options.persistent);
+
+    /**
+     * The render thread never waits for the display: finished frames go
+     * through a triple buffer, the main thread presents the newest one and
+     * queues the input back.
+     */
+    TripleBuffer<Frame> frames(Frame{vector<uint32_t>(size_w * size_h), 0, 0});
+    RingQueue<Command, COMMAND_QUEUE_SIZE> commands;
+    atomic<bool> rendering(true);
+    exception_ptr failure;
+
+    thread render_thread([&] {
+      try
+      {
+        SDL::Motion held = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+        bool quit = false;
+        unsigned int frame = 0;
+        auto last_frame = chrono::steady_clock::now();
+        while(!quit)
+        {
+          SDL::Motion motion = held;
+          motion.yaw = 0.0f;
+          motion.pitch = 0.0f;
+          Command command;
+          while(commands.pop(command))
+          {
+            quit = quit || command.quit;
+            motion.forward = command.motion.forward;
+            motion.right = command.motion.right;
+            motion.up = command.motion.up;
+            motion.yaw += command.motion.yaw;
+            motion.pitch += command.motion.pitch;
+          }
+          held = motion;
+
+          auto now = chrono::steady_clock::now();
+          float dt = chrono::duration<float>(now - last_frame).count();
+          last_frame = now;
+          /** Keep what is still visible from the new position **/
+          if(move_camera(c, motion, dt))
+            renderer.move_camera(c);
+          if(animate)
+          {
+            float const height = 0.15f * fabs(sin(0.1f * (float)frame++));
+            glm::mat4 const transform = glm::translate(
+                glm::mat4(1.0f), glm::vec3(0.0f, height, 0.0f));
+            update_object(renderer,
+                          scene,
+                          source.prim_nodes,
+                          source.ball,
+                          transform,
+                          obuf);
+            renderer.reset();
+          }
+          /** RUN KERNEL **/
+          float frame_ms = 0.0f;
+          for(unsigned int i = 0; i < governor.samples_per_frame(); i++)
+            frame_ms += renderer.render();
+
+          /** Read result from char-framebuffer and hand it over **/
+          Frame& out = frames.back();
+          renderer.read_frame(out.pixels.data());
+          out.width = (int)renderer.width();
+          out.height = (int)renderer.height();
+          frames.publish();
+          cout << "[Main] Samples: " << renderer.sample_count() << endl;
+          cout.flush();
+
+          if(target_ms > 0.0f && governor.update(frame_ms))
+          {
+            renderer.set_resolution(governor.width(), governor.height());
+            renderer.tune(tuner, options.tune);
+          }
+        }
+      }
+      catch(...)
+      {
+        failure = current_exception();
+      }
+      rendering = false;
+    });
+
+    /** Presentation and input, SDL stays on this thread **/
+    Command pending = {false, {0.0f, 0.0f, 0.0f, 0.0f, 0.0f}};
+    Command sent = pending;
+    while(rendering)
     {
       SDL::handleEvents();
-      samples++;
-      writeBufferBlocking(queue, samples_mem, &samples);
-      /** RUN KERNEL **/
-      path_tracer.enqueue(size_w, size_h, queue);
-
-      queue.finish();
-      /** Read result from char-framebuffer **/
-      readBufferBlocking(queue, frame_c_mem, frame_buffer);
-      /** Draw it **/
-      SDL::drawFrame(frame_buffer);
-      cout << "[Main] Samples: " << (int)samples << endl;
-      cout.flush();
+      SDL::Motion const motion = SDL::takeMotion();
+      pending.quit = SDL::die;
+      pending.motion.forward = motion.forward;
+      pending.motion.right = motion.right;
+      pending.motion.up = motion.up;
+      pending.motion.yaw += motion.yaw;
+      pending.motion.pitch += motion.pitch;
+
+      /* Only changes are sent, a full queue keeps them for the next try */
+      bool const changed =
+          pending.quit != sent.quit ||
+          fabs(pending.motion.forward - sent.motion.forward) +
+                  fabs(pending.motion.right - sent.motion.right) +
+                  fabs(pending.motion.up - sent.motion.up) +
+                  fabs(pending.motion.yaw) + fabs(pending.motion.pitch) >
+              0.0f;
+      if(changed && commands.push(pending))
+      {
+        sent = pending;
+        pending.motion.yaw = 0.0f;
+        pending.motion.pitch = 0.0f;
+      }
+
+      if(frames.update())
+      {
+        Frame const& shown = frames.front();
+        SDL::drawFrame(shown.pixels.data(), shown.width, shown.height);
+      }
+      else
+        SDL::wait(1);
     }
+    render_thread.join();
+    if(failure)
+      rethrow_exception(failure);
   }
   catch(OpenCLException& e)
   {
     e.print();
   }
+  catch(std::exception& e)
+  {
+    cerr << e.what() << endl;
+  }
 
-  delete[] frame_buffer;
   delete[] primitive_buffer;
 
   SDL::close();
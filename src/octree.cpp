@@ -1,4 +1,6 @@
 #include <glm/glm.hpp>
+#include <algorithm>
+#include <unordered_set>
 #include <vector>
 #include <iostream>
 
@@ -42,14 +44,17 @@ void push_vector(float* data, glm::vec3 const& vec)
   data[2] = vec.z;
 }
 
-Octree::Octree(AABB const& aabb_) : aabb(aabb_)
+Octree::Octree(AABB const& aabb_)
+    : aabb(aabb_), parent(nullptr), fit_lower(aabb_.lower),
+      fit_upper(aabb_.upper), array_offset(0)
 {
   for(int i = 0; i < 8; i++)
     sub[i] = nullptr;
 }
 
 Octree::Octree(glm::vec3 const& lower, glm::vec3 const& upper)
-    : aabb(lower, upper)
+    : aabb(lower, upper), parent(nullptr), fit_lower(lower), fit_upper(upper),
+      array_offset(0)
 {
   for(int i = 0; i < 8; i++)
     sub[i] = nullptr;
@@ -62,54 +67,107 @@ Octree::~Octree(void)
       delete sub[i];
 }
 
-Octree* Octree::insert(unsigned int val, AABB const& space)
+/**
+ * Surface area of the box between *lower* and *upper*, proportional to the
+ * chance that a random ray hits it.
+ */
+__attribute__((const)) static float surface_area(glm::vec3 lower,
+                                                 glm::vec3 upper)
+{
+  glm::vec3 const d = glm::max(upper - lower, glm::vec3(0.0f));
+  return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+__attribute__((pure)) AABB Octree::octant(unsigned int id) const
 {
   float size = aabb.upper.x - aabb.lower.x; // qubic dx=dy=dz
 
-  /** Check if it's a subspace [of one of the eight subspaces] **/
-  glm::vec3 lower;
-  glm::vec3 upper;
+  glm::vec3 lower = aabb.lower;
+  if(id / 4 == 1)
+    lower.x += size / 2.0f;
+  if((id % 4) / 2 == 1)
+    lower.y += size / 2.0f;
+  if(id % 2 == 1)
+    lower.z += size / 2.0f;
+  return AABB(lower, lower + (size / 2.0f) * glm::vec3(1.0f));
+}
 
-  if(space.is_subspace_of(aabb))
+Octree* Octree::child(unsigned int id)
+{
+  if(sub[id] == nullptr)
   {
-    for(int i = 0; i < 8; i++)
+    sub[id] = new Octree(octant(id));
+    sub[id]->parent = this;
+  }
+  return sub[id];
+}
+
+void Octree::add(unsigned int val,
+                 AABB const& space,
+                 OctreeOptions const& options,
+                 unsigned int refs,
+                 unsigned int depth)
+{
+  if(depth >= OCTREE_MAX_DEPTH)
+  {
+    primitives.push_back(val);
+    return;
+  }
+
+  /** Children take what is centred in their octant and fits loosely **/
+  glm::vec3 const mid = (aabb.lower + aabb.upper) * 0.5f;
+  glm::vec3 const centre = (space.lower + space.upper) * 0.5f;
+  unsigned int const id = (centre.x >= mid.x ? 4 : 0) +
+                          (centre.y >= mid.y ? 2 : 0) +
+                          (centre.z >= mid.z ? 1 : 0);
+  AABB const cell = octant(id);
+  glm::vec3 const slack((cell.upper.x - cell.lower.x) *
+                        (options.looseness - 1.0f) / 2.0f);
+  if(space.is_subspace_of(AABB(cell.lower - slack, cell.upper + slack)))
+  {
+    child(id)->add(val, space, options, refs, depth + 1);
+    return;
+  }
+
+  /** Split a straddler if rays would hit its parts less often **/
+  if(refs > 1)
+  {
+    vector<pair<unsigned int, AABB>> parts;
+    float split_cost = 0.0f;
+    for(unsigned int i = 0; i < 8; i++)
     {
-      if(sub[i] != nullptr)
-      {
-        if(space.is_subspace_of(sub[i]->aabb))
-        {
-          /* it's guaranteed that the given space is a subspace of
-            sub[i], therefore it doesn't have to be extended. */
-          (void)sub[i]->insert(val, space);
-          return this;
-        }
-      }
-      else
-      {
-        lower = aabb.lower;
-        int id = i;
-        if(id / 4 == 1)
-          lower.x += size / 2.0f;
-        if((id % 4) / 2 == 1)
-          lower.y += size / 2.0f;
-        if(id % 2 == 1)
-          lower.z += size / 2.0f;
-
-        upper = lower + (size / 2.0f) * glm::vec3(1.0f);
-        AABB subspace(lower, upper);
-
-        if(space.is_subspace_of(subspace))
-        {
-          /* it's guaranteed that the given space is a subspace of
-            sub[i], therefore it doesn't have to be extended. */
-          sub[i] = new Octree(subspace);
-          (void)sub[i]->insert(val, space);
-          return this;
-        }
-      }
+      AABB const part = octant(i);
+      glm::vec3 const lower = glm::max(space.lower, part.lower);
+      glm::vec3 const upper = glm::min(space.upper, part.upper);
+      if(lower.x > upper.x || lower.y > upper.y || lower.z > upper.z)
+        continue;
+      parts.push_back(make_pair(i, AABB(lower, upper)));
+      split_cost += surface_area(lower, upper);
     }
+    split_cost *= 1.0f + options.ref_cost;
 
-    primitives.push_back(val);
+    if(parts.size() <= refs &&
+       split_cost < surface_area(aabb.lower, aabb.upper))
+    {
+      unsigned int const share = refs / (unsigned int)parts.size();
+      for(auto i = parts.begin(); i != parts.end(); i++)
+        child(i->first)->add(val, i->second, options, share, depth + 1);
+      return;
+    }
+  }
+
+  primitives.push_back(val);
+}
+
+Octree* Octree::insert(unsigned int val,
+                       AABB const& space,
+                       OctreeOptions const& options)
+{
+  float size = aabb.upper.x - aabb.lower.x; // qubic dx=dy=dz
+
+  if(space.is_subspace_of(aabb))
+  {
+    add(val, space, options, max(options.max_refs, 1u), 0);
     return this;
   }
 
@@ -139,7 +197,8 @@ Octree* Octree::insert(unsigned int val, AABB const& space)
 
   Octree* ext = new Octree(new_lower, new_upper);
   ext->sub[id] = this;
-  return ext->insert(val, space);
+  parent = ext;
+  return ext->insert(val, space, options);
 }
 
 void Octree::print_info(void) const
@@ -176,13 +235,14 @@ float-size units difference to beginning of thus subtree
 * required in float-sized units
 * @param buffer_f - A pointer to the start of the available space.
 */
-unsigned int Octree::print_to_array(float* buffer_f) const
+unsigned int Octree::print_to_array(float* buffer_f, unsigned int base)
 {
+  array_offset = base;
   unsigned int offset = 0;
   int* buffer_i = (int*)buffer_f; // sozeof(int) == sizeof(float)
 
-  push_vector(buffer_f, aabb.lower);
-  push_vector(buffer_f + 3, aabb.upper);
+  push_vector(buffer_f, fit_lower);
+  push_vector(buffer_f + 3, fit_upper);
   offset += 6;
 
   buffer_i[offset] = (int)primitives.size();
@@ -202,13 +262,23 @@ unsigned int Octree::print_to_array(float* buffer_f) const
     else
     {
       buffer_i[offset + i] = (int)subsize + offset + 8;
-      subsize += sub[i]->print_to_array(buffer_f + offset + 8 + subsize);
+      subsize += sub[i]->print_to_array(buffer_f + offset + 8 + subsize,
+                                        base + offset + 8 + subsize);
     }
   }
 
   return offset + 8 + subsize;
 }
 
+__attribute__((pure)) unsigned int Octree::array_size(void) const
+{
+  unsigned int size = 6 + 1 + (unsigned int)primitives.size() + 8;
+  for(int i = 0; i < 8; i++)
+    if(sub[i] != nullptr)
+      size += sub[i]->array_size();
+  return size;
+}
+
 Octree* Octree::reconstruct(float* data_f)
 {
   glm::vec3 lower(data_f[0], data_f[1], data_f[2]);
@@ -227,11 +297,122 @@ Octree* Octree::reconstruct(float* data_f)
     if(off == -1)
       oct->sub[i] = nullptr;
     else
+    {
       oct->sub[i] = Octree::reconstruct(data_f + off);
+      oct->sub[i]->parent = oct;
+    }
   }
   return oct;
 }
 
+/**
+ * Adds the ids of the flattened node at *data_f* and its subtree to *seen*.
+ * @return false as soon as an id was there already
+ */
+static bool collect_ids(float const* data_f, unordered_set<int>& seen)
+{
+  int const* data_i = (int const*)data_f + 6;
+  int size = *data_i;
+  data_i++;
+  for(int i = 0; i < size; i++)
+    if(!seen.insert(data_i[i]).second)
+      return false;
+  data_i += size;
+
+  for(int i = 0; i < 8; i++)
+    if(data_i[i] != -1 && !collect_ids(data_f + data_i[i], seen))
+      return false;
+  return true;
+}
+
+bool Octree::shares_primitives(float const* data_f)
+{
+  unordered_set<int> seen;
+  return !collect_ids(data_f, seen);
+}
+
+/**
+ * Recomputes the bounds of this node only, from its primitives and the
+ * (already fitted) bounds of its children.
+ */
+static void fit_node(Octree* node, BoundsFunction const& bounds)
+{
+  bool empty = true;
+  glm::vec3 lower(node->aabb.lower);
+  glm::vec3 upper(node->aabb.upper);
+
+  for(auto i = node->primitives.begin(); i != node->primitives.end(); i++)
+  {
+    AABB space = bounds(*i);
+    lower = empty ? space.lower : glm::min(lower, space.lower);
+    upper = empty ? space.upper : glm::max(upper, space.upper);
+    empty = false;
+  }
+  for(int i = 0; i < 8; i++)
+  {
+    Octree* sub = node->sub[i];
+    if(sub == nullptr)
+      continue;
+    lower = empty ? sub->fit_lower : glm::min(lower, sub->fit_lower);
+    upper = empty ? sub->fit_upper : glm::max(upper, sub->fit_upper);
+    empty = false;
+  }
+
+  node->fit_lower = lower;
+  node->fit_upper = upper;
+}
+
+void Octree::fit(BoundsFunction const& bounds)
+{
+  for(int i = 0; i < 8; i++)
+    if(sub[i] != nullptr)
+      sub[i]->fit(bounds);
+  fit_node(this, bounds);
+}
+
+vector<Octree*> Octree::refit(vector<Octree*> const& nodes,
+                              BoundsFunction const& bounds)
+{
+  /** Collect the dirty nodes with their depth **/
+  unordered_map<Octree*, unsigned int> dirty;
+  for(auto i = nodes.begin(); i != nodes.end(); i++)
+    for(Octree* node = *i; node != nullptr; node = node->parent)
+      if(!dirty.insert(make_pair(node, 0)).second)
+        break; // the rest of the path is known already
+
+  vector<pair<unsigned int, Octree*>> order;
+  for(auto i = dirty.begin(); i != dirty.end(); i++)
+  {
+    unsigned int depth = 0;
+    for(Octree* node = i->first->parent; node != nullptr; node = node->parent)
+      depth++;
+    order.push_back(make_pair(depth, i->first));
+  }
+
+  /** Deepest first, so children are done before their parents **/
+  sort(order.begin(),
+       order.end(),
+       [](pair<unsigned int, Octree*> const& a,
+          pair<unsigned int, Octree*> const& b) { return a.first > b.first; });
+
+  vector<Octree*> changed;
+  for(auto i = order.begin(); i != order.end(); i++)
+  {
+    fit_node(i->second, bounds);
+    changed.push_back(i->second);
+  }
+  return changed;
+}
+
+void Octree::index(unordered_multimap<unsigned int, Octree*>& nodes)
+{
+  for(auto i = primitives.begin(); i != primitives.end(); i++)
+    nodes.insert(make_pair(*i, this));
+  for(int i = 0; i < 8; i++)
+    if(sub[i] != nullptr)
+      sub[i]->index(nodes);
+}
+
 /*int main(void)
 {
   Octree* o = new Octree(glm::vec3(0.0f), glm::vec3(1.0f));
@@ -2,8 +2,16 @@
 #define __FUNNYOCTREE__
 
 #include <glm/glm.hpp>
+#include <functional>
+#include <unordered_map>
 #include <vector>
 
+/**
+ * Primitives are not pushed further down than this. Keeps the tree (and the
+ * traversal stack in the kernel) bounded for tiny or degenerate primitives.
+ */
+#define OCTREE_MAX_DEPTH 8
+
 class AABB
 {
 public:
@@ -17,11 +25,59 @@ public:
   bool is_superspace_of(AABB const& space) const;
 };
 
+/**
+ * Looks up the current bounding box of a primitive id.
+ */
+typedef std::function<AABB(unsigned int)> BoundsFunction;
+
+/**
+ * How Octree::insert places primitives that straddle octant boundaries.
+ * By default they stay in the smallest node that contains them, so large
+ * ones pile up near the root.
+ */
+struct OctreeOptions
+{
+  /**
+   * A child takes primitives centred in its octant that fit the octant
+   * scaled by this factor around its centre (a loose octree). 1 for a
+   * plain octree, 2 lets every primitive no larger than the octant go down.
+   */
+  float looseness;
+  /**
+   * Up to this many nodes may reference one primitive: a straddler is
+   * referenced from every child it overlaps when the cost model prefers
+   * that. 1 never splits. Traversal has to skip repeated ids then, see
+   * shares_primitives.
+   */
+  unsigned int max_refs;
+  /**
+   * Cost of an extra reference relative to a primitive test. A straddler
+   * is split if the surface areas of its parts in the children, times
+   * 1 + ref_cost, sum to less than the surface area of the node.
+   */
+  float ref_cost;
+
+  OctreeOptions(void) : looseness(1.0f), max_refs(1), ref_cost(0.5f) {}
+};
+
 class Octree
 {
 public:
   AABB const aabb;
   Octree* sub[8];
+  Octree* parent;
+
+  /**
+   * Bounds of all primitives in this subtree. Unlike aabb (the cell) they
+   * follow the primitives when those move, see refit.
+   */
+  glm::vec3 fit_lower;
+  glm::vec3 fit_upper;
+
+  /**
+   * Position of this node in the array written by print_to_array.
+   */
+  unsigned int array_offset;
 
   Octree(AABB const& aabb_);
   Octree(glm::vec3 const& lower, glm::vec3 const& upper);
@@ -30,13 +86,39 @@ public:
 
   std::vector<unsigned int> primitives;
 
-  Octree* insert(unsigned int val, AABB const& space);
+  /**
+   * Adds primitive *val* with bounds *space*, growing the tree upwards if
+   * it lies outside.
+   * @return The (possibly new) root
+   */
+  Octree* insert(unsigned int val,
+                 AABB const& space,
+                 OctreeOptions const& options = OctreeOptions());
   void print_info(void) const;
 
+  /**
+   * Computes fit_lower/fit_upper of the whole subtree.
+   */
+  void fit(BoundsFunction const& bounds);
+
+  /**
+   * Recomputes the bounds of *nodes* and their ancestors bottom-up,
+   * keeping the topology of the tree.
+   * @return All nodes that were recomputed, in that order
+   */
+  static std::vector<Octree*> refit(std::vector<Octree*> const& nodes,
+                                    BoundsFunction const& bounds);
+
+  /**
+   * Maps every primitive id in this subtree to the nodes referencing it,
+   * more than one if it was split (see OctreeOptions::max_refs).
+   */
+  void index(std::unordered_multimap<unsigned int, Octree*>& nodes);
+
   /**
   Format:
-  float3 lower
-  float3 upper
+  float3 lower (fit)
+  float3 upper (fit)
   unsigned int size
   (size * unsigned int) ids
   (8 * int) offsets <-
@@ -51,9 +133,41 @@ public:
    * required in float-sized units
    * @param buffer_f - A pointer to the start of the available space.
    */
-  unsigned int print_to_array(float* buffer_f) const;
+  unsigned int print_to_array(float* buffer_f, unsigned int base = 0);
+
+  /**
+   * Returns the number of float-sized units print_to_array will write.
+   */
+  unsigned int array_size(void) const;
 
   static Octree* reconstruct(float* data_f);
+
+  /**
+   * Whether any primitive id occurs in more than one node of the flattened
+   * octree *data_f*.
+   */
+  static bool shares_primitives(float const* data_f);
+
+private:
+  /**
+   * Places *val* in this subtree, *space* lies within the node.
+   * @param refs - References *val* may still be split into
+   */
+  void add(unsigned int val,
+           AABB const& space,
+           OctreeOptions const& options,
+           unsigned int refs,
+           unsigned int depth);
+
+  /**
+   * Bounds of octant *id* (x * 4 + y * 2 + z, upper halves set).
+   */
+  AABB octant(unsigned int id) const;
+
+  /**
+   * Child *id*, created if missing.
+   */
+  Octree* child(unsigned int id);
 };
 
 #endif
@@ -0,0 +1,510 @@
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file.hpp"
+#include "paging.hpp"
+#include "scene_cache.hpp"
+
+using namespace std;
+
+#define PAGE_SIZE 4096
+
+__attribute__((const)) static uint64_t page_align(uint64_t offset)
+{
+  return (offset + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+}
+
+static uint32_t get_id(float const* data, size_t at)
+{
+  uint32_t id;
+  memcpy(&id, data + at, sizeof(id));
+  return id;
+}
+
+static void put_id(float* data, size_t at, uint32_t id)
+{
+  memcpy(data + at, &id, sizeof(id));
+}
+
+/**
+ * Appends the subtree of the flattened octree *src* at *node* to *dst*,
+ * mapping every primitive id through *map*. Nodes *levels* below *node*
+ * are replaced by stubs with the count returned by *cut_off*.
+ */
+static void copy_tree(float const* src,
+                      size_t node,
+                      unsigned int levels,
+                      vector<float>& dst,
+                      function<uint32_t(uint32_t)> const& map,
+                      function<int32_t(size_t)> const& cut_off)
+{
+  size_t const at = dst.size();
+  dst.insert(dst.end(), src + node, src + node + 6);
+  if(levels == 0)
+  {
+    dst.push_back(0.0f);
+    put_id(dst.data(), at + 6, (uint32_t)cut_off(node));
+    return;
+  }
+
+  uint32_t const count = get_id(src, node + 6);
+  dst.resize(at + 7 + count + 8);
+  put_id(dst.data(), at + 6, count);
+  for(uint32_t i = 0; i < count; i++)
+    put_id(dst.data(), at + 7 + i, map(get_id(src, node + 7 + i)));
+
+  size_t const children = node + 7 + count;
+  for(unsigned int i = 0; i < 8; i++)
+  {
+    int32_t const off = (int32_t)get_id(src, children + i);
+    uint32_t rel = (uint32_t)-1;
+    if(off != -1)
+    {
+      rel = (uint32_t)(dst.size() - at);
+      copy_tree(src, node + (size_t)off, levels - 1, dst, map, cut_off);
+    }
+    put_id(dst.data(), at + 7 + count + i, rel);
+  }
+}
+
+/**
+ * Calls *visit* with the position of every primitive id in the flattened
+ * tree *tree* at *node*.
+ */
+static void visit_ids(float const* tree,
+                      size_t node,
+                      function<void(size_t)> const& visit)
+{
+  int32_t const count = (int32_t)get_id(tree, node + 6);
+  if(count < 0)
+    return;
+  for(int32_t i = 0; i < count; i++)
+    visit(node + 7 + (size_t)i);
+
+  size_t const children = node + 7 + (size_t)count;
+  for(unsigned int i = 0; i < 8; i++)
+  {
+    int32_t const off = (int32_t)get_id(tree, children + i);
+    if(off != -1)
+      visit_ids(tree, node + (size_t)off, visit);
+  }
+}
+
+ClusterCache::ClusterCache(void) : mapping(nullptr), mapping_size(0) {}
+
+ClusterCache::~ClusterCache(void) { unmap(); }
+
+void ClusterCache::unmap(void)
+{
+  if(mapping != nullptr)
+    munmap(mapping, mapping_size);
+  mapping = nullptr;
+  mapping_size = 0;
+}
+
+bool ClusterCache::load(string const& path)
+{
+  unmap();
+
+  int fd = open(path.c_str(), O_RDONLY);
+  if(fd < 0)
+    return false;
+
+  struct stat st;
+  if(fstat(fd, &st) != 0 ||
+     (size_t)st.st_size < sizeof(ClusterCacheHeader))
+  {
+    close(fd);
+    cerr << "[ClusterCache] " << path << " is truncated." << endl;
+    return false;
+  }
+
+  mapping_size = (size_t)st.st_size;
+  mapping = mmap(nullptr, mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(mapping == MAP_FAILED)
+  {
+    mapping = nullptr;
+    mapping_size = 0;
+    cerr << "[ClusterCache] Could not map " << path << "." << endl;
+    return false;
+  }
+  /* Clusters are read in whatever order rays reach them */
+  madvise(mapping, mapping_size, MADV_RANDOM);
+
+  ClusterCacheHeader const& h = header();
+  size_t const prim_bytes = PRIM_SIZE * sizeof(float);
+  char const* reason = nullptr;
+  if(memcmp(h.magic, CLUSTER_CACHE_MAGIC, sizeof(CLUSTER_CACHE_MAGIC)) != 0)
+    reason = "not a cluster cache";
+  else if(h.version != CLUSTER_CACHE_VERSION || h.prim_size != PRIM_SIZE)
+    reason = "outdated format";
+  else if(h.header_checksum !=
+          checksum(&h, offsetof(ClusterCacheHeader, header_checksum)))
+    reason = "corrupt header";
+  else if(h.file_size != mapping_size ||
+          h.table_offset + h.cluster_count * sizeof(ClusterEntry) >
+              mapping_size ||
+          h.lamp_offset + h.lamp_count * prim_bytes > mapping_size ||
+          h.surf_offset + h.surf_count * prim_bytes > mapping_size ||
+          h.top_offset + h.top_size * sizeof(float) > mapping_size)
+    reason = "truncated";
+  else if(h.resident_checksum !=
+          checksum((char const*)mapping + h.table_offset,
+                   h.top_offset + h.top_size * sizeof(float) -
+                       h.table_offset))
+    reason = "checksum mismatch";
+  else
+    for(unsigned int c = 0; c < h.cluster_count && reason == nullptr; c++)
+    {
+      ClusterEntry const& e = entry(c);
+      if(e.prim_count > h.max_prims || e.tree_size > h.max_tree ||
+         e.offset + e.prim_count * prim_bytes + e.tree_size * sizeof(float) >
+             mapping_size)
+        reason = "truncated";
+    }
+
+  if(reason != nullptr)
+  {
+    cerr << "[ClusterCache] Ignoring " << path << ": " << reason << "."
+         << endl;
+    unmap();
+    return false;
+  }
+
+  cout << "[ClusterCache] Mapped " << path << " (" << h.cluster_count
+       << " clusters of up to " << h.max_prims << " primitives, "
+       << h.surf_count << " resident surfaces, " << h.lamp_count
+       << " lamps)." << endl;
+  return true;
+}
+
+bool ClusterCache::store(string const& path,
+                         ObjectsBuffer const& obj,
+                         float const* surfaces,
+                         float const* lamps,
+                         float const* octree,
+                         unsigned int cut_depth)
+{
+  size_t const prim_bytes = PRIM_SIZE * sizeof(float);
+  uint32_t const lamp_first = obj.lamp_float_index / PRIM_SIZE;
+  auto record = [&](uint32_t id) {
+    return id >= lamp_first ? lamps + (id - lamp_first) * PRIM_SIZE
+                            : surfaces + id * PRIM_SIZE;
+  };
+
+  /** Top tree, resident surfaces numbered after the lamps **/
+  vector<float> resident;
+  vector<float> top;
+  vector<vector<float>> prims;
+  vector<vector<float>> trees;
+  /* Split primitives are referenced from several nodes, copy them once */
+  unordered_map<uint32_t, uint32_t> top_ids;
+  auto top_id = [&](uint32_t id) -> uint32_t {
+    if(id >= lamp_first)
+      return id - lamp_first;
+    auto const known = top_ids.find(id);
+    if(known != top_ids.end())
+      return known->second;
+    resident.insert(resident.end(), record(id), record(id) + PRIM_SIZE);
+    uint32_t const placed =
+        obj.lamp_count + (uint32_t)(resident.size() / PRIM_SIZE) - 1;
+    top_ids[id] = placed;
+    return placed;
+  };
+  auto cluster = [&](size_t node) -> int32_t {
+    size_t const c = prims.size();
+    prims.emplace_back();
+    trees.emplace_back();
+    unordered_map<uint32_t, uint32_t> local_ids;
+    auto local_id = [&](uint32_t id) -> uint32_t {
+      if(id >= lamp_first)
+        return id - lamp_first;
+      auto const known = local_ids.find(id);
+      if(known != local_ids.end())
+        return known->second;
+      prims[c].insert(prims[c].end(), record(id), record(id) + PRIM_SIZE);
+      uint32_t const placed =
+          CLUSTER_LOCAL | ((uint32_t)(prims[c].size() / PRIM_SIZE) - 1);
+      local_ids[id] = placed;
+      return placed;
+    };
+    copy_tree(octree,
+              node,
+              numeric_limits<unsigned int>::max(),
+              trees[c],
+              local_id,
+              nullptr);
+    return -1 - (int32_t)c;
+  };
+  copy_tree(octree, 0, cut_depth, top, top_id, cluster);
+
+  ClusterCacheHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, CLUSTER_CACHE_MAGIC, sizeof(CLUSTER_CACHE_MAGIC));
+  h.version = CLUSTER_CACHE_VERSION;
+  h.prim_size = PRIM_SIZE;
+  h.cut_depth = cut_depth;
+  h.shared = Octree::shares_primitives(octree) ? 1 : 0;
+  h.cluster_count = (uint32_t)prims.size();
+  h.surf_count = (uint32_t)(resident.size() / PRIM_SIZE);
+  h.lamp_count = obj.lamp_count;
+  h.top_size = (uint32_t)top.size();
+
+  for(uint32_t i = 0; i < obj.surf_count + obj.lamp_count; i++)
+  {
+    uint8_t const* prim_header = (uint8_t const*)(
+        i < obj.surf_count ? record(i) : record(lamp_first + i -
+                                                obj.surf_count));
+    if(prim_header[0] <= GLASS)
+      h.materials |= 1u << prim_header[0];
+    if(prim_header[1] <= SPHERE)
+      h.shapes |= 1u << prim_header[1];
+  }
+
+  h.table_offset = page_align(sizeof(ClusterCacheHeader));
+  h.lamp_offset = h.table_offset + h.cluster_count * sizeof(ClusterEntry);
+  h.surf_offset = h.lamp_offset + obj.lamp_count * prim_bytes;
+  h.top_offset = h.surf_offset + resident.size() * sizeof(float);
+  uint64_t offset = page_align(h.top_offset + top.size() * sizeof(float));
+
+  vector<ClusterEntry> table(h.cluster_count);
+  for(uint32_t c = 0; c < h.cluster_count; c++)
+  {
+    ClusterEntry& e = table[c];
+    e.offset = offset;
+    e.prim_count = (uint32_t)(prims[c].size() / PRIM_SIZE);
+    e.tree_size = (uint32_t)trees[c].size();
+    /* The tree follows the primitives, checksum both as one block */
+    vector<float> block(prims[c]);
+    block.insert(block.end(), trees[c].begin(), trees[c].end());
+    e.checksum = checksum(block.data(), block.size() * sizeof(float));
+    h.max_prims = max(h.max_prims, e.prim_count);
+    h.max_tree = max(h.max_tree, e.tree_size);
+    offset = page_align(offset + block.size() * sizeof(float));
+  }
+  h.file_size = offset;
+
+  /* Table, lamps, surfaces and top tree are contiguous */
+  vector<char> section(h.top_offset + top.size() * sizeof(float) -
+                       h.table_offset);
+  char* base = section.data() - h.table_offset;
+  memcpy(base + h.table_offset,
+         table.data(),
+         table.size() * sizeof(ClusterEntry));
+  memcpy(base + h.lamp_offset, lamps, obj.lamp_count * prim_bytes);
+  memcpy(base + h.surf_offset,
+         resident.data(),
+         resident.size() * sizeof(float));
+  memcpy(base + h.top_offset, top.data(), top.size() * sizeof(float));
+  h.resident_checksum = checksum(section.data(), section.size());
+  h.header_checksum =
+      checksum(&h, offsetof(ClusterCacheHeader, header_checksum));
+
+  bool const ok = write_atomically(path, [&](int fd) {
+    bool written = write_all(fd, &h, sizeof(h)) &&
+                   write_at(fd, h.table_offset, section.data(), section.size());
+    for(uint32_t c = 0; c < h.cluster_count && written; c++)
+      written = write_at(fd,
+                         table[c].offset,
+                         prims[c].data(),
+                         prims[c].size() * sizeof(float)) &&
+                write_all(fd,
+                          trees[c].data(),
+                          trees[c].size() * sizeof(float));
+    return written && ftruncate(fd, (off_t)h.file_size) == 0;
+  });
+  if(!ok)
+  {
+    cerr << "[ClusterCache] Could not write " << path << "." << endl;
+    return false;
+  }
+
+  cout << "[ClusterCache] Stored " << path << " (" << h.cluster_count
+       << " clusters, " << h.file_size << " byte)." << endl;
+  return true;
+}
+
+__attribute__((pure)) ClusterCacheHeader const& ClusterCache::header(void) const
+{
+  return *(ClusterCacheHeader const*)mapping;
+}
+
+__attribute__((pure)) ClusterEntry const&
+ClusterCache::entry(unsigned int cluster) const
+{
+  char const* table = (char const*)mapping + header().table_offset;
+  return ((ClusterEntry const*)table)[cluster];
+}
+
+__attribute__((pure)) float const* ClusterCache::lamps(void) const
+{
+  return (float const*)((char const*)mapping + header().lamp_offset);
+}
+
+__attribute__((pure)) float const* ClusterCache::surfaces(void) const
+{
+  return (float const*)((char const*)mapping + header().surf_offset);
+}
+
+__attribute__((pure)) float const* ClusterCache::top(void) const
+{
+  return (float const*)((char const*)mapping + header().top_offset);
+}
+
+__attribute__((pure)) float const*
+ClusterCache::cluster_prims(unsigned int cluster) const
+{
+  return (float const*)((char const*)mapping + entry(cluster).offset);
+}
+
+__attribute__((pure)) float const*
+ClusterCache::cluster_tree(unsigned int cluster) const
+{
+  return cluster_prims(cluster) + entry(cluster).prim_count * PRIM_SIZE;
+}
+
+bool ClusterCache::verify(unsigned int cluster) const
+{
+  ClusterEntry const& e = entry(cluster);
+  size_t const bytes = (e.prim_count * PRIM_SIZE + e.tree_size) *
+                       sizeof(float);
+  return checksum(cluster_prims(cluster), bytes) == e.checksum;
+}
+
+__attribute__((pure)) unsigned int
+ClusterCache::max_primitives(unsigned int slots) const
+{
+  ClusterCacheHeader const& h = header();
+  return h.lamp_count + h.surf_count + slots * h.max_prims;
+}
+
+__attribute__((pure)) unsigned int
+ClusterCache::octree_size(unsigned int slots) const
+{
+  ClusterCacheHeader const& h = header();
+  return h.top_size + slots * h.max_tree;
+}
+
+ClusterPager::ClusterPager(ClusterCache const& clusters, unsigned int slots)
+    : cache(clusters), slot_count(slots), slot_cluster(slots, CLUSTER_ABSENT),
+      clock(0), waiting(0)
+{
+  unsigned int const n = cache.header().cluster_count;
+  paging.assign(PAGING_SLOTS + 3 * n, 0);
+  paging[PAGING_COUNT] = n;
+  for(unsigned int c = 0; c < n; c++)
+    paging[PAGING_SLOTS + c] = CLUSTER_ABSENT;
+  cluster_slot.assign(n, CLUSTER_ABSENT);
+  last_use.assign(n, 0);
+  broken.assign(n, false);
+}
+
+vector<pair<unsigned int, unsigned int>> ClusterPager::schedule(void)
+{
+  unsigned int const n = cache.header().cluster_count;
+  uint32_t* roots = paging.data() + PAGING_SLOTS;
+  uint32_t* requested = roots + n;
+  uint32_t* used = requested + n;
+
+  clock++;
+  vector<unsigned int> wanted;
+  for(unsigned int c = 0; c < n; c++)
+  {
+    if(used[c] || requested[c])
+      last_use[c] = clock;
+    if(requested[c] && cluster_slot[c] == CLUSTER_ABSENT && !broken[c])
+      wanted.push_back(c);
+    used[c] = 0;
+    requested[c] = 0;
+  }
+
+  vector<pair<unsigned int, unsigned int>> loads;
+  vector<bool> fresh(slot_count, false);
+  waiting = 0;
+  for(auto c = wanted.begin(); c != wanted.end(); c++)
+  {
+    if(!cache.verify(*c))
+    {
+      cerr << "[ClusterPager] Cluster " << *c << " is corrupt, skipping it."
+           << endl;
+      broken[*c] = true;
+      continue;
+    }
+
+    /* A free slot, or the least recently used one not filled just now */
+    unsigned int slot = CLUSTER_ABSENT;
+    for(unsigned int s = 0; s < slot_count; s++)
+    {
+      if(fresh[s])
+        continue;
+      if(slot_cluster[s] == CLUSTER_ABSENT)
+      {
+        slot = s;
+        break;
+      }
+      if(slot == CLUSTER_ABSENT ||
+         last_use[slot_cluster[s]] < last_use[slot_cluster[slot]])
+        slot = s;
+    }
+    if(slot == CLUSTER_ABSENT)
+    {
+      waiting++;
+      continue;
+    }
+
+    if(slot_cluster[slot] != CLUSTER_ABSENT)
+    {
+      roots[slot_cluster[slot]] = CLUSTER_ABSENT;
+      cluster_slot[slot_cluster[slot]] = CLUSTER_ABSENT;
+    }
+    slot_cluster[slot] = *c;
+    cluster_slot[*c] = slot;
+    roots[*c] = tree_base(slot);
+    fresh[slot] = true;
+    loads.push_back(make_pair(*c, slot));
+  }
+  return loads;
+}
+
+__attribute__((pure)) unsigned int ClusterPager::deferred(void) const
+{
+  return waiting;
+}
+
+__attribute__((pure)) unsigned int
+ClusterPager::prim_base(unsigned int slot) const
+{
+  ClusterCacheHeader const& h = cache.header();
+  return h.lamp_count + h.surf_count + slot * h.max_prims;
+}
+
+__attribute__((pure)) unsigned int
+ClusterPager::tree_base(unsigned int slot) const
+{
+  ClusterCacheHeader const& h = cache.header();
+  return h.top_size + slot * h.max_tree;
+}
+
+vector<float> ClusterPager::place_tree(unsigned int cluster,
+                                       unsigned int slot) const
+{
+  float const* src = cache.cluster_tree(cluster);
+  vector<float> tree(src, src + cache.entry(cluster).tree_size);
+  uint32_t const base = prim_base(slot);
+  visit_ids(tree.data(), 0, [&](size_t at) {
+    uint32_t const id = get_id(tree.data(), at);
+    if(id & CLUSTER_LOCAL)
+      put_id(tree.data(), at, base + (id & ~CLUSTER_LOCAL));
+  });
+  return tree;
+}
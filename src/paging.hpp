@@ -0,0 +1,224 @@
+#ifndef __PAGING_H__
+#define __PAGING_H__
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "scene.hpp"
+
+#define CLUSTER_CACHE_MAGIC "HBCLUST"
+#define CLUSTER_CACHE_VERSION 4
+
+/** Octree levels that stay resident, the subtrees below are clusters **/
+#define CLUSTER_DEPTH 3
+
+/**
+ * Primitive ids in cluster trees: with CLUSTER_LOCAL set an index into the
+ * primitives of the cluster, otherwise one of the resident primitives.
+ */
+#define CLUSTER_LOCAL 0x80000000u
+
+/**
+ * Layout of the paging table the kernel is built with under PAGING, in
+ * 32-bit units, for n clusters:
+ * retry :: UInt - Set on launches that only trace the pending pixels
+ * n :: UInt
+ * n * UInt octree offset of the cluster root, or CLUSTER_ABSENT
+ * n * UInt requested - Set by rays that reached an absent cluster
+ * n * UInt used - Set by rays that entered a resident cluster
+ */
+#define PAGING_RETRY 0
+#define PAGING_COUNT 1
+#define PAGING_SLOTS 2
+#define CLUSTER_ABSENT 0xFFFFFFFFu
+
+/**
+ * Scene split for out-of-core rendering. The octree is cut at cut_depth:
+ * the levels above are the top tree, which always stays resident together
+ * with the lamps and the primitives held by top nodes. Every subtree below
+ * the cut is a cluster with its own primitives, loaded on demand. In the
+ * top tree a cluster is a stub node: its bounds and a count of
+ * -1 - cluster id, without ids or children.
+ *
+ * Resident objects buffer: lamps first, then the resident surfaces, then
+ * the cluster slots, see ClusterPager.
+ *
+ * header
+ * table    :: cluster_count ClusterEntry
+ * lamps    :: (lamp_count * PRIM_SIZE) floats
+ * surfaces :: (surf_count * PRIM_SIZE) floats
+ * top tree :: top_size floats
+ * clusters :: primitives and tree of every cluster, page aligned
+ */
+struct ClusterCacheHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t prim_size;
+  uint32_t cut_depth;
+  uint32_t cluster_count;
+  uint32_t surf_count;
+  uint32_t lamp_count;
+  uint32_t top_size;
+  /** Largest cluster, a slot has to have room for it **/
+  uint32_t max_prims;
+  uint32_t max_tree;
+  /** Bit per material and shape that occurs, for the kernel variant **/
+  uint32_t materials;
+  uint32_t shapes;
+  /** 1 if the octree had split primitives, see Octree::shares_primitives **/
+  uint32_t shared;
+
+  /** Byte offsets from the beginning of the file **/
+  uint64_t table_offset;
+  uint64_t lamp_offset;
+  uint64_t surf_offset;
+  uint64_t top_offset;
+  uint64_t file_size;
+
+  /** Table and resident sections, clusters carry their own **/
+  uint64_t resident_checksum;
+  /** Over all of the above **/
+  uint64_t header_checksum;
+};
+
+struct ClusterEntry
+{
+  /** Byte offset of the primitives, the tree follows them **/
+  uint64_t offset;
+  uint32_t prim_count;
+  uint32_t tree_size;
+  uint64_t checksum;
+};
+
+/**
+ * Read-only memory mapping of a clustered scene. Clusters are only read
+ * (and checked) when they are paged in, so the file can be larger than
+ * host memory. The file is the scene: rendering it needs nothing else,
+ * it is split offline from a scene that fits host memory (see
+ * --split-scene).
+ */
+class ClusterCache
+{
+private:
+  void* mapping;
+  size_t mapping_size;
+
+  void unmap(void);
+
+public:
+  ClusterCache(void);
+  virtual ~ClusterCache(void);
+
+  /**
+   * Maps the file at *path* and validates the header, the table and the
+   * resident sections.
+   * @return false if the file is missing, outdated or corrupt
+   */
+  bool load(std::string const& path);
+
+  /**
+   * Splits a scene at *cut_depth* and writes it to *path*. The file is
+   * replaced atomically, so processes storing the same scene at once
+   * don't corrupt it.
+   * @param surfaces, lamps - As for Renderer::upload_scene
+   * @param octree - The flattened octree, see Octree::print_to_array
+   * @return false on I/O errors
+   */
+  static bool store(std::string const& path,
+                    ObjectsBuffer const& obj,
+                    float const* surfaces,
+                    float const* lamps,
+                    float const* octree,
+                    unsigned int cut_depth = CLUSTER_DEPTH);
+
+  bool is_loaded(void) const { return mapping != nullptr; }
+
+  ClusterCacheHeader const& header(void) const;
+  ClusterEntry const& entry(unsigned int cluster) const;
+  float const* lamps(void) const;
+  float const* surfaces(void) const;
+  float const* top(void) const;
+  float const* cluster_prims(unsigned int cluster) const;
+  float const* cluster_tree(unsigned int cluster) const;
+
+  /**
+   * Whether the mapped data of *cluster* matches its checksum.
+   */
+  bool verify(unsigned int cluster) const;
+
+  /**
+   * Capacity of the objects buffer, in primitives, and size of the octree
+   * buffer, in floats, when *slots* clusters are resident at once.
+   */
+  unsigned int max_primitives(unsigned int slots) const;
+  unsigned int octree_size(unsigned int slots) const;
+};
+
+/**
+ * Decides which clusters are resident in the slots of the device buffers.
+ * Slot s holds max_prims primitives at prim_base(s) in the objects buffer
+ * and a tree of up to max_tree floats at tree_base(s) in the octree
+ * buffer. Evicts the least recently used cluster when a slot is needed.
+ */
+class ClusterPager
+{
+private:
+  ClusterCache const& cache;
+  unsigned int const slot_count;
+  /** Host copy of the paging table **/
+  std::vector<uint32_t> paging;
+  /** Cluster in every slot, CLUSTER_ABSENT if free **/
+  std::vector<uint32_t> slot_cluster;
+  std::vector<uint32_t> cluster_slot;
+  std::vector<uint64_t> last_use;
+  /** Clusters that failed ClusterCache::verify, never loaded **/
+  std::vector<bool> broken;
+  uint64_t clock;
+  unsigned int waiting;
+
+public:
+  /**
+   * @param slots - At least 1
+   */
+  ClusterPager(ClusterCache const& cache, unsigned int slots);
+  virtual ~ClusterPager(void) {}
+
+  /**
+   * The paging table, to be read back from the device after a launch and
+   * written to it before the next one.
+   */
+  std::vector<uint32_t>& table(void) { return paging; }
+
+  /**
+   * Consumes the requested and used flags of table() and assigns slots to
+   * requested clusters, evicting the least recently used ones. Clusters
+   * used or requested by the last launch are evicted last. Updates the
+   * roots in table() and clears the flags.
+   * @return (cluster, slot) of every cluster that has to be uploaded,
+   *         empty if no ray requested one
+   */
+  std::vector<std::pair<unsigned int, unsigned int>> schedule(void);
+
+  /**
+   * Number of clusters requested but not scheduled by the last schedule
+   * because there were more requests than slots.
+   */
+  unsigned int deferred(void) const;
+
+  unsigned int prim_base(unsigned int slot) const;
+  unsigned int tree_base(unsigned int slot) const;
+
+  /**
+   * The tree of *cluster* as it has to be placed in *slot*: local primitive
+   * ids point into the slot, resident ones are kept.
+   */
+  std::vector<float> place_tree(unsigned int cluster, unsigned int slot) const;
+
+  unsigned int slots(void) const { return slot_count; }
+};
+
+#endif
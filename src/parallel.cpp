@@ -0,0 +1,338 @@
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "checkpoint.hpp"
+#include "image.hpp"
+#include "parallel.hpp"
+#include "scene_cache.hpp"
+
+using namespace std;
+
+namespace Parallel
+{
+
+void sample_range(Job const& job,
+                  unsigned int worker,
+                  unsigned int& begin,
+                  unsigned int& end)
+{
+  uint64_t const total = job.samples;
+  begin = (unsigned int)(total * worker / job.workers);
+  end = (unsigned int)(total * (worker + 1) / job.workers);
+}
+
+static bool send_all(int fd, void const* data, size_t size)
+{
+  char const* bytes = (char const*)data;
+  while(size > 0)
+  {
+    ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+    if(sent < 0 && errno == EINTR)
+      continue;
+    if(sent <= 0)
+      return false;
+    bytes += sent;
+    size -= (size_t)sent;
+  }
+  return true;
+}
+
+static bool receive_all(int fd, void* data, size_t size)
+{
+  char* bytes = (char*)data;
+  while(size > 0)
+  {
+    ssize_t received = recv(fd, bytes, size, 0);
+    if(received < 0 && errno == EINTR)
+      continue;
+    if(received <= 0)
+      return false;
+    bytes += received;
+    size -= (size_t)received;
+  }
+  return true;
+}
+
+bool send_accumulation(int fd,
+                       AccumulationHeader const& header,
+                       float const* rgbw)
+{
+  size_t const bytes = (size_t)header.width * header.height * 4 * sizeof(float);
+  return send_all(fd, &header, sizeof(header)) && send_all(fd, rgbw, bytes);
+}
+
+bool receive_accumulation(int fd,
+                          AccumulationHeader& header,
+                          vector<float>& rgbw)
+{
+  if(!receive_all(fd, &header, sizeof(header)))
+    return false;
+
+  if(memcmp(header.magic, ACCUMULATION_MAGIC, sizeof(header.magic)) != 0 ||
+     header.version != ACCUMULATION_VERSION)
+  {
+    cerr << "[Parallel] Malformed message." << endl;
+    return false;
+  }
+
+  rgbw.resize((size_t)header.width * header.height * 4);
+  size_t const bytes = rgbw.size() * sizeof(float);
+  if(!receive_all(fd, rgbw.data(), bytes))
+    return false;
+
+  if(checksum(rgbw.data(), bytes) != header.checksum)
+  {
+    cerr << "[Parallel] Checksum mismatch from worker " << header.worker
+         << "." << endl;
+    return false;
+  }
+  return true;
+}
+
+string checkpoint_path(Job const& job, unsigned int worker)
+{
+  return job.checkpoint + "." + to_string(worker);
+}
+
+/** Set by SIGINT and SIGTERM in workers **/
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int) { stop_requested = 1; }
+
+/**
+ * Saves the state of *renderer* if the job has checkpoints.
+ */
+static void save_checkpoint(Renderer const& renderer,
+                            Job const& job,
+                            unsigned int worker,
+                            uint64_t id)
+{
+  if(job.checkpoint.empty())
+    return;
+  RenderState state;
+  renderer.save_state(state);
+  if(Checkpoint::save(checkpoint_path(job, worker), state, id))
+    cout << "[Parallel] Worker " << worker << " saved a checkpoint at "
+         << renderer.sample_count() << " samples" << endl;
+}
+
+int work(Renderer& renderer, Job const& job, unsigned int worker, int fd)
+{
+  unsigned int begin, end;
+  sample_range(job, worker, begin, end);
+  unsigned int const count = end - begin;
+
+  renderer.set_resolution(job.width, job.height);
+  renderer.seed(job.seed + worker);
+  renderer.reset((float)begin);
+
+  /** Checkpoints only resume the same worker of the same job **/
+  uint64_t const range[3] = {job.seed + worker, begin, end};
+  uint64_t const id = checksum(range, sizeof(range));
+  if(job.resume && !job.checkpoint.empty())
+  {
+    RenderState state;
+    if(Checkpoint::load(checkpoint_path(job, worker), id, state) &&
+       renderer.restore_state(state))
+      cout << "[Parallel] Worker " << worker << " resumed at "
+           << renderer.sample_count() << " samples" << endl;
+    else
+      cout << "[Parallel] Worker " << worker
+           << " has no matching checkpoint, starting over" << endl;
+  }
+
+  signal(SIGINT, request_stop);
+  signal(SIGTERM, request_stop);
+  auto const started = chrono::steady_clock::now();
+  auto saved = started;
+
+  AccumulationHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, ACCUMULATION_MAGIC, sizeof(header.magic));
+  header.version = ACCUMULATION_VERSION;
+  header.worker = worker;
+  header.width = renderer.width();
+  header.height = renderer.height();
+
+  vector<float> rgbw((size_t)header.width * header.height * 4);
+  float kernel_ms = 0.0f;
+  unsigned int done = renderer.sample_count();
+  while(true)
+  {
+    if(done < count)
+    {
+      kernel_ms += renderer.render();
+      done = renderer.sample_count();
+    }
+
+    auto const now = chrono::steady_clock::now();
+    bool const out_of_time =
+        job.time_limit > 0 && now - started >= chrono::seconds(job.time_limit);
+    if(done < count && (stop_requested || out_of_time))
+    {
+      save_checkpoint(renderer, job, worker, id);
+      cerr << "[Parallel] Worker " << worker << " stopped at " << done
+           << " samples." << endl;
+      return 1;
+    }
+    if(now - saved >= chrono::seconds(job.checkpoint_every))
+    {
+      save_checkpoint(renderer, job, worker, id);
+      saved = now;
+    }
+
+    bool const last = done >= count;
+    if(last || done % job.export_every == 0)
+    {
+      renderer.read_accumulation(rgbw.data());
+      header.samples = done;
+      header.final = last ? 1 : 0;
+      header.checksum = checksum(rgbw.data(), rgbw.size() * sizeof(float));
+      if(!send_accumulation(fd, header, rgbw.data()))
+      {
+        cerr << "[Parallel] Worker " << worker << " lost the coordinator."
+             << endl;
+        save_checkpoint(renderer, job, worker, id);
+        return 1;
+      }
+    }
+    if(last)
+      break;
+  }
+  /* The coordinator may still fail, keep the finished range */
+  save_checkpoint(renderer, job, worker, id);
+
+  cout << "[Parallel] Worker " << worker << " rendered samples " << begin
+       << " to " << end << " in " << kernel_ms << " ms" << endl;
+  return 0;
+}
+
+int coordinate(Job const& job, WorkerFunction const& worker)
+{
+  size_t const pixels = (size_t)job.width * job.height;
+  vector<pid_t> pids;
+  vector<pollfd> fds;
+
+  /* Buffered output would be written by every child again */
+  cout.flush();
+  cerr.flush();
+
+  for(unsigned int i = 0; i < job.workers; i++)
+  {
+    int pair[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0)
+    {
+      cerr << "[Parallel] socketpair: " << strerror(errno) << endl;
+      break;
+    }
+
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+      for(auto p = fds.begin(); p != fds.end(); p++)
+        close(p->fd);
+      close(pair[0]);
+      int status = worker(i, pair[1]);
+      close(pair[1]);
+      cout.flush();
+      _exit(status);
+    }
+
+    close(pair[1]);
+    if(pid < 0)
+    {
+      cerr << "[Parallel] fork: " << strerror(errno) << endl;
+      close(pair[0]);
+      break;
+    }
+    pids.push_back(pid);
+    fds.push_back({pair[0], POLLIN, 0});
+  }
+
+  /** Latest snapshot of every worker **/
+  vector<vector<float>> snapshots(fds.size(), vector<float>(pixels * 4, 0.0f));
+  vector<unsigned int> samples(fds.size(), 0);
+  vector<bool> finished(fds.size(), false);
+  size_t open = fds.size();
+
+  AccumulationHeader header;
+  vector<float> rgbw;
+  while(open > 0)
+  {
+    if(poll(fds.data(), fds.size(), -1) < 0)
+    {
+      if(errno == EINTR)
+        continue;
+      cerr << "[Parallel] poll: " << strerror(errno) << endl;
+      break;
+    }
+
+    for(size_t i = 0; i < fds.size(); i++)
+    {
+      if(fds[i].fd < 0 || fds[i].revents == 0)
+        continue;
+
+      bool valid = receive_accumulation(fds[i].fd, header, rgbw) &&
+                   header.worker == i && header.width == job.width &&
+                   header.height == job.height;
+      if(valid)
+      {
+        snapshots[i].swap(rgbw);
+        samples[i] = header.samples;
+        finished[i] = header.final != 0;
+
+        unsigned int total = 0;
+        for(auto s = samples.begin(); s != samples.end(); s++)
+          total += *s;
+        cout << "[Parallel] " << total << "/" << job.samples << " samples"
+             << endl;
+      }
+
+      if(!valid || finished[i])
+      {
+        close(fds[i].fd);
+        fds[i].fd = -1;
+        open--;
+      }
+    }
+  }
+
+  int status = pids.size() == job.workers ? 0 : 1;
+  for(size_t i = 0; i < pids.size(); i++)
+  {
+    int worker_status = 0;
+    waitpid(pids[i], &worker_status, 0);
+    if(!finished[i] || !WIFEXITED(worker_status) ||
+       WEXITSTATUS(worker_status) != 0)
+    {
+      cerr << "[Parallel] Worker " << i << " did not finish." << endl;
+      status = 1;
+    }
+  }
+
+  /** Merge **/
+  vector<float> merged(pixels * 4, 0.0f);
+  for(auto s = snapshots.begin(); s != snapshots.end(); s++)
+    for(size_t j = 0; j < merged.size(); j++)
+      merged[j] += (*s)[j];
+
+  Image image = resolve(merged.data(), job.width, job.height);
+  if(!write_png(job.output, image))
+    return 1;
+
+  cout << "[Parallel] Wrote " << job.output << endl;
+  if(status == 0 && !job.checkpoint.empty())
+    for(unsigned int i = 0; i < job.workers; i++)
+      remove(checkpoint_path(job, i).c_str());
+  return status;
+}
+}
@@ -0,0 +1,119 @@
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "renderer.hpp"
+
+#define ACCUMULATION_MAGIC "HBACCUM"
+#define ACCUMULATION_VERSION 1
+
+/**
+ * Message sent from a worker to the coordinator, followed by
+ * width * height * 4 floats of accumulation (see Renderer::read_accumulation).
+ * Every pixel carries its own sample count, so snapshots of different
+ * workers merge by plain addition. Snapshots are cumulative, a newer one
+ * of the same worker replaces the older.
+ * Fields are in host byte order, the framing only needs a stream socket.
+ */
+struct AccumulationHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t worker;
+  uint32_t width;
+  uint32_t height;
+  /** Samples per pixel in this snapshot **/
+  uint32_t samples;
+  /** 1 for the last snapshot of the worker **/
+  uint32_t final;
+  uint64_t checksum;
+};
+
+namespace Parallel
+{
+
+/**
+ * One still frame, split into sample ranges over several processes.
+ */
+struct Job
+{
+  unsigned int width;
+  unsigned int height;
+  /** Total samples per pixel over all workers **/
+  unsigned int samples;
+  unsigned int workers;
+  /** Samples between two snapshots of a worker **/
+  unsigned int export_every;
+  uint64_t seed;
+  std::string output;
+  /** Workers save their state to this path + "." + worker, empty for none **/
+  std::string checkpoint;
+  /** Seconds between two checkpoints of a worker **/
+  unsigned int checkpoint_every;
+  /** Workers continue from their checkpoints if they match the job **/
+  bool resume;
+  /** Seconds after which workers checkpoint and stop, 0 for no limit **/
+  unsigned int time_limit;
+};
+
+/**
+ * Checkpoint file of *worker*, see Job::checkpoint.
+ */
+std::string checkpoint_path(Job const& job, unsigned int worker);
+
+/**
+ * Sample indices [begin, end) rendered by *worker*.
+ */
+void sample_range(Job const& job,
+                  unsigned int worker,
+                  unsigned int& begin,
+                  unsigned int& end);
+
+/**
+ * Writes one message to the stream socket *fd*.
+ * @return false if the peer went away
+ */
+bool send_accumulation(int fd,
+                       AccumulationHeader const& header,
+                       float const* rgbw);
+
+/**
+ * Reads one message from the stream socket *fd* and validates it.
+ * @return false on end of stream or a malformed message
+ */
+bool receive_accumulation(int fd,
+                          AccumulationHeader& header,
+                          std::vector<float>& rgbw);
+
+/**
+ * Worker side: renders the sample range of *worker* with its own seed and
+ * sends a snapshot every job.export_every samples and at the end.
+ * With job.checkpoint set the worker also saves its state periodically,
+ * when it finishes and before it stops early: on SIGINT or SIGTERM, at the
+ * time limit or when the coordinator went away.
+ * @param renderer - Set up with the scene and camera of the job
+ * @return The exit status of the worker process, nonzero if it stopped
+ *         early
+ */
+int work(Renderer& renderer, Job const& job, unsigned int worker, int fd);
+
+/**
+ * Sets up the renderer of worker *worker* in the child process and calls
+ * work(). No OpenCL state may be created before the fork.
+ */
+typedef std::function<int(unsigned int worker, int fd)> WorkerFunction;
+
+/**
+ * Forks job.workers processes connected by Unix sockets, merges their
+ * snapshots and writes the resolved image to job.output. The checkpoints
+ * are removed once every worker finished.
+ * @return The exit status: 0 if every worker finished its range
+ */
+int coordinate(Job const& job, WorkerFunction const& worker);
+}
+
+#endif
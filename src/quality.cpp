@@ -0,0 +1,204 @@
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <vector>
+
+#include "quality.hpp"
+
+using namespace std;
+
+namespace Quality
+{
+
+Result measure(Renderer& renderer, Job const& job, Image const& reference)
+{
+  renderer.seed(job.seed);
+  renderer.reset();
+
+  Result result = {false, 0, 0.0, 0.0, 0.0};
+  vector<float> rgbw((size_t)renderer.width() * renderer.height() * 4);
+  double elapsed = 0.0;
+  for(unsigned int s = 1; s <= job.max_samples; s++)
+  {
+    auto begin = chrono::steady_clock::now();
+    renderer.render();
+    elapsed +=
+        chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    if(s % job.check_every != 0 && s != job.max_samples)
+      continue;
+
+    renderer.read_accumulation(rgbw.data());
+    Image const image =
+        resolve(rgbw.data(), renderer.width(), renderer.height());
+    result.rmse = rmse(image, reference);
+    result.psnr = psnr(result.rmse);
+    if(!result.reached && result.rmse <= job.threshold)
+    {
+      result.reached = true;
+      result.samples = s;
+      result.seconds = elapsed;
+    }
+    cout << "[Quality] " << s << " samples, " << elapsed
+         << " s: rmse " << result.rmse << ", psnr " << result.psnr << " dB"
+         << endl;
+  }
+  return result;
+}
+
+/**
+ * Writes *value* so that parse_value reads it back, infinity (the PSNR of
+ * an exact match) as "inf": operator>> can't read that.
+ */
+static string format_value(double value)
+{
+  if(isinf(value))
+    return value > 0.0 ? "inf" : "-inf";
+  ostringstream text;
+  text.precision(9);
+  text << value;
+  return text.str();
+}
+
+/**
+ * @return false if *text* is not a number as written by format_value
+ */
+static bool parse_value(string const& text, double& value)
+{
+  if(text == "inf" || text == "-inf")
+  {
+    value = text[0] == '-' ? -numeric_limits<double>::infinity()
+                           : numeric_limits<double>::infinity();
+    return true;
+  }
+  char* end = nullptr;
+  value = strtod(text.c_str(), &end);
+  return !text.empty() && *end == '\0';
+}
+
+bool load_result(string const& path, Result& result)
+{
+  ifstream file(path);
+  map<string, double> values;
+  string key, text;
+  double value;
+  while(file >> key >> text)
+    if(parse_value(text, value))
+      values[key] = value;
+
+  char const* keys[] = {"reached", "samples", "seconds", "rmse", "psnr"};
+  for(auto k : keys)
+    if(values.count(k) == 0)
+      return false;
+
+  result.reached = values["reached"] > 0.5;
+  result.samples = (unsigned int)values["samples"];
+  result.seconds = values["seconds"];
+  result.rmse = values["rmse"];
+  result.psnr = values["psnr"];
+  return true;
+}
+
+bool store_result(string const& path, Result const& result)
+{
+  ofstream file(path);
+  file << "reached " << (result.reached ? 1 : 0) << "\n"
+       << "samples " << result.samples << "\n"
+       << "seconds " << format_value(result.seconds) << "\n"
+       << "rmse " << format_value(result.rmse) << "\n"
+       << "psnr " << format_value(result.psnr) << "\n";
+  return file.good();
+}
+
+/**
+ * Renders the reference with a seed unrelated to the measured one, so the
+ * measurement is not a prefix of it.
+ */
+static bool render_reference(Renderer& renderer, Job const& job)
+{
+  renderer.seed(~job.seed);
+  renderer.reset();
+  for(unsigned int s = 0; s < job.reference_samples; s++)
+    renderer.render();
+
+  vector<float> rgbw((size_t)renderer.width() * renderer.height() * 4);
+  renderer.read_accumulation(rgbw.data());
+  cout << "[Quality] Reference rendered with " << job.reference_samples
+       << " samples" << endl;
+  return write_png(job.reference,
+                   resolve(rgbw.data(), renderer.width(), renderer.height()));
+}
+
+int run(Renderer& renderer, Job const& job)
+{
+  string const baseline_path = job.reference + ".baseline";
+
+  if(job.update && !render_reference(renderer, job))
+    return 1;
+
+  Image reference;
+  if(!read_png(job.reference, reference))
+    return 1;
+  if(reference.width != renderer.width() ||
+     reference.height != renderer.height())
+  {
+    cerr << "[Quality] " << job.reference << " is " << reference.width << "x"
+         << reference.height << ", rendering " << renderer.width() << "x"
+         << renderer.height() << endl;
+    return 1;
+  }
+
+  Result const result = measure(renderer, job, reference);
+  if(result.reached)
+    cout << "[Quality] rmse " << job.threshold << " reached after "
+         << result.samples << " samples, " << result.seconds << " s" << endl;
+  else
+    cout << "[Quality] rmse " << job.threshold << " not reached" << endl;
+
+  if(job.update)
+  {
+    if(!store_result(baseline_path, result))
+      return 1;
+    cout << "[Quality] Baseline written to " << baseline_path << endl;
+    return 0;
+  }
+
+  Result baseline;
+  if(!load_result(baseline_path, baseline))
+  {
+    cerr << "[Quality] No baseline at " << baseline_path
+         << ", record one with --update-reference" << endl;
+    return 1;
+  }
+
+  int status = 0;
+  double const slack = 1.0 + job.tolerance;
+  if(baseline.reached && !result.reached)
+  {
+    cerr << "[Quality] Regression: threshold no longer reached" << endl;
+    status = 1;
+  }
+  if(baseline.reached && result.reached &&
+     result.seconds > baseline.seconds * slack)
+  {
+    cerr << "[Quality] Regression: time to quality " << result.seconds
+         << " s, baseline " << baseline.seconds << " s" << endl;
+    status = 1;
+  }
+  if(result.rmse > baseline.rmse * slack)
+  {
+    cerr << "[Quality] Regression: rmse " << result.rmse << ", baseline "
+         << baseline.rmse << endl;
+    status = 1;
+  }
+
+  if(status == 0)
+    cout << "[Quality] Passed" << endl;
+  return status;
+}
+}
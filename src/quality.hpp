@@ -0,0 +1,67 @@
+#ifndef __QUALITY_H__
+#define __QUALITY_H__
+
+#include <cstdint>
+#include <string>
+
+#include "image.hpp"
+#include "renderer.hpp"
+
+namespace Quality
+{
+
+/**
+ * Time-to-quality measurement of one scene against a reference image.
+ */
+struct Job
+{
+  /** Samples per pixel after which the measurement stops **/
+  unsigned int max_samples;
+  /** Samples per pixel of the reference image **/
+  unsigned int reference_samples;
+  /** Samples between two error evaluations **/
+  unsigned int check_every;
+  uint64_t seed;
+  /** RMSE (on a [0, 1] scale) to reach **/
+  double threshold;
+  /** Allowed relative regression against the baseline **/
+  double tolerance;
+  /** Reference PNG, the baseline is stored next to it **/
+  std::string reference;
+  /** Render a new reference and record a new baseline **/
+  bool update;
+};
+
+struct Result
+{
+  bool reached;
+  /** Samples and render wall time until the threshold was reached **/
+  unsigned int samples;
+  double seconds;
+  /** Error after max_samples **/
+  double rmse;
+  double psnr;
+};
+
+/**
+ * Renders with a fixed seed and evaluates the error every
+ * job.check_every samples. Only the kernel dispatches are timed.
+ */
+Result measure(Renderer& renderer, Job const& job, Image const& reference);
+
+/**
+ * Baselines are plain "key value" lines.
+ * @return false on I/O errors or missing keys
+ */
+bool load_result(std::string const& path, Result& result);
+bool store_result(std::string const& path, Result const& result);
+
+/**
+ * Measures against job.reference and compares to its baseline.
+ * With job.update, renders the reference and baseline first.
+ * @return The exit status: nonzero if time or error regressed
+ */
+int run(Renderer& renderer, Job const& job);
+}
+
+#endif
@@ -0,0 +1,578 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "raycast.hpp"
+#include "scene_helper.hpp"
+
+/** Pending octree nodes of a packet, see Octree::print_to_array **/
+#define RAY_STACK_SIZE 256
+/** Closer hits are the surface the ray starts on, as on the device **/
+#define RAY_EPSILON 0.00001f
+/**
+ * Direction components smaller than this count as 0. Their inverse is
+ * large but finite: with inf, a ray starting on a slab plane would get
+ * 0 * inf = NaN there and miss the node.
+ */
+#define RAY_MIN_DIR 1e-20f
+/** Rays per set that benchmark checks against the brute force **/
+#define BENCH_CHECKED 4096
+
+using namespace std;
+
+namespace Raycast
+{
+
+/**
+ * Rays of a packet as structure of arrays, so that every step runs on all
+ * lanes at once. Lanes past *size* are inactive: their t is negative.
+ */
+struct Packet
+{
+  unsigned int size;
+  float ox[RAY_PACKET], oy[RAY_PACKET], oz[RAY_PACKET];
+  float dx[RAY_PACKET], dy[RAY_PACKET], dz[RAY_PACKET];
+  float ix[RAY_PACKET], iy[RAY_PACKET], iz[RAY_PACKET];
+  /** Closest hit so far, or tmax; negative once a lane is done **/
+  float t[RAY_PACKET];
+  uint32_t prim[RAY_PACKET];
+};
+
+/** An octree node a packet has yet to trace **/
+struct NodeEntry
+{
+  uint32_t offset;
+  /** Nearest entry distance of the lanes, see test_node **/
+  float enter;
+};
+
+__attribute__((const)) static float inverse(float d)
+{
+  return fabs(d) > RAY_MIN_DIR ? 1.0f / d : copysign(1.0f / RAY_MIN_DIR, d);
+}
+
+static void load_packet(Packet& p, Ray const* rays, unsigned int size)
+{
+  p.size = size;
+  for(unsigned int l = 0; l < RAY_PACKET; l++)
+  {
+    Ray const& r = rays[l < size ? l : 0];
+    p.ox[l] = r.origin.x;
+    p.oy[l] = r.origin.y;
+    p.oz[l] = r.origin.z;
+    p.dx[l] = r.dir.x;
+    p.dy[l] = r.dir.y;
+    p.dz[l] = r.dir.z;
+    p.ix[l] = inverse(r.dir.x);
+    p.iy[l] = inverse(r.dir.y);
+    p.iz[l] = inverse(r.dir.z);
+    p.t[l] = l < size ? r.tmax : -1.0f;
+    p.prim[l] = RAY_MISS;
+  }
+}
+
+/**
+ * The lane loops below are written without branches, so that the compiler
+ * turns them into SIMD code: ternaries as min and max, & instead of &&.
+ */
+static inline float fmin2(float a, float b) { return a < b ? a : b; }
+static inline float fmax2(float a, float b) { return a > b ? a : b; }
+
+/**
+ * Square roots of all lanes of *v*, which are not negative. sqrt itself
+ * keeps loops scalar, it may have to set errno.
+ */
+static void sqrt_lanes(float* v)
+{
+#ifdef __SSE__
+  for(unsigned int l = 0; l < RAY_PACKET; l += 4)
+    _mm_storeu_ps(v + l, _mm_sqrt_ps(_mm_loadu_ps(v + l)));
+#else
+  for(unsigned int l = 0; l < RAY_PACKET; l++)
+    v[l] = sqrt(v[l]);
+#endif
+}
+
+/**
+ * Smallest and largest lane of *v*. Reduced inside a lane loop, they would
+ * keep it scalar: without -ffast-math, "a < b ? a : b" is no min for GCC.
+ */
+static float min_lanes(float const* v)
+{
+#ifdef __SSE__
+  __m128 m = _mm_loadu_ps(v);
+  for(unsigned int l = 4; l < RAY_PACKET; l += 4)
+    m = _mm_min_ps(m, _mm_loadu_ps(v + l));
+  m = _mm_min_ps(m, _mm_movehl_ps(m, m));
+  return _mm_cvtss_f32(_mm_min_ss(m, _mm_shuffle_ps(m, m, 1)));
+#else
+  float m = v[0];
+  for(unsigned int l = 1; l < RAY_PACKET; l++)
+    m = fmin2(m, v[l]);
+  return m;
+#endif
+}
+
+static float max_lanes(float const* v)
+{
+#ifdef __SSE__
+  __m128 m = _mm_loadu_ps(v);
+  for(unsigned int l = 4; l < RAY_PACKET; l += 4)
+    m = _mm_max_ps(m, _mm_loadu_ps(v + l));
+  m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+  return _mm_cvtss_f32(_mm_max_ss(m, _mm_shuffle_ps(m, m, 1)));
+#else
+  float m = v[0];
+  for(unsigned int l = 1; l < RAY_PACKET; l++)
+    m = fmax2(m, v[l]);
+  return m;
+#endif
+}
+
+/**
+ * Nearest distance at which a lane's ray enters the bounds of *node*,
+ * of the lanes that do so before their t. INFINITY if none does.
+ */
+__attribute__((pure)) static float test_node(Packet const& p,
+                                             float const* node)
+{
+  float const inf = numeric_limits<float>::infinity();
+  float nearest[RAY_PACKET];
+  for(unsigned int l = 0; l < RAY_PACKET; l++)
+  {
+    float const x0 = (node[0] - p.ox[l]) * p.ix[l];
+    float const x1 = (node[3] - p.ox[l]) * p.ix[l];
+    float const y0 = (node[1] - p.oy[l]) * p.iy[l];
+    float const y1 = (node[4] - p.oy[l]) * p.iy[l];
+    float const z0 = (node[2] - p.oz[l]) * p.iz[l];
+    float const z1 = (node[5] - p.oz[l]) * p.iz[l];
+    float const enter = fmax2(fmax2(fmin2(x0, x1), fmin2(y0, y1)),
+                              fmax2(fmin2(z0, z1), 0.0f));
+    float const exit =
+        fmin2(fmin2(fmax2(x0, x1), fmax2(y0, y1)), fmax2(z0, z1));
+    int const hit = (enter <= exit) & (enter < p.t[l]);
+    nearest[l] = hit ? enter : inf;
+  }
+  return min_lanes(nearest);
+}
+
+/**
+ * Distance of every lane to triangle *tri*, INFINITY where it misses.
+ */
+static void hit_triangle(Packet const& p, float const* tri, float* dist)
+{
+  glm::vec3 const a(tri[6], tri[7], tri[8]);
+  glm::vec3 const e1 = glm::vec3(tri[9], tri[10], tri[11]) - a;
+  glm::vec3 const e2 = glm::vec3(tri[12], tri[13], tri[14]) - a;
+
+  for(unsigned int l = 0; l < RAY_PACKET; l++)
+  {
+    float const px = p.dy[l] * e2.z - p.dz[l] * e2.y;
+    float const py = p.dz[l] * e2.x - p.dx[l] * e2.z;
+    float const pz = p.dx[l] * e2.y - p.dy[l] * e2.x;
+    float const det = e1.x * px + e1.y * py + e1.z * pz;
+    float const inv_det = 1.0f / det;
+
+    float const tx = p.ox[l] - a.x;
+    float const ty = p.oy[l] - a.y;
+    float const tz = p.oz[l] - a.z;
+    float const u = (tx * px + ty * py + tz * pz) * inv_det;
+
+    float const qx = ty * e1.z - tz * e1.y;
+    float const qy = tz * e1.x - tx * e1.z;
+    float const qz = tx * e1.y - ty * e1.x;
+    float const v = (p.dx[l] * qx + p.dy[l] * qy + p.dz[l] * qz) * inv_det;
+    float const d = (e2.x * qx + e2.y * qy + e2.z * qz) * inv_det;
+
+    int const hit = (det >= RAY_EPSILON) & (u >= 0.0f) & (u <= 1.0f) &
+                    (v >= 0.0f) & (u + v <= 1.0f) & (d > RAY_EPSILON);
+    dist[l] = hit ? d : numeric_limits<float>::infinity();
+  }
+}
+
+/**
+ * Distance of every lane to sphere *sphere*, INFINITY where it misses.
+ */
+static void hit_sphere(Packet const& p, float const* sphere, float* dist)
+{
+  glm::vec3 const center(sphere[6], sphere[7], sphere[8]);
+  float const r2 = sphere[9] * sphere[9];
+
+  float b[RAY_PACKET], disc[RAY_PACKET], root[RAY_PACKET];
+  for(unsigned int l = 0; l < RAY_PACKET; l++)
+  {
+    float const cx = center.x - p.ox[l];
+    float const cy = center.y - p.oy[l];
+    float const cz = center.z - p.oz[l];
+    b[l] = cx * p.dx[l] + cy * p.dy[l] + cz * p.dz[l];
+    disc[l] = b[l] * b[l] - (cx * cx + cy * cy + cz * cz) + r2;
+    root[l] = fmax2(disc[l], 0.0f);
+  }
+  sqrt_lanes(root);
+
+  /* The near root, or the far one from inside the sphere */
+  float const inf = numeric_limits<float>::infinity();
+  for(unsigned int l = 0; l < RAY_PACKET; l++)
+  {
+    float const near = b[l] - root[l];
+    float const far = b[l] + root[l];
+    float const d = fmin2(near > RAY_EPSILON ? near : inf,
+                          far > RAY_EPSILON ? far : inf);
+    dist[l] = disc[l] >= 0.0f ? d : inf;
+  }
+}
+
+/**
+ * Records the hits in *dist* of primitive *id* that are closer than the
+ * lanes' t. With *any_hit*, a lane is done at its first hit instead.
+ * @return The largest t of the lanes, negative once all are done
+ */
+static float take_hits(Packet& p, float const* dist, uint32_t id, bool any_hit)
+{
+  /* Masks and min instead of "t = closer ? d : t": GCC turns that into a
+   * conditional store, which keeps the loop scalar */
+  float const inf = numeric_limits<float>::infinity();
+  for(unsigned int l = 0; l < RAY_PACKET; l++)
+  {
+    float const old = p.t[l];
+    uint32_t const closer = 0u - (uint32_t)(dist[l] < old);
+    float const t = fmin2(closer ? (any_hit ? -1.0f : dist[l]) : inf, old);
+    p.t[l] = t;
+    p.prim[l] = (id & closer) | (p.prim[l] & ~closer);
+  }
+  return max_lanes(p.t);
+}
+
+/**
+ * Tests every lane of *p* against primitive *id* at *object*.
+ * @return The largest t of the lanes, negative once all are done
+ */
+static float test_primitive(Packet& p,
+                            float const* object,
+                            uint32_t id,
+                            bool any_hit)
+{
+  float dist[RAY_PACKET];
+  if(((uint8_t const*)object)[1] == SPHERE)
+    hit_sphere(p, object, dist);
+  else
+    hit_triangle(p, object, dist);
+  return take_hits(p, dist, id, any_hit);
+}
+
+/**
+ * Writes the result of the lanes of *p* for rays from *first* on.
+ */
+static void store_packet(Packet const& p,
+                         size_t first,
+                         Hit* hits,
+                         uint8_t* blocked)
+{
+  for(unsigned int l = 0; l < p.size; l++)
+  {
+    if(hits != nullptr)
+    {
+      hits[first + l].dist = p.prim[l] == RAY_MISS
+                                 ? numeric_limits<float>::infinity()
+                                 : p.t[l];
+      hits[first + l].prim = p.prim[l];
+    }
+    if(blocked != nullptr)
+      blocked[first + l] = p.prim[l] != RAY_MISS ? 1 : 0;
+  }
+}
+
+Tracer::Tracer(ObjectsBuffer const& obj,
+               float const* surfaces_,
+               float const* lamps_,
+               float const* octree_)
+    : surfaces(surfaces_), lamps(lamps_), surf_count(obj.surf_count),
+      lamp_count(obj.lamp_count),
+      lamp_first(obj.lamp_float_index / PRIM_SIZE), octree(octree_)
+{
+}
+
+Tracer::Tracer(Scene const& scene, Octree& octree_)
+    : Tracer(scene.get_buffer(),
+             scene.get_buffer().buffer,
+             scene.get_buffer().buffer + scene.get_buffer().lamp_float_index,
+             nullptr)
+{
+  owned_octree.resize(octree_.array_size());
+  octree_.print_to_array(owned_octree.data());
+}
+
+__attribute__((pure)) float const* Tracer::record(uint32_t id) const
+{
+  return id >= lamp_first ? lamps + (id - lamp_first) * PRIM_SIZE
+                          : surfaces + id * PRIM_SIZE;
+}
+
+/* Not a stored pointer, so that a copied tracer doesn't point into the
+ * octree of the original */
+__attribute__((pure)) float const* Tracer::root(void) const
+{
+  return owned_octree.empty() ? octree : owned_octree.data();
+}
+
+void Tracer::trace(Ray const* rays,
+                   size_t begin,
+                   size_t end,
+                   Hit* hits,
+                   uint8_t* blocked) const
+{
+  float const* const tree = root();
+  bool const any_hit = blocked != nullptr;
+  Packet p;
+  NodeEntry stack[RAY_STACK_SIZE];
+
+  for(size_t first = begin; first < end; first += RAY_PACKET)
+  {
+    unsigned int const size =
+        (unsigned int)min<size_t>(end - first, RAY_PACKET);
+    load_packet(p, rays + first, size);
+
+    float far = max_lanes(p.t);
+    int top = 0;
+    float const enter = test_node(p, tree);
+    if(enter < far)
+      stack[top++] = {0, enter};
+    while(top > 0 && far >= 0.0f)
+    {
+      /* Hits found since the push may have moved every lane's t closer */
+      NodeEntry const entry = stack[--top];
+      if(entry.enter >= far)
+        continue;
+      float const* node = tree + entry.offset;
+
+      int32_t const* node_i = (int32_t const*)(node + 6);
+      int32_t const count = *node_i++;
+      if(count < 0)
+        continue; // stub of a paged cluster
+      for(int32_t i = 0; i < count && far >= 0.0f; i++)
+      {
+        uint32_t const id = (uint32_t)node_i[i];
+        far = test_primitive(p, record(id), id, any_hit);
+      }
+      node_i += count;
+
+      /* The children the packet enters, pushed far to near so that the
+       * nearest is traced first and its hits cull the others */
+      NodeEntry children[8];
+      unsigned int entered = 0;
+      for(unsigned int k = 0; k < 8 && far >= 0.0f; k++)
+      {
+        int32_t const off = node_i[k];
+        if(off == -1)
+          continue;
+        NodeEntry const child = {entry.offset + (uint32_t)off,
+                                 test_node(p, node + off)};
+        if(child.enter >= far)
+          continue;
+        unsigned int j = entered++;
+        for(; j > 0 && children[j - 1].enter < child.enter; j--)
+          children[j] = children[j - 1];
+        children[j] = child;
+      }
+      for(unsigned int j = 0; j < entered && top < RAY_STACK_SIZE; j++)
+        stack[top++] = children[j];
+    }
+
+    store_packet(p, first, hits, blocked);
+  }
+}
+
+void Tracer::closest(Ray const* rays,
+                     size_t count,
+                     Hit* hits,
+                     unsigned int threads) const
+{
+  unsigned int const chunks =
+      (unsigned int)((count + RAY_CHUNK - 1) / RAY_CHUNK);
+  parallel_for(chunks, threads, [&](unsigned int c) {
+    size_t const begin = (size_t)c * RAY_CHUNK;
+    trace(rays, begin, min(count, begin + RAY_CHUNK), hits, nullptr);
+  });
+}
+
+void Tracer::occluded(Ray const* rays,
+                      size_t count,
+                      uint8_t* blocked,
+                      unsigned int threads) const
+{
+  unsigned int const chunks =
+      (unsigned int)((count + RAY_CHUNK - 1) / RAY_CHUNK);
+  parallel_for(chunks, threads, [&](unsigned int c) {
+    size_t const begin = (size_t)c * RAY_CHUNK;
+    trace(rays, begin, min(count, begin + RAY_CHUNK), nullptr, blocked);
+  });
+}
+
+void Tracer::closest_brute_force(Ray const* rays,
+                                 size_t count,
+                                 Hit* hits) const
+{
+  Packet p;
+  for(size_t first = 0; first < count; first += RAY_PACKET)
+  {
+    load_packet(
+        p, rays + first, (unsigned int)min<size_t>(count - first, RAY_PACKET));
+    for(uint32_t i = 0; i < surf_count; i++)
+      test_primitive(p, record(i), i, false);
+    for(uint32_t i = lamp_first; i < lamp_first + lamp_count; i++)
+      test_primitive(p, record(i), i, false);
+    store_packet(p, first, hits, nullptr);
+  }
+}
+
+/******************************************************************************/
+/******************************************************************************/
+
+/**
+ * *count* rays from outside the cube of random_scene into it, row by row
+ * over a 60 degree field of view, so neighbouring rays are similar.
+ */
+static vector<Ray> coherent_rays(size_t count, float tmax)
+{
+  size_t const side = max<size_t>(1, (size_t)sqrt((double)count));
+  float const extent = tan(glm::radians(30.0f));
+  vector<Ray> rays(count);
+  for(size_t i = 0; i < count; i++)
+  {
+    float const x = ((float)(i % side) / (float)side * 2.0f - 1.0f) * extent;
+    float const y = ((float)(i / side) / (float)side * 2.0f - 1.0f) * extent;
+    rays[i].origin = glm::vec3(5.0f, 5.0f, -4.0f);
+    rays[i].dir = glm::normalize(glm::vec3(x, y, 1.0f));
+    rays[i].tmax = tmax;
+  }
+  return rays;
+}
+
+/**
+ * *count* rays with random origins in the cube and random directions.
+ */
+static vector<Ray> incoherent_rays(size_t count, float tmax)
+{
+  mt19937 rng(1234);
+  uniform_real_distribution<float> pos(0.0f, 10.0f);
+  normal_distribution<float> axis(0.0f, 1.0f);
+  vector<Ray> rays(count);
+  for(size_t i = 0; i < count; i++)
+  {
+    glm::vec3 dir(axis(rng), axis(rng), axis(rng));
+    if(glm::length(dir) < 0.001f)
+      dir = glm::vec3(0.0f, 1.0f, 0.0f);
+    rays[i].origin = glm::vec3(pos(rng), pos(rng), pos(rng));
+    rays[i].dir = glm::normalize(dir);
+    rays[i].tmax = tmax;
+  }
+  return rays;
+}
+
+/**
+ * Million rays per second for *count* rays in *seconds*.
+ */
+__attribute__((const)) static double mrays(size_t count, double seconds)
+{
+  return (double)count / max(seconds, 1e-9) * 1e-6;
+}
+
+/**
+ * Runs *query* on one thread and on *threads* and prints the throughput.
+ */
+static void measure(string const& name,
+                    size_t count,
+                    unsigned int threads,
+                    function<void(unsigned int)> const& query)
+{
+  double results[2];
+  unsigned int const counts[2] = {1, threads};
+  for(unsigned int i = 0; i < 2; i++)
+  {
+    auto const begin = chrono::steady_clock::now();
+    query(counts[i]);
+    results[i] = mrays(
+        count,
+        chrono::duration<double>(chrono::steady_clock::now() - begin)
+            .count());
+  }
+  cout << "[Raycast] " << name << ": " << results[0]
+       << " Mrays/s on 1 thread, " << results[1] << " Mrays/s on "
+       << threads << " threads" << endl;
+}
+
+int benchmark(unsigned int triangles,
+              size_t rays,
+              OctreeOptions const& options,
+              unsigned int threads)
+{
+  if(threads == 0)
+    threads = max(1u, thread::hardware_concurrency());
+
+  unsigned int const capacity = triangles + RANDOM_SCENE_EXTRA;
+  vector<float> buffer((size_t)capacity * PRIM_SIZE);
+  ObjectsBuffer obj(buffer.data(), capacity);
+  Scene scene(obj);
+  random_scene(scene, triangles);
+  unique_ptr<Octree> octree(scene.build_octree(options));
+  Tracer const tracer(scene, *octree);
+  cout << "[Raycast] " << obj.surf_count << " surfaces, " << obj.lamp_count
+       << " lamps, " << octree->array_size() << " floats of octree" << endl;
+
+  /** Closest hits of rays to infinity, occlusion of shadow-like rays that
+   * end a few units into the cube, also for the coherent ones from outside **/
+  float const shadow_tmax = 6.0f;
+  unsigned int mismatches = 0;
+  char const* const names[2] = {"coherent", "incoherent"};
+  for(unsigned int set = 0; set < 2; set++)
+  {
+    float const inf = numeric_limits<float>::infinity();
+    vector<Ray> const primary =
+        set == 0 ? coherent_rays(rays, inf) : incoherent_rays(rays, inf);
+    vector<Ray> const shadow = set == 0 ? coherent_rays(rays, shadow_tmax)
+                                        : incoherent_rays(rays, shadow_tmax);
+
+    vector<Hit> hits(rays);
+    vector<uint8_t> blocked(rays);
+    string const name(names[set]);
+    measure(name + " closest", rays, threads, [&](unsigned int n) {
+      tracer.closest(primary.data(), rays, hits.data(), n);
+    });
+    measure(name + " occluded", rays, threads, [&](unsigned int n) {
+      tracer.occluded(shadow.data(), rays, blocked.data(), n);
+    });
+
+    /* Ties between coincident primitives may pick either */
+    size_t const checked = min<size_t>(rays, BENCH_CHECKED);
+    vector<Hit> expected(checked);
+    tracer.closest_brute_force(primary.data(), checked, expected.data());
+    for(size_t i = 0; i < checked; i++)
+    {
+      Hit const& a = hits[i];
+      Hit const& b = expected[i];
+      bool const same = a.prim == b.prim ||
+                        (a.prim != RAY_MISS && b.prim != RAY_MISS &&
+                         fabs(a.dist - b.dist) <= 1e-4f * max(1.0f, b.dist));
+      mismatches += same ? 0 : 1;
+    }
+    tracer.closest_brute_force(shadow.data(), checked, expected.data());
+    for(size_t i = 0; i < checked; i++)
+      mismatches += (blocked[i] != 0) != (expected[i].prim != RAY_MISS);
+  }
+
+  cout << "[Raycast] " << mismatches << " mismatches against brute force"
+       << endl;
+  return mismatches > 0 ? 1 : 0;
+}
+}
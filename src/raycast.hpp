@@ -0,0 +1,131 @@
+#ifndef __RAYCAST_H__
+#define __RAYCAST_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "octree.hpp"
+#include "scene.hpp"
+
+/** Rays traced together through the octree, one SIMD lane each **/
+#define RAY_PACKET 8
+/** Rays a thread takes from a batch at once **/
+#define RAY_CHUNK 1024
+/** Hit::prim of rays that hit nothing **/
+#define RAY_MISS 0xFFFFFFFFu
+
+namespace Raycast
+{
+
+struct Ray
+{
+  glm::vec3 origin;
+  /** Normalized **/
+  glm::vec3 dir;
+  /** Hits beyond this distance are ignored **/
+  float tmax;
+};
+
+struct Hit
+{
+  float dist;
+  /** Primitive id, see Scene::build_octree, or RAY_MISS **/
+  uint32_t prim;
+};
+
+/**
+ * Ray queries on the host against the same data the device traces: the
+ * primitive records and the flattened octree. Rays are traced in packets
+ * of RAY_PACKET that share one walk through the octree, nearest nodes
+ * first, so packets of similar rays (picking, probes from one point) are
+ * the fastest.
+ * Primitives are hit as in the kernel: triangles from the front only.
+ */
+class Tracer
+{
+private:
+  float const* surfaces;
+  float const* lamps;
+  unsigned int surf_count;
+  unsigned int lamp_count;
+  unsigned int lamp_first;
+  float const* octree;
+  /** Flattened octree of a tracer built from a Scene, else empty **/
+  std::vector<float> owned_octree;
+
+  float const* record(uint32_t id) const;
+  float const* root(void) const;
+
+  /**
+   * Traces rays [begin, end) of one thread, *hits* or *blocked* is null.
+   */
+  void trace(Ray const* rays,
+             size_t begin,
+             size_t end,
+             Hit* hits,
+             uint8_t* blocked) const;
+
+public:
+  /**
+   * Arguments as for Renderer::upload_scene, they have to outlive the
+   * tracer. Paged octrees (see ClusterCache) are not supported.
+   */
+  Tracer(ObjectsBuffer const& obj,
+         float const* surfaces,
+         float const* lamps,
+         float const* octree);
+
+  /**
+   * Traces *scene* through *octree*, which has to be built from it (see
+   * Scene::build_octree). The tracer keeps its own flattened copy of the
+   * octree, the objects buffer of the scene has to outlive it.
+   * Throws std::logic_error on a segment scene.
+   */
+  Tracer(Scene const& scene, Octree& octree);
+  virtual ~Tracer(void) {}
+
+  /**
+   * Closest hit of each of *count* *rays* in *hits*.
+   * @param threads - 0 for one per core
+   */
+  void closest(Ray const* rays,
+               size_t count,
+               Hit* hits,
+               unsigned int threads = 0) const;
+
+  /**
+   * Whether each of *count* *rays* hits anything before its tmax: 1 or 0
+   * in *blocked*. Cheaper than closest, a ray stops at the first hit.
+   * @param threads - 0 for one per core
+   */
+  void occluded(Ray const* rays,
+                size_t count,
+                uint8_t* blocked,
+                unsigned int threads = 0) const;
+
+  /**
+   * Closest hits found by testing every primitive, without the octree.
+   * A reference for closest and occluded, far too slow for anything else.
+   */
+  void closest_brute_force(Ray const* rays, size_t count, Hit* hits) const;
+};
+
+/**
+ * Checks a Tracer against closest_brute_force and measures its throughput
+ * on a random scene of *triangles* small triangles, for coherent rays
+ * (from one point) and incoherent ones, on one thread and on *threads*.
+ * The scene is split as for rendering with *options*: with the default
+ * plain octree, every straddler of the root's planes is tested by every ray.
+ * @param threads - 0 for one per core
+ * @return The exit status: nonzero if a query disagreed with the reference
+ */
+int benchmark(unsigned int triangles,
+              size_t rays,
+              OctreeOptions const& options,
+              unsigned int threads);
+}
+
+#endif
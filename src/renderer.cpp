@@ -0,0 +1,662 @@
+#include "renderer.hpp"
+#include "sampler.hpp"
+#include "scene_cache.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <string>
+
+/** Side of the tiles trace_persistent hands out **/
+#define PERSISTENT_TILE 8
+/** Resident work-groups per compute unit in persistent mode **/
+#define PERSISTENT_GROUPS_PER_UNIT 4
+/** 1/MEMORY_HEADROOM of the device memory is left to the driver **/
+#define MEMORY_HEADROOM 16
+/** Launches per sample at most that trace pixels waiting for clusters **/
+#define PAGING_PASSES 4
+
+using namespace std;
+using namespace OpenCL;
+
+Renderer::Renderer(Environment const& environment,
+                   unsigned int max_width,
+                   unsigned int max_height,
+                   unsigned int max_primitives,
+                   unsigned int octree_size,
+                   unsigned int bounces,
+                   bool relaxed_math)
+    : env(environment), path_tracer("./cl/ray_frag.cl", "trace"),
+      persistent_tracer("./cl/ray_frag.cl", "trace_persistent"),
+      reprojector("./cl/ray_frag.cl", "reproject"), max_w(max_width),
+      max_h(max_height), max_bounces(bounces),
+      fast_math(relaxed_math), reprojection(false), built(false),
+      persistent(false), instrumented(false),
+      sampler(SAMPLER_SOBOL),
+      persistent_items(0), w(max_width),
+      h(max_height),
+      camera(), surf_count(0), lamp_count(0), lamp_float_index(0),
+      scene_id(0), samples(0.0f), first_sample(0.0f), clusters(nullptr)
+{
+  /** Buffers **/
+  data_mem /*float */ = env.allocate(20 * sizeof(float), "camera");
+  objects_mem /*float */ =
+      env.allocate(max_primitives * PRIM_SIZE * sizeof(float), "scene");
+  octree_mem /*float */ = env.allocate(octree_size * sizeof(float), "scene");
+  samples_mem /*float */ = env.allocate(sizeof(float), "accumulation");
+  prng_mem /*PRNG  */ = env.allocate(17 * sizeof(uint64_t), "prng");
+  counter_mem /*uint  */ = env.allocate(sizeof(cl_uint), "scheduling");
+  counters_mem.size = 0;
+  paging_mem.size = 0;
+  pending_mem.size = 0;
+  sampler_mem /*uint  */ =
+      env.allocate(SAMPLER_TABLE_SIZE * sizeof(uint32_t), "sampler");
+
+  /**
+  * The aux buffer is meant for the eye and lamp vertices of bidirectional
+  * paths, which the kernel doesn't trace yet: it gets a dummy float and
+  * AUX_BOUNCES is 0.
+  */
+  aux_mem /*float */ = env.allocate(sizeof(float), "aux");
+
+  /**
+  * The per-pixel buffers get what is left of the device memory. Without
+  * room for the reprojection history, a moving camera restarts the
+  * accumulation instead. Without room for the frame itself, the largest
+  * resolution shrinks and the window scales the frames up.
+  */
+  MemoryTracker const& memory = env.memory();
+  size_t const headroom = memory.global_memory() / MEMORY_HEADROOM;
+  size_t const budget =
+      memory.budget() > headroom ? memory.budget() - headroom : 0;
+  size_t const frame_bytes = sizeof(uint32_t) + 5 * sizeof(float);
+  size_t const history_bytes = 5 * sizeof(float);
+  size_t const max_pixels = min(budget / frame_bytes,
+                                memory.max_allocation() / (4 * sizeof(float)));
+
+  size_t pixels = (size_t)max_w * max_h;
+  reprojection =
+      pixels * (frame_bytes + history_bytes) + data_mem.size <= budget;
+  if(pixels > max_pixels)
+  {
+    double const scale = sqrt((double)max_pixels / (double)pixels);
+    max_w = max(1u, (unsigned int)(max_w * scale));
+    max_h = max(1u, (unsigned int)(max_h * scale));
+    while((size_t)max_w * max_h > max_pixels && max_w > 1)
+    {
+      max_w--;
+      max_h = max(1u, (unsigned int)((double)max_w * max_height / max_width));
+    }
+    cout << "[Renderer] Resolution reduced from " << max_width << "x"
+         << max_height << " to " << max_w << "x" << max_h
+         << " to fit device memory" << endl;
+    pixels = (size_t)max_w * max_h;
+    w = max_w;
+    h = max_h;
+  }
+  if(!reprojection)
+  {
+    cout << "[Renderer] Reprojection disabled, its history doesn't fit "
+            "device memory"
+         << endl;
+  }
+
+  frame_c_mem /*char4 */ = env.allocate(pixels * sizeof(uint32_t), "frame");
+  frame_f_mem /*float4*/ =
+      env.allocate(pixels * 4 * sizeof(float), "accumulation");
+  depth_mem /*float */ = env.allocate(pixels * sizeof(float), "frame");
+
+  if(reprojection)
+  {
+    prev_data_mem /*float */ = env.allocate(data_mem.size, "camera");
+    history_mem /*float4*/ = env.allocate(frame_f_mem.size, "history");
+    prev_depth_mem /*float */ = env.allocate(depth_mem.size, "history");
+  }
+
+  memory.print();
+
+  /** CommandQueue **/
+  queue = env.create_queue(CL_QUEUE_PROFILING_ENABLE);
+
+  writeBufferBlocking(queue, sampler_mem, sampler_tables().data());
+
+  seed(0);
+  reset();
+}
+
+void Renderer::build(BuildOptions const& options)
+{
+  if(built && options == path_tracer.options())
+    return;
+
+  if(instrumented && counters_mem.size == 0)
+  {
+    counters_mem /*uint4 */ =
+        env.allocate(max_w * max_h * 4 * sizeof(cl_uint), "counters");
+    clearBufferBlocking(queue, counters_mem);
+  }
+
+  path_tracer.make(env, options);
+  path_tracer.set_argument(0, data_mem);
+  path_tracer.set_argument(1, objects_mem);
+  path_tracer.set_argument(2, octree_mem);
+  path_tracer.set_argument(3, aux_mem);
+  path_tracer.set_argument(4, frame_c_mem);
+  path_tracer.set_argument(5, frame_f_mem);
+  path_tracer.set_argument(6, samples_mem);
+  path_tracer.set_argument(7, prng_mem);
+  path_tracer.set_argument(8, depth_mem);
+  path_tracer.set_argument(9, sampler_mem);
+  unsigned int arg = 10;
+  if(pager)
+  {
+    path_tracer.set_argument(arg++, paging_mem);
+    path_tracer.set_argument(arg++, pending_mem);
+  }
+  if(instrumented)
+    path_tracer.set_argument(arg, counters_mem);
+
+  cout << "[Renderer] PathTracer compiled" << endl;
+
+  persistent_tracer.make(env, options);
+  persistent_tracer.set_argument(0, data_mem);
+  persistent_tracer.set_argument(1, objects_mem);
+  persistent_tracer.set_argument(2, octree_mem);
+  persistent_tracer.set_argument(3, aux_mem);
+  persistent_tracer.set_argument(4, frame_c_mem);
+  persistent_tracer.set_argument(5, frame_f_mem);
+  persistent_tracer.set_argument(6, samples_mem);
+  persistent_tracer.set_argument(7, prng_mem);
+  persistent_tracer.set_argument(8, depth_mem);
+  persistent_tracer.set_argument(9, sampler_mem);
+  persistent_tracer.set_argument(10, counter_mem);
+  arg = 11;
+  if(pager)
+  {
+    persistent_tracer.set_argument(arg++, paging_mem);
+    persistent_tracer.set_argument(arg++, pending_mem);
+  }
+  if(instrumented)
+    persistent_tracer.set_argument(arg, counters_mem);
+
+  /* Enough groups to keep every compute unit busy, no more */
+  size_t const group =
+      min<size_t>(PERSISTENT_TILE * PERSISTENT_TILE,
+                  persistent_tracer.resources().work_group_size);
+  cl_uint const units = get_device_info_(
+      env.m_devices[0], CL_DEVICE_MAX_COMPUTE_UNITS, cl_uint);
+  persistent_tracer.set_local_size(group, 1);
+  persistent_items = group * units * PERSISTENT_GROUPS_PER_UNIT;
+
+  if(reprojection)
+  {
+    reprojector.make(env, options);
+    reprojector.set_argument(0, data_mem);
+    reprojector.set_argument(1, prev_data_mem);
+    reprojector.set_argument(2, objects_mem);
+    reprojector.set_argument(3, octree_mem);
+    reprojector.set_argument(4, history_mem);
+    reprojector.set_argument(5, prev_depth_mem);
+    reprojector.set_argument(6, frame_f_mem);
+    reprojector.set_argument(7, depth_mem);
+    if(pager)
+    {
+      reprojector.set_argument(8, paging_mem);
+      reprojector.set_argument(9, pending_mem);
+    }
+  }
+
+  built = true;
+}
+
+BuildOptions Renderer::variant(ObjectsBuffer const& obj,
+                               float const* surfaces,
+                               float const* lamps) const
+{
+  uint32_t materials = 0;
+  uint32_t shapes = 0;
+
+  float const* ranges[2] = {surfaces, lamps};
+  unsigned int const counts[2] = {obj.surf_count, obj.lamp_count};
+  for(unsigned int r = 0; r < 2; r++)
+    for(unsigned int i = 0; i < counts[r]; i++)
+    {
+      uint8_t const* header = (uint8_t const*)(ranges[r] + i * PRIM_SIZE);
+      /* Unknown bytes (a foreign or corrupt record) don't enable code */
+      if(header[0] <= GLASS)
+        materials |= 1u << header[0];
+      if(header[1] <= SPHERE)
+        shapes |= 1u << header[1];
+    }
+  return variant(materials, shapes);
+}
+
+BuildOptions Renderer::variant(uint32_t materials, uint32_t shapes) const
+{
+  BuildOptions options;
+  options.define("PRIM_SIZE", PRIM_SIZE)
+      .define("MAX_BOUNCES", max_bounces)
+      .define("AUX_BOUNCES", 0)
+      .define("HAS_DIFFUSE", (materials >> DIFFUSE) & 1)
+      .define("HAS_METALLIC", (materials >> METALLIC) & 1)
+      .define("HAS_MIRROR", (materials >> MIRROR) & 1)
+      .define("HAS_GLASS", (materials >> GLASS) & 1)
+      .define("HAS_TRIANGLE", (shapes >> TRIANGLE) & 1)
+      .define("HAS_SPHERE", (shapes >> SPHERE) & 1)
+      .define("PERSISTENT_TILE", PERSISTENT_TILE)
+      .define("SAMPLER", sampler)
+      .define("BLUE_NOISE_SIZE", BLUE_NOISE_SIZE);
+  if(instrumented)
+    options.define("INSTRUMENT");
+  if(pager)
+    options.define("PAGING");
+  if(fast_math)
+    options.flag("-cl-fast-relaxed-math").flag("-cl-mad-enable");
+  return options;
+}
+
+void Renderer::push_camera(void)
+{
+  /**
+  * Main kernel function.
+  * general_data is an array of 20 4-byte units:
+  * fovy, aspect :: Float
+  * posx, posy, posz :: Float
+  * dirx, diry, dirz :: Float
+  * upx, upy, upz :: Float
+  * leftx, lefty, leftz :: Float
+  * size_w, size_h :: UInt
+  * num_surfs :: UInt
+  * num_lamps :: UInt
+  * off_lamps :: UInt
+  * max_bounces :: UInt
+   */
+  float data[20];
+  data[0] = camera.fov;
+  data[1] = float(w) / float(h);
+  data[2] = camera.pos.x;
+  data[3] = camera.pos.y;
+  data[4] = camera.pos.z;
+  data[5] = camera.dir.x;
+  data[6] = camera.dir.y;
+  data[7] = camera.dir.z;
+  data[8] = camera.up.x;
+  data[9] = camera.up.y;
+  data[10] = camera.up.z;
+  data[11] = camera.left.x;
+  data[12] = camera.left.y;
+  data[13] = camera.left.z;
+
+  unsigned int* data_i = (unsigned int*)(data + 14);
+  data_i[0] = w;
+  data_i[1] = h;
+  data_i[2] = surf_count;
+  data_i[3] = lamp_count;
+  data_i[4] = lamp_float_index;
+  data_i[5] = max_bounces;
+
+  writeBufferBlocking(queue, data_mem, data);
+}
+
+void Renderer::upload_scene(ObjectsBuffer const& obj,
+                            float const* surfaces,
+                            float const* lamps,
+                            float const* octree,
+                            unsigned int octree_size,
+                            uint64_t id)
+{
+  BuildOptions options = variant(obj, surfaces, lamps);
+  if(Octree::shares_primitives(octree))
+    options.define("SHARED_PRIMITIVES");
+  build(options);
+
+  surf_count = obj.surf_count;
+  lamp_count = obj.lamp_count;
+  lamp_float_index = obj.lamp_float_index;
+
+  size_t const prim_bytes = PRIM_SIZE * sizeof(float);
+  writeBufferBlocking(
+      queue, objects_mem, 0, obj.surf_count * prim_bytes, surfaces);
+  writeBufferBlocking(queue,
+                      objects_mem,
+                      obj.lamp_float_index * sizeof(float),
+                      obj.lamp_count * prim_bytes,
+                      lamps);
+  writeBufferBlocking(
+      queue, octree_mem, 0, octree_size * sizeof(float), octree);
+  push_camera();
+  scene_id = id;
+}
+
+__attribute__((pure)) bool Renderer::fits(unsigned int width,
+                                          unsigned int height,
+                                          unsigned int primitives,
+                                          unsigned int octree_size) const
+{
+  return width <= max_w && height <= max_h &&
+         primitives * PRIM_SIZE * sizeof(float) <= objects_mem.size &&
+         octree_size * sizeof(float) <= octree_mem.size;
+}
+
+void Renderer::upload_paged_scene(ClusterCache const& cache,
+                                  unsigned int slots)
+{
+  ClusterCacheHeader const& header = cache.header();
+  size_t const table_bytes =
+      (PAGING_SLOTS + 3 * header.cluster_count) * sizeof(cl_uint);
+  if(paging_mem.size != table_bytes)
+  {
+    paging_mem /*uint  */ = env.allocate(table_bytes, "paging");
+    built = false; // rebind the new table
+  }
+  if(pending_mem.size == 0)
+  {
+    pending_mem /*uint  */ =
+        env.allocate(max_w * max_h * sizeof(cl_uint), "paging");
+    clearBufferBlocking(queue, pending_mem);
+  }
+  clusters = &cache;
+  pager.reset(new ClusterPager(cache, max(1u, slots)));
+  writeBufferBlocking(queue, paging_mem, pager->table().data());
+
+  BuildOptions options = variant(header.materials, header.shapes);
+  if(header.shared)
+    options.define("SHARED_PRIMITIVES");
+  build(options);
+
+  /* Lamps first, then the resident surfaces, see paging.hpp */
+  surf_count = header.surf_count;
+  lamp_count = header.lamp_count;
+  lamp_float_index = 0;
+
+  size_t const prim_bytes = PRIM_SIZE * sizeof(float);
+  writeBufferBlocking(
+      queue, objects_mem, 0, header.lamp_count * prim_bytes, cache.lamps());
+  writeBufferBlocking(queue,
+                      objects_mem,
+                      header.lamp_count * prim_bytes,
+                      header.surf_count * prim_bytes,
+                      cache.surfaces());
+  writeBufferBlocking(
+      queue, octree_mem, 0, header.top_size * sizeof(float), cache.top());
+  push_camera();
+  scene_id = header.header_checksum;
+
+  cout << "[Renderer] Paging " << header.cluster_count << " clusters through "
+       << pager->slots() << " slots" << endl;
+}
+
+void Renderer::upload_object(ObjectsBuffer const& obj,
+                             SceneObject const& object,
+                             vector<Octree*> const& nodes)
+{
+  writeBufferBlocking(queue,
+                      objects_mem,
+                      object.surf_begin * sizeof(float),
+                      (object.surf_end - object.surf_begin) * sizeof(float),
+                      obj.buffer + object.surf_begin);
+  writeBufferBlocking(queue,
+                      objects_mem,
+                      object.lamp_begin * sizeof(float),
+                      (object.lamp_end - object.lamp_begin) * sizeof(float),
+                      obj.buffer + object.lamp_begin);
+
+  for(auto i = nodes.begin(); i != nodes.end(); i++)
+  {
+    Octree const* node = *i;
+    float const bounds[6] = {node->fit_lower.x,
+                             node->fit_lower.y,
+                             node->fit_lower.z,
+                             node->fit_upper.x,
+                             node->fit_upper.y,
+                             node->fit_upper.z};
+    writeBufferBlocking(queue,
+                        octree_mem,
+                        node->array_offset * sizeof(float),
+                        sizeof(bounds),
+                        bounds);
+  }
+}
+
+void Renderer::set_camera(Camera const& c)
+{
+  camera = c;
+  push_camera();
+  reset();
+}
+
+void Renderer::move_camera(Camera const& c)
+{
+  if(!reprojection)
+  {
+    set_camera(c);
+    return;
+  }
+  copyBufferBlocking(queue, data_mem, prev_data_mem);
+  copyBufferBlocking(queue, frame_f_mem, history_mem);
+  copyBufferBlocking(queue, depth_mem, prev_depth_mem);
+  camera = c;
+  push_camera();
+  reprojector.enqueue(w, h, queue);
+  queue.finish();
+}
+
+void Renderer::set_resolution(unsigned int width, unsigned int height)
+{
+  w = width < max_w ? width : max_w;
+  h = height < max_h ? height : max_h;
+  push_camera();
+  reset();
+}
+
+void Renderer::seed(uint64_t seed)
+{
+  /**
+   * PRNG
+   * adapted from svenstaro's trac0r
+   * 01.01.2016 => github.com/svenstaro/trac0r
+   * The xorshift state is expanded from the seed with splitmix64, so that
+   * close seeds still give unrelated states.
+   */
+  uint64_t prng[17];
+  for(int i = 0; i < 16; i++)
+  {
+    seed += 0x9E3779B97F4A7C15ull;
+    uint64_t z = seed;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    prng[i] = z ^ (z >> 31);
+  }
+  prng[16] = 0;
+  writeBufferBlocking(queue, prng_mem, prng);
+
+  /* Scrambles the low-discrepancy sequences */
+  uint32_t const scramble = (uint32_t)(prng[0] >> 32);
+  writeBufferBlocking(queue, sampler_mem, 0, sizeof(scramble), &scramble);
+}
+
+void Renderer::reset(float first)
+{
+  clearBufferBlocking(queue, frame_f_mem);
+  clearBufferBlocking(queue, depth_mem);
+  if(counters_mem.size > 0)
+    clearBufferBlocking(queue, counters_mem);
+  samples = first;
+  first_sample = first;
+}
+
+void Renderer::tune(WorkGroupTuner& tuner, bool probe)
+{
+  string const key =
+      WorkGroupTuner::key(env.device_id(), path_tracer.id(), w, h);
+
+  LocalSize best = {0, 0, INFINITY};
+  if(!tuner.lookup(key, best) && probe)
+  {
+    vector<LocalSize> const candidates =
+        WorkGroupTuner::candidates(path_tracer.resources(), w, h);
+    for(auto c = candidates.begin(); c != candidates.end(); c++)
+    {
+      path_tracer.set_local_size(c->x, c->y);
+      render(); // warm up
+      float ms = 0.0f;
+      for(unsigned int i = 0; i < 4; i++)
+        ms += render();
+      ms /= 4.0f;
+
+      cout << "[Renderer] Local size " << c->x << "x" << c->y << ": " << ms
+           << " ms" << endl;
+      if(ms < best.ms)
+        best = {c->x, c->y, ms};
+    }
+    tuner.store(key, best);
+    reset(first_sample);
+  }
+
+  path_tracer.set_local_size(best.x, best.y);
+  cout << "[Renderer] Using local size " << best.x << "x" << best.y << endl;
+}
+
+float Renderer::render(void)
+{
+  samples++;
+  writeBufferBlocking(queue, samples_mem, &samples);
+  float ms = launch();
+  if(pager)
+    ms += page_in();
+  return ms;
+}
+
+float Renderer::launch(void)
+{
+  cl::Event event;
+  if(persistent)
+  {
+    clearBufferBlocking(queue, counter_mem);
+    event = persistent_tracer.enqueue(persistent_items, queue);
+  }
+  else
+    event = path_tracer.enqueue(w, h, queue);
+  event.wait();
+  return getEventDuration(event);
+}
+
+float Renderer::page_in(void)
+{
+  vector<uint32_t>& table = pager->table();
+  size_t const prim_bytes = PRIM_SIZE * sizeof(float);
+  float ms = 0.0f;
+  for(unsigned int pass = 0;; pass++)
+  {
+    readBufferBlocking(queue, paging_mem, table.data());
+    vector<pair<unsigned int, unsigned int>> const loads = pager->schedule();
+    for(auto l = loads.begin(); l != loads.end(); l++)
+    {
+      ClusterEntry const& e = clusters->entry(l->first);
+      vector<float> const tree = pager->place_tree(l->first, l->second);
+      writeBufferBlocking(queue,
+                          objects_mem,
+                          pager->prim_base(l->second) * prim_bytes,
+                          e.prim_count * prim_bytes,
+                          clusters->cluster_prims(l->first));
+      writeBufferBlocking(queue,
+                          octree_mem,
+                          pager->tree_base(l->second) * sizeof(float),
+                          tree.size() * sizeof(float),
+                          tree.data());
+    }
+
+    if(loads.empty() || pass == PAGING_PASSES)
+    {
+      /* Pixels still waiting lose this sample, the next one retries */
+      if(!loads.empty() || pager->deferred() > 0)
+        cout << "[Renderer] Dropped the sample of pixels waiting for "
+             << loads.size() + pager->deferred() << " clusters" << endl;
+      table[PAGING_RETRY] = 0;
+      writeBufferBlocking(queue, paging_mem, table.data());
+      return ms;
+    }
+
+    table[PAGING_RETRY] = 1;
+    writeBufferBlocking(queue, paging_mem, table.data());
+    ms += launch();
+  }
+}
+
+__attribute__((pure)) unsigned int Renderer::sample_count(void) const
+{
+  return (unsigned int)(samples - first_sample);
+}
+
+uint64_t Renderer::state_key(void) const
+{
+  float const view[13] = {camera.pos.x,
+                          camera.pos.y,
+                          camera.pos.z,
+                          camera.dir.x,
+                          camera.dir.y,
+                          camera.dir.z,
+                          camera.up.x,
+                          camera.up.y,
+                          camera.up.z,
+                          camera.left.x,
+                          camera.left.y,
+                          camera.left.z,
+                          camera.fov};
+  uint64_t const parts[6] = {scene_id,
+                             checksum(view, sizeof(view)),
+                             w,
+                             h,
+                             max_bounces,
+                             sampler};
+  return checksum(parts, sizeof(parts));
+}
+
+void Renderer::save_state(RenderState& state) const
+{
+  state.key = state_key();
+  state.width = w;
+  state.height = h;
+  state.samples = samples;
+  state.first_sample = first_sample;
+  readBufferBlocking(queue, prng_mem, 0, sizeof(state.prng), state.prng);
+  readBufferBlocking(
+      queue, sampler_mem, 0, sizeof(state.scramble), &state.scramble);
+  state.rgbw.resize((size_t)w * h * 4);
+  read_accumulation(state.rgbw.data());
+}
+
+bool Renderer::restore_state(RenderState const& state)
+{
+  if(state.key != state_key() || state.width != w || state.height != h ||
+     state.rgbw.size() != (size_t)w * h * 4)
+    return false;
+
+  reset(state.first_sample);
+  samples = state.samples;
+  writeBufferBlocking(queue, prng_mem, 0, sizeof(state.prng), state.prng);
+  writeBufferBlocking(
+      queue, sampler_mem, 0, sizeof(state.scramble), &state.scramble);
+  writeBufferBlocking(queue,
+                      frame_f_mem,
+                      0,
+                      state.rgbw.size() * sizeof(float),
+                      state.rgbw.data());
+  return true;
+}
+
+void Renderer::read_frame(uint32_t* pixels) const
+{
+  readBufferBlocking(queue, frame_c_mem, 0, w * h * sizeof(uint32_t), pixels);
+}
+
+void Renderer::read_accumulation(float* rgbw) const
+{
+  readBufferBlocking(queue, frame_f_mem, 0, w * h * 4 * sizeof(float), rgbw);
+}
+
+void Renderer::read_counters(uint32_t* counters) const
+{
+  readBufferBlocking(
+      queue, counters_mem, 0, w * h * 4 * sizeof(cl_uint), counters);
+}
@@ -0,0 +1,310 @@
+#ifndef __RENDERER_H__
+#define __RENDERER_H__
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "autotune.hpp"
+#include "cl.hpp"
+#include "paging.hpp"
+#include "scene.hpp"
+
+/**
+ * Everything a progressive render needs to continue where it stopped, see
+ * Renderer::save_state and checkpoint.hpp.
+ */
+struct RenderState
+{
+  /** Renderer::state_key of the renderer that saved it **/
+  uint64_t key;
+  unsigned int width;
+  unsigned int height;
+  /** Index of the next sample, and the one the accumulation started at **/
+  float samples;
+  float first_sample;
+  /** Device PRNG and sampler scramble **/
+  uint64_t prng[17];
+  uint32_t scramble;
+  /** width * height * 4 floats, see Renderer::read_accumulation **/
+  std::vector<float> rgbw;
+};
+
+/**
+ * Owns the kernels and device buffers of the path tracer.
+ * Buffers are allocated for the maximum resolution, any smaller one can be
+ * rendered without reallocating.
+ */
+class Renderer
+{
+private:
+  OpenCL::Environment const& env;
+  cl::CommandQueue queue;
+  OpenCL::Kernel path_tracer;
+  OpenCL::Kernel persistent_tracer;
+  OpenCL::Kernel reprojector;
+
+  /** Shrunk by the constructor if the frame doesn't fit device memory **/
+  unsigned int max_w;
+  unsigned int max_h;
+  unsigned int const max_bounces;
+  bool const fast_math;
+  /** Whether the history buffers fit, see move_camera **/
+  bool reprojection;
+  bool built;
+  bool persistent;
+  bool instrumented;
+  /** One of the SAMPLER_* values, see sampler.hpp **/
+  unsigned int sampler;
+  /** Work-items of a persistent launch, enough to fill the device **/
+  size_t persistent_items;
+  unsigned int w;
+  unsigned int h;
+
+  Camera camera;
+  unsigned int surf_count;
+  unsigned int lamp_count;
+  unsigned int lamp_float_index;
+  /** Identifies the uploaded scene, see state_key **/
+  uint64_t scene_id;
+
+  /** Index of the next sample, and the one the accumulation started at **/
+  float samples;
+  float first_sample;
+
+  OpenCL::RemoteBuffer data_mem;
+  OpenCL::RemoteBuffer objects_mem;
+  OpenCL::RemoteBuffer octree_mem;
+  OpenCL::RemoteBuffer aux_mem;
+  OpenCL::RemoteBuffer frame_c_mem;
+  OpenCL::RemoteBuffer frame_f_mem;
+  OpenCL::RemoteBuffer samples_mem;
+  OpenCL::RemoteBuffer prng_mem;
+  OpenCL::RemoteBuffer depth_mem;
+  OpenCL::RemoteBuffer counter_mem;
+  /** Instrumented builds only, see read_counters **/
+  OpenCL::RemoteBuffer counters_mem;
+  /** Scramble seed, Sobol columns and blue noise, see sampler_tables **/
+  OpenCL::RemoteBuffer sampler_mem;
+
+  /** Previous frame, for reprojection **/
+  OpenCL::RemoteBuffer prev_data_mem;
+  OpenCL::RemoteBuffer history_mem;
+  OpenCL::RemoteBuffer prev_depth_mem;
+
+  /** Paged scenes only, see upload_paged_scene **/
+  ClusterCache const* clusters;
+  std::unique_ptr<ClusterPager> pager;
+  OpenCL::RemoteBuffer paging_mem;
+  /** Pixels whose sample waits for a cluster, one uint each **/
+  OpenCL::RemoteBuffer pending_mem;
+
+  void push_camera(void);
+
+  /**
+   * Launches the path tracer once.
+   * @return The kernel time in milliseconds
+   */
+  float launch(void);
+
+  /**
+   * Uploads the clusters the last launch requested and traces the pixels
+   * that waited for them again, until no ray misses a cluster.
+   * @return The kernel time of the extra launches in milliseconds
+   */
+  float page_in(void);
+
+  /**
+   * Kernel specialisation from bit masks of the materials and shapes that
+   * occur in the scene.
+   */
+  OpenCL::BuildOptions variant(uint32_t materials, uint32_t shapes) const;
+
+  /**
+   * Compiles both kernels as *variant* and binds the buffers,
+   * unless they already are.
+   */
+  void build(OpenCL::BuildOptions const& variant);
+
+public:
+  /**
+   * Allocates all buffers. The kernels are compiled by upload_scene.
+   * Without room in device memory, the reprojection history is dropped
+   * first and the largest resolution is reduced second.
+   * @param max_w, max_h - The largest resolution that will be rendered
+   * @param max_primitives - Capacity of the objects buffer
+   * @param octree_size - Size of the flattened octree in floats
+   * @param fast_math - Allow the compiler to trade precision for speed
+   */
+  Renderer(OpenCL::Environment const& env,
+           unsigned int max_w,
+           unsigned int max_h,
+           unsigned int max_primitives,
+           unsigned int octree_size,
+           unsigned int max_bounces,
+           bool fast_math = false);
+  virtual ~Renderer(void) {}
+
+  /**
+   * Kernel specialisation for a scene: fixes PRIM_SIZE and MAX_BOUNCES and
+   * compiles in only the materials and shapes that occur in it.
+   */
+  OpenCL::BuildOptions variant(ObjectsBuffer const& obj,
+                               float const* surfaces,
+                               float const* lamps) const;
+
+  /**
+   * Builds the kernel variant of the scene, then uploads only the used
+   * surface and lamp ranges of the objects buffer.
+   * @param surfaces - obj.surf_count primitives
+   * @param lamps - obj.lamp_count primitives, placed at obj.lamp_float_index
+   * @param octree - The flattened octree of *octree_size* floats, at most
+   *                 the size the renderer was constructed with
+   * @param id - Identifies the scene data, checkpoints are only resumed
+   *             on the same id. Taken from the caller, so a mapped scene
+   *             isn't read once more just to checksum it.
+   */
+  void upload_scene(ObjectsBuffer const& obj,
+                    float const* surfaces,
+                    float const* lamps,
+                    float const* octree,
+                    unsigned int octree_size,
+                    uint64_t id);
+
+  /**
+   * Whether the buffers have room for a scene of *primitives* primitives
+   * and an octree of *octree_size* floats, rendered at *width* x *height*.
+   */
+  bool fits(unsigned int width,
+            unsigned int height,
+            unsigned int primitives,
+            unsigned int octree_size) const;
+
+  /**
+   * Renders a scene too large for the device: only the top tree, the lamps
+   * and the resident surfaces of *cache* are uploaded. Clusters are loaded
+   * into *slots* slots when rays reach them, replacing the least recently
+   * used ones, and the samples that waited for them are traced again in
+   * the same render call. Instead of upload_scene, the renderer has to be
+   * constructed with cache.max_primitives(slots) and
+   * cache.octree_size(slots). *cache* has to outlive the renderer.
+   */
+  void upload_paged_scene(ClusterCache const& cache, unsigned int slots);
+
+  /**
+   * Uploads the primitive ranges of a moved object and the bounds of the
+   * refitted octree *nodes*. Does not reset the accumulation.
+   */
+  void upload_object(ObjectsBuffer const& obj,
+                     SceneObject const& object,
+                     std::vector<Octree*> const& nodes);
+
+  /**
+   * Sets the camera and starts a new accumulation.
+   */
+  void set_camera(Camera const& c);
+
+  /**
+   * Sets the camera, keeping what is still visible from the new position.
+   */
+  void move_camera(Camera const& c);
+
+  /**
+   * Changes the internal resolution and starts a new accumulation.
+   */
+  void set_resolution(unsigned int width, unsigned int height);
+
+  /**
+   * Reseeds the device PRNG and the scrambling of the sampler. Renderers
+   * with different seeds produce independent samples.
+   */
+  void seed(uint64_t seed);
+
+  /**
+   * Clears the accumulation.
+   * @param first - Index of the first sample that will be rendered
+   */
+  void reset(float first = 0.0f);
+
+  /**
+   * Sets the local size of the path tracer for the current variant and
+   * resolution from *tuner*.
+   * @param probe - If there is no entry yet, time every candidate on a few
+   *                samples and store the fastest. The accumulation is
+   *                reset afterwards.
+   */
+  void tune(WorkGroupTuner& tuner, bool probe);
+
+  /**
+   * Switches between one work-item per pixel and persistent work-groups
+   * that pull tiles from an atomic counter (see trace_persistent).
+   */
+  void set_persistent(bool enable) { persistent = enable; }
+
+  /**
+   * Builds the kernels with per-pixel counters from the next upload_scene
+   * on. Slower, meant for analysis only.
+   */
+  void set_instrumented(bool enable) { instrumented = enable; }
+
+  /**
+   * Builds the kernels with *s*, one of the SAMPLER_* values, from the next
+   * upload_scene on. Sobol by default.
+   */
+  void set_sampler(unsigned int s) { sampler = s; }
+
+  /**
+   * Renders one sample per pixel, blocking.
+   * @return The kernel time in milliseconds
+   */
+  float render(void);
+
+  /**
+   * Number of samples per pixel accumulated since the last reset.
+   */
+  unsigned int sample_count(void) const;
+
+  /**
+   * @param pixels -> width() * height() RGBA8888 pixels
+   */
+  void read_frame(uint32_t* pixels) const;
+
+  /**
+   * @param rgbw -> width() * height() * 4 floats: the color sums and the
+   *                number of samples of every pixel
+   */
+  void read_accumulation(float* rgbw) const;
+
+  /**
+   * Instrumented builds only.
+   * @param counters -> width() * height() * 4 values, summed over all
+   *                    samples since the last reset: triangle tests,
+   *                    sphere tests, octree node visits, bounces
+   */
+  void read_counters(uint32_t* counters) const;
+
+  /**
+   * Identifies what the accumulation depends on: the uploaded scene, the
+   * camera, the resolution, the bounces and the sampler.
+   */
+  uint64_t state_key(void) const;
+
+  /**
+   * Reads the accumulation, the sample counters and the random state back
+   * from the device.
+   */
+  void save_state(RenderState& state) const;
+
+  /**
+   * Continues the accumulation of *state*: the next render call takes the
+   * sample the saved renderer would have taken.
+   * @return false, changing nothing, if *state* was saved with a different
+   *         state_key or resolution
+   */
+  bool restore_state(RenderState const& state);
+
+  unsigned int width(void) const { return w; }
+  unsigned int height(void) const { return h; }
+};
+
+#endif
@@ -0,0 +1,170 @@
+#include "sampler.hpp"
+
+#include <cmath>
+
+/** Standard deviation of the void-and-cluster filter in pixels **/
+#define VOID_CLUSTER_SIGMA 1.5f
+
+using namespace std;
+
+void sobol_columns(uint32_t* columns)
+{
+  /**
+   * The first dimension is the van der Corput sequence, the second uses
+   * the primitive polynomial x + 1 with m_1 = 1.
+   */
+  for(unsigned int i = 0; i < SOBOL_BITS; i++)
+    columns[i] = 1u << (SOBOL_BITS - 1 - i);
+
+  uint32_t* second = columns + SOBOL_BITS;
+  second[0] = 1u << (SOBOL_BITS - 1);
+  for(unsigned int i = 1; i < SOBOL_BITS; i++)
+    second[i] = second[i - 1] ^ (second[i - 1] >> 1);
+}
+
+vector<uint32_t> blue_noise(unsigned int size)
+{
+  unsigned int const n = size * size;
+  unsigned int const mask = size - 1;
+
+  /* Gaussian response at every offset, wrapping around the tile */
+  vector<float> filter(n);
+  for(unsigned int y = 0; y < size; y++)
+    for(unsigned int x = 0; x < size; x++)
+    {
+      float dx = (float)min(x, size - x);
+      float dy = (float)min(y, size - y);
+      filter[y * size + x] = expf(-(dx * dx + dy * dy) /
+                                  (2.0f * VOID_CLUSTER_SIGMA *
+                                   VOID_CLUSTER_SIGMA));
+    }
+
+  vector<uint8_t> pattern(n, 0);
+  vector<float> energy(n, 0.0f);
+  auto toggle = [&](unsigned int p, bool set)
+  {
+    pattern[p] = set;
+    float const sign = set ? 1.0f : -1.0f;
+    unsigned int const px = p & mask;
+    unsigned int const py = p / size;
+    for(unsigned int y = 0; y < size; y++)
+      for(unsigned int x = 0; x < size; x++)
+        energy[y * size + x] +=
+            sign * filter[((y - py) & mask) * size + ((x - px) & mask)];
+  };
+  /* The set point with the most set neighbours */
+  auto tightest_cluster = [&](void)
+  {
+    unsigned int best = 0;
+    float most = -INFINITY;
+    for(unsigned int p = 0; p < n; p++)
+      if(pattern[p] && energy[p] > most)
+      {
+        most = energy[p];
+        best = p;
+      }
+    return best;
+  };
+  /* The free point with the fewest set neighbours */
+  auto largest_void = [&](void)
+  {
+    unsigned int best = 0;
+    float least = INFINITY;
+    for(unsigned int p = 0; p < n; p++)
+      if(!pattern[p] && energy[p] < least)
+      {
+        least = energy[p];
+        best = p;
+      }
+    return best;
+  };
+
+  /* Initial pattern, a tenth of the points at random */
+  unsigned int const ones = n / 10;
+  uint64_t state = 0x9E3779B97F4A7C15ull;
+  for(unsigned int i = 0; i < ones;)
+  {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    unsigned int const p = (unsigned int)(state % n);
+    if(!pattern[p])
+    {
+      toggle(p, true);
+      i++;
+    }
+  }
+
+  /* Move points from clusters to voids until that changes nothing */
+  while(true)
+  {
+    unsigned int const cluster = tightest_cluster();
+    toggle(cluster, false);
+    unsigned int const hole = largest_void();
+    toggle(hole, true);
+    if(hole == cluster)
+      break;
+  }
+  vector<uint8_t> const initial_pattern = pattern;
+  vector<float> const initial_energy = energy;
+
+  /* The initial points get the lowest ranks, the most clustered ones last */
+  vector<uint32_t> rank(n);
+  for(unsigned int r = ones; r-- > 0;)
+  {
+    unsigned int const cluster = tightest_cluster();
+    toggle(cluster, false);
+    rank[cluster] = r;
+  }
+
+  /* The remaining points fill the largest voids */
+  pattern = initial_pattern;
+  energy = initial_energy;
+  for(unsigned int r = ones; r < n; r++)
+  {
+    unsigned int const hole = largest_void();
+    toggle(hole, true);
+    rank[hole] = r;
+  }
+  return rank;
+}
+
+vector<uint32_t> sampler_tables(void)
+{
+  vector<uint32_t> tables(SAMPLER_TABLE_SIZE, 0);
+  sobol_columns(tables.data() + SAMPLER_SOBOL_OFFSET);
+
+  /* Ranks to offsets in the middle of their stratum of [0, 1) */
+  uint64_t const n = BLUE_NOISE_SIZE * BLUE_NOISE_SIZE;
+  vector<uint32_t> const ranks = blue_noise(BLUE_NOISE_SIZE);
+  for(size_t i = 0; i < ranks.size(); i++)
+    tables[SAMPLER_BLUE_NOISE_OFFSET + i] =
+        (uint32_t)(((2 * (uint64_t)ranks[i] + 1) << 31) / n);
+  return tables;
+}
+
+bool parse_sampler(string const& name, unsigned int& sampler)
+{
+  for(unsigned int s = SAMPLER_RANDOM; s <= SAMPLER_BLUE_NOISE; s++)
+    if(name == sampler_name(s))
+    {
+      sampler = s;
+      return true;
+    }
+  return false;
+}
+
+char const* sampler_name(unsigned int sampler)
+{
+  switch(sampler)
+  {
+  case SAMPLER_RANDOM:
+    return "random";
+  case SAMPLER_SOBOL:
+    return "sobol";
+  case SAMPLER_BLUE_NOISE:
+    return "blue-noise";
+  default:
+    return "unknown";
+  }
+}
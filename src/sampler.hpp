@@ -0,0 +1,64 @@
+#ifndef __SAMPLER_H__
+#define __SAMPLER_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Samplers of the path tracer, selected at kernel build time through the
+ * SAMPLER define, see Renderer::set_sampler.
+ * RANDOM - independent xorshift numbers
+ * SOBOL - Owen-scrambled Sobol points, scrambled per pixel
+ * BLUE_NOISE - Owen-scrambled Sobol points shared by all pixels, rotated
+ *              per pixel by a blue-noise tile, so the error of neighbouring
+ *              pixels is uncorrelated
+ */
+#define SAMPLER_RANDOM 0
+#define SAMPLER_SOBOL 1
+#define SAMPLER_BLUE_NOISE 2
+
+#define SOBOL_BITS 32
+/** Side of the tiling blue-noise texture, a power of two **/
+#define BLUE_NOISE_SIZE 64
+
+/**
+ * Layout of the sampler tables in 32-bit units:
+ * scramble seed :: UInt
+ * 2 * SOBOL_BITS generator columns of the first two Sobol dimensions
+ * BLUE_NOISE_SIZE^2 blue-noise offsets, in units of 2^-32
+ */
+#define SAMPLER_SOBOL_OFFSET 1
+#define SAMPLER_BLUE_NOISE_OFFSET (SAMPLER_SOBOL_OFFSET + 2 * SOBOL_BITS)
+#define SAMPLER_TABLE_SIZE                                                     \
+  (SAMPLER_BLUE_NOISE_OFFSET + BLUE_NOISE_SIZE * BLUE_NOISE_SIZE)
+
+/**
+ * @param columns -> 2 * SOBOL_BITS generator matrix columns, most
+ *                   significant bit first
+ */
+void sobol_columns(uint32_t* columns);
+
+/**
+ * Blue-noise threshold map made with the void-and-cluster method.
+ * @param size - Side of the tile, a power of two
+ * @return size * size ranks, every value in [0, size * size) once
+ */
+std::vector<uint32_t> blue_noise(unsigned int size);
+
+/**
+ * All sampler tables with a scramble seed of 0.
+ * @return SAMPLER_TABLE_SIZE values
+ */
+std::vector<uint32_t> sampler_tables(void);
+
+/**
+ * @param name - "random", "sobol" or "blue-noise"
+ * @param sampler <- One of the SAMPLER_* values
+ * @return false for unknown names
+ */
+bool parse_sampler(std::string const& name, unsigned int& sampler);
+
+char const* sampler_name(unsigned int sampler) __attribute__((const));
+
+#endif
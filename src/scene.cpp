@@ -5,6 +5,9 @@
 #include <string>
 #include <stack>
 #include <vector>
+#include <stdexcept>
+#include <atomic>
+#include <thread>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/matrix_access.hpp>
@@ -12,6 +15,10 @@
 #define __USE_BSD // to get usleep
 #include <unistd.h>
 
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
 #include "scene.hpp"
 
 using namespace std;
@@ -84,14 +91,35 @@ struct interleave_ // TODO what is this?
   float color;
 };
 
-Scene::Scene(ObjectsBuffer& objbuf) : buf(objbuf) { push_matrix(); }
+Scene::Scene(ObjectsBuffer& objbuf)
+    : buf(&objbuf), segment(nullptr), object_open(false)
+{
+  push_matrix();
+}
+
+Scene::Scene(SceneSegment& seg, glm::mat4 const& model)
+    : buf(nullptr), segment(&seg), object_open(false)
+{
+  model_s.push(model);
+}
 
 void Scene::clear_buffers(void)
 {
-  buf.surf_float_index = 0;
-  buf.lamp_float_index = 0;
-  buf.surf_count = 0;
-  buf.lamp_count = 0;
+  if(segment)
+  {
+    segment->surfaces.clear();
+    segment->lamps.clear();
+    segment->objects.clear();
+  }
+  else
+  {
+    buf->surf_float_index = 0;
+    buf->lamp_float_index = buf->max_count * PRIM_SIZE;
+    buf->surf_count = 0;
+    buf->lamp_count = 0;
+    objects.clear();
+  }
+  object_open = false;
 }
 
 void Scene::rotate(float angle, float x, float y, float z)
@@ -118,17 +146,17 @@ void Scene::translate(float x, float y, float z)
 
 //---------------------------------------
 
-void Scene::push_vec3(glm::vec3 const& v, unsigned int const& index)
+void Scene::push_vec3(glm::vec3 const& v, float* dst)
 {
-  buf.buffer[index + 0] = v.x;
-  buf.buffer[index + 1] = v.y;
-  buf.buffer[index + 2] = v.z;
+  dst[0] = v.x;
+  dst[1] = v.y;
+  dst[2] = v.z;
 }
 
-void Scene::push_vertex(glm::vec3 const& v, unsigned int const& index)
+void Scene::push_vertex(glm::vec3 const& v, float* dst)
 {
   glm::vec3 res = glm::vec3(model_s.top() * glm::vec4(v, 1.0f));
-  push_vec3(res, index);
+  push_vec3(res, dst);
 }
 
 __attribute__((const)) float min3(float a, float b, float c)
@@ -140,39 +168,204 @@ __attribute__((const)) float max3(float a, float b, float c)
   return max(a, max(b, c));
 }
 
+float* Scene::reserve(Material const& material, unsigned int count)
+{
+  unsigned int const floats = count * PRIM_SIZE;
+  bool const lamp = material.luminescence > 0.0001f;
+  if(segment)
+  {
+    vector<float>& v = lamp ? segment->lamps : segment->surfaces;
+    size_t const index = v.size();
+    v.resize(index + floats);
+    return v.data() + index;
+  }
+
+  if(buf->lamp_float_index - buf->surf_float_index < floats)
+    throw length_error("[Scene] Objects buffer full (" +
+                       to_string(buf->max_count) + " primitives).");
+
+  unsigned int index;
+  if(lamp)
+  {
+    buf->lamp_float_index -= floats;
+    buf->lamp_count += count;
+    index = buf->lamp_float_index;
+  }
+  else
+  {
+    index = buf->surf_float_index;
+    buf->surf_float_index += floats;
+    buf->surf_count += count;
+  }
+  return buf->buffer + index;
+}
+
+__attribute__((pure)) unsigned int Scene::surf_cursor(void) const
+{
+  return segment ? (unsigned int)segment->surfaces.size()
+                 : buf->surf_float_index;
+}
+
+__attribute__((pure)) unsigned int Scene::lamp_cursor(void) const
+{
+  return segment ? (unsigned int)segment->lamps.size()
+                 : buf->lamp_float_index;
+}
+
+void Scene::push_header(Material const& material,
+                        uint8_t shape,
+                        float* record)
+{
+  uint8_t* record_u = (uint8_t*)record;
+  record_u[0] = material.type;
+  record_u[1] = shape;
+  record_u[2] = 0;
+  record_u[3] = 0;
+  record[1] = material.roughness;
+  record[2] = material.luminescence;
+  push_vec3(material.color, record + 3);
+}
+
+glm::mat3 Scene::normal_matrix(void) const
+{
+  return glm::transpose(glm::inverse(glm::mat3(model_s.top())));
+}
+
 void Scene::triangle(Material const& material,
                      glm::vec3 const& a,
                      glm::vec3 const& b,
                      glm::vec3 const& c)
 {
-  glm::vec3 lower, upper;
+  float* record = reserve(material);
+  push_header(material, TRIANGLE, record);
 
-  unsigned int index;
-  if(material.luminescence > 0.0001f) // lamp
+  push_vertex(a, record + 6);
+  push_vertex(b, record + 9);
+  push_vertex(c, record + 12);
+
+  glm::vec3 norm = glm::cross(b - a, c - a);
+  push_vec3(normal_matrix() * norm, record + 15);
+}
+
+/**
+ * Transforms the *count* vectors (x[i], y[i], z[i]) in place by the upper
+ * 3x4 part of *mat*, four at a time. *count* has to be a multiple of 4.
+ * @param translate - false for directions (w = 0)
+ */
+static void transform_soa(glm::mat4 const& mat,
+                          bool translate,
+                          float* x,
+                          float* y,
+                          float* z,
+                          size_t count)
+{
+  float const t = translate ? 1.0f : 0.0f;
+#ifdef __SSE__
+  __m128 m[4][3];
+  for(int col = 0; col < 4; col++)
+    for(int row = 0; row < 3; row++)
+      m[col][row] = _mm_set1_ps(col == 3 ? t * mat[col][row] : mat[col][row]);
+
+  for(size_t i = 0; i < count; i += 4)
   {
-    buf.lamp_float_index -= PRIM_SIZE;
-    buf.lamp_count++;
-    index = buf.lamp_float_index;
+    __m128 vx = _mm_loadu_ps(x + i);
+    __m128 vy = _mm_loadu_ps(y + i);
+    __m128 vz = _mm_loadu_ps(z + i);
+    __m128 res[3];
+    for(int row = 0; row < 3; row++)
+      res[row] = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(m[0][row], vx), _mm_mul_ps(m[1][row], vy)),
+          _mm_add_ps(_mm_mul_ps(m[2][row], vz), m[3][row]));
+    _mm_storeu_ps(x + i, res[0]);
+    _mm_storeu_ps(y + i, res[1]);
+    _mm_storeu_ps(z + i, res[2]);
   }
-  else
+#else
+  for(size_t i = 0; i < count; i++)
   {
-    index = buf.surf_float_index;
-    buf.surf_float_index += PRIM_SIZE;
-    buf.surf_count++;
+    glm::vec3 res(mat * glm::vec4(x[i], y[i], z[i], t));
+    x[i] = res.x;
+    y[i] = res.y;
+    z[i] = res.z;
   }
+#endif
+}
+
+void Scene::mesh(Material const& material,
+                 vector<glm::vec3> const& vertices,
+                 vector<unsigned int> const& indices)
+{
+  if(indices.size() % 3 != 0)
+    throw invalid_argument("[Scene] Mesh index count " +
+                           to_string(indices.size()) +
+                           " is not a multiple of 3.");
+  for(size_t i = 0; i < indices.size(); i++)
+    if(indices[i] >= vertices.size())
+      throw out_of_range("[Scene] Mesh index " + to_string(i) +
+                         " (triangle " + to_string(i / 3) + ") is " +
+                         to_string(indices[i]) + ", but there are only " +
+                         to_string(vertices.size()) + " vertices.");
 
-  uint8_t* buf_u = (uint8_t*)(buf.buffer + index);
-  buf_u[0] = material.type;
-  buf.buffer[index + 1] = material.roughness;
-  buf.buffer[index + 2] = material.luminescence;
-  push_vec3(material.color, index + 3);
+  size_t const tri_count = indices.size() / 3;
+  if(tri_count == 0)
+    return;
 
-  push_vertex(a, index + 6);
-  push_vertex(b, index + 9);
-  push_vertex(c, index + 12);
+  /** Positions, structure of arrays padded to a multiple of 4 **/
+  size_t const vert_padded = (vertices.size() + 3) & ~(size_t)3;
+  vector<float> px(vert_padded, 0.0f);
+  vector<float> py(vert_padded, 0.0f);
+  vector<float> pz(vert_padded, 0.0f);
+  for(size_t i = 0; i < vertices.size(); i++)
+  {
+    px[i] = vertices[i].x;
+    py[i] = vertices[i].y;
+    pz[i] = vertices[i].z;
+  }
+  transform_soa(
+      model_s.top(), true, px.data(), py.data(), pz.data(), vert_padded);
 
-  glm::vec3 norm = glm::cross(b - a, c - a);
-  push_vertex(norm, index + 15);
+  /** Face normals in model space, then by the inverse-transpose **/
+  size_t const tri_padded = (tri_count + 3) & ~(size_t)3;
+  vector<float> nx(tri_padded, 0.0f);
+  vector<float> ny(tri_padded, 0.0f);
+  vector<float> nz(tri_padded, 0.0f);
+  for(size_t t = 0; t < tri_count; t++)
+  {
+    glm::vec3 const& a = vertices[indices[3 * t + 0]];
+    glm::vec3 const& b = vertices[indices[3 * t + 1]];
+    glm::vec3 const& c = vertices[indices[3 * t + 2]];
+    glm::vec3 norm = glm::cross(b - a, c - a);
+    nx[t] = norm.x;
+    ny[t] = norm.y;
+    nz[t] = norm.z;
+  }
+  transform_soa(glm::mat4(normal_matrix()),
+                false,
+                nx.data(),
+                ny.data(),
+                nz.data(),
+                tri_padded);
+
+  /** Reserve once, then write the packed records in one pass **/
+  float* out = reserve(material, (unsigned int)tri_count);
+  push_header(material, TRIANGLE, out);
+
+  float const header[6] = {out[0], out[1], out[2], out[3], out[4], out[5]};
+  for(size_t t = 0; t < tri_count; t++, out += PRIM_SIZE)
+  {
+    for(int i = 0; i < 6; i++)
+      out[i] = header[i];
+    for(int v = 0; v < 3; v++)
+    {
+      unsigned int const vi = indices[3 * t + (size_t)v];
+      out[6 + 3 * v + 0] = px[vi];
+      out[6 + 3 * v + 1] = py[vi];
+      out[6 + 3 * v + 2] = pz[vi];
+    }
+    out[15] = nx[t];
+    out[16] = ny[t];
+    out[17] = nz[t];
+  }
 }
 
 void Scene::quad(Material const& material,
@@ -185,6 +378,297 @@ void Scene::quad(Material const& material,
   triangle(material, a, c, d);
 }
 
+void Scene::sphere(Material const& material,
+                   glm::vec3 const& center,
+                   float radius)
+{
+  float* record = reserve(material);
+  push_header(material, SPHERE, record);
+
+  push_vertex(center, record + 6);
+  // Rotations and translations keep the radius, uniform scaling doesn't.
+  record[9] = radius * glm::length(glm::vec3(model_s.top()[0]));
+}
+
+ObjectsBuffer const& Scene::get_buffer(void) const
+{
+  if(segment)
+    throw logic_error("[Scene] Segments have to be merged first.");
+  return *buf;
+}
+
+AABB Scene::bounds(unsigned int prim) const
+{
+  if(segment)
+    throw logic_error("[Scene] Segments have to be merged first.");
+  float const* obj = buf->buffer + prim * PRIM_SIZE;
+  uint8_t const* obj_u = (uint8_t const*)obj;
+
+  if(obj_u[1] == SPHERE)
+  {
+    glm::vec3 center(obj[6], obj[7], obj[8]);
+    glm::vec3 radius(obj[9]);
+    return AABB(center - radius, center + radius);
+  }
+
+  glm::vec3 a(obj[6], obj[7], obj[8]);
+  glm::vec3 b(obj[9], obj[10], obj[11]);
+  glm::vec3 c(obj[12], obj[13], obj[14]);
+  return AABB(glm::min(a, glm::min(b, c)), glm::max(a, glm::max(b, c)));
+}
+
+Octree* Scene::build_octree(OctreeOptions const& options) const
+{
+  if(segment)
+    throw logic_error("[Scene] Segments have to be merged first.");
+  vector<unsigned int> prims;
+  for(unsigned int i = 0; i < buf->surf_count; i++)
+    prims.push_back(i);
+  unsigned int lamp_first = buf->lamp_float_index / PRIM_SIZE;
+  for(unsigned int i = 0; i < buf->lamp_count; i++)
+    prims.push_back(lamp_first + i);
+
+  /** The root has to be cubic and should contain everything right away **/
+  glm::vec3 lower(0.0f);
+  glm::vec3 upper(0.0f);
+  for(auto i = prims.begin(); i != prims.end(); i++)
+  {
+    AABB space = bounds(*i);
+    lower = i == prims.begin() ? space.lower : glm::min(lower, space.lower);
+    upper = i == prims.begin() ? space.upper : glm::max(upper, space.upper);
+  }
+  glm::vec3 extent = upper - lower;
+  float size = max3(extent.x, extent.y, extent.z) + 0.001f;
+
+  Octree* octree = new Octree(lower, lower + glm::vec3(size));
+  for(auto i = prims.begin(); i != prims.end(); i++)
+    octree = octree->insert(*i, bounds(*i), options);
+  octree->fit([this](unsigned int prim) { return bounds(prim); });
+  return octree;
+}
+
+void Scene::begin_object(void)
+{
+  if(object_open)
+    throw logic_error("[Scene] Objects can't be nested.");
+  object_open = true;
+
+  /* Segment lamps grow upwards, those of the objects buffer downwards */
+  SceneObject obj{};
+  obj.surf_begin = surf_cursor();
+  if(segment)
+    obj.lamp_begin = lamp_cursor();
+  else
+    obj.lamp_end = lamp_cursor();
+  obj.base = model_s.top();
+  (segment ? segment->objects : objects).push_back(obj);
+}
+
+unsigned int Scene::end_object(void)
+{
+  if(!object_open)
+    throw logic_error("[Scene] end_object without begin_object.");
+  object_open = false;
+
+  vector<SceneObject>& list = segment ? segment->objects : objects;
+  SceneObject& obj = list.back();
+  obj.surf_end = surf_cursor();
+  if(segment)
+    obj.lamp_end = lamp_cursor();
+  else
+    obj.lamp_begin = lamp_cursor();
+
+  float const* surfaces = segment ? segment->surfaces.data() : buf->buffer;
+  float const* lamps = segment ? segment->lamps.data() : buf->buffer;
+  obj.original.assign(surfaces + obj.surf_begin, surfaces + obj.surf_end);
+  obj.original.insert(
+      obj.original.end(), lamps + obj.lamp_begin, lamps + obj.lamp_end);
+  return (unsigned int)list.size() - 1;
+}
+
+SceneObject const& Scene::object(unsigned int handle) const
+{
+  return objects.at(handle);
+}
+
+/**
+ * Copies a record from *src* to *dst*, moving its payload by *mat*.
+ */
+static void transform_record(float const* src,
+                             float* dst,
+                             glm::mat4 const& mat,
+                             glm::mat3 const& normal_mat)
+{
+  for(int i = 0; i < 6; i++)
+    dst[i] = src[i];
+
+  for(int v = 0; v < 3; v++)
+  {
+    glm::vec3 pos(src[6 + 3 * v], src[7 + 3 * v], src[8 + 3 * v]);
+    pos = glm::vec3(mat * glm::vec4(pos, 1.0f));
+    dst[6 + 3 * v] = pos.x;
+    dst[7 + 3 * v] = pos.y;
+    dst[8 + 3 * v] = pos.z;
+  }
+
+  if(((uint8_t const*)src)[1] == SPHERE)
+  {
+    /* Only the center was a point, undo the rest */
+    for(int i = 9; i < PRIM_SIZE; i++)
+      dst[i] = src[i];
+    dst[9] = src[9] * glm::length(glm::vec3(mat[0]));
+    return;
+  }
+
+  glm::vec3 norm = normal_mat * glm::vec3(src[15], src[16], src[17]);
+  dst[15] = norm.x;
+  dst[16] = norm.y;
+  dst[17] = norm.z;
+}
+
+void Scene::set_transform(unsigned int handle,
+                          glm::mat4 const& transform,
+                          vector<unsigned int>& changed)
+{
+  if(segment)
+    throw logic_error("[Scene] Segments have to be merged first.");
+
+  SceneObject const& obj = objects.at(handle);
+  glm::mat4 const mat = obj.base * transform * glm::inverse(obj.base);
+  glm::mat3 const normal_mat = glm::transpose(glm::inverse(glm::mat3(mat)));
+
+  float const* src = obj.original.data();
+  for(unsigned int i = obj.surf_begin; i < obj.surf_end; i += PRIM_SIZE)
+  {
+    transform_record(src, buf->buffer + i, mat, normal_mat);
+    changed.push_back(i / PRIM_SIZE);
+    src += PRIM_SIZE;
+  }
+  for(unsigned int i = obj.lamp_begin; i < obj.lamp_end; i += PRIM_SIZE)
+  {
+    transform_record(src, buf->buffer + i, mat, normal_mat);
+    changed.push_back(i / PRIM_SIZE);
+    src += PRIM_SIZE;
+  }
+}
+
+void parallel_for(unsigned int count,
+                  unsigned int threads,
+                  function<void(unsigned int)> const& body)
+{
+  if(threads == 0)
+    threads = max(1u, thread::hardware_concurrency());
+  threads = min(threads, count);
+
+  atomic<unsigned int> next(0);
+  vector<exception_ptr> errors(threads);
+  auto worker = [&](unsigned int t) {
+    try
+    {
+      for(unsigned int i = next++; i < count; i = next++)
+        body(i);
+    }
+    catch(...)
+    {
+      errors[t] = current_exception();
+      next = count;
+    }
+  };
+
+  vector<thread> pool;
+  for(unsigned int t = 1; t < threads; t++)
+    pool.emplace_back(worker, t);
+  if(threads > 0)
+    worker(0);
+  for(auto t = pool.begin(); t != pool.end(); t++)
+    t->join();
+  for(auto e = errors.begin(); e != errors.end(); e++)
+    if(*e)
+      rethrow_exception(*e);
+}
+
+void Scene::merge(vector<SceneSegment>& segments)
+{
+  if(segment)
+    throw logic_error("[Scene] Segments can only be merged into a buffer.");
+  if(object_open)
+    throw logic_error("[Scene] Can't merge into an open object.");
+
+  size_t surf_floats = 0;
+  size_t lamp_floats = 0;
+  for(auto s = segments.begin(); s != segments.end(); s++)
+  {
+    surf_floats += s->surfaces.size();
+    lamp_floats += s->lamps.size();
+  }
+  if(buf->lamp_float_index - buf->surf_float_index <
+     surf_floats + lamp_floats)
+    throw length_error("[Scene] Objects buffer full (" +
+                       to_string(buf->max_count) + " primitives).");
+
+  /**
+   * Surfaces follow the existing ones, the lamps of all segments form one
+   * block below the existing lamps. Every segment is copied straight to
+   * its place, in parallel.
+   */
+  unsigned int surf_index = buf->surf_float_index;
+  unsigned int lamp_index = buf->lamp_float_index - (unsigned int)lamp_floats;
+  buf->surf_float_index += (unsigned int)surf_floats;
+  buf->lamp_float_index = lamp_index;
+  buf->surf_count += (unsigned int)(surf_floats / PRIM_SIZE);
+  buf->lamp_count += (unsigned int)(lamp_floats / PRIM_SIZE);
+
+  vector<float*> surf_dst;
+  vector<float*> lamp_dst;
+  for(auto s = segments.begin(); s != segments.end(); s++)
+  {
+    surf_dst.push_back(buf->buffer + surf_index);
+    lamp_dst.push_back(buf->buffer + lamp_index);
+
+    s->handle_base = (unsigned int)objects.size();
+    for(auto o = s->objects.begin(); o != s->objects.end(); o++)
+    {
+      o->surf_begin += surf_index;
+      o->surf_end += surf_index;
+      o->lamp_begin += lamp_index;
+      o->lamp_end += lamp_index;
+      objects.push_back(std::move(*o));
+    }
+    s->objects.clear();
+
+    surf_index += (unsigned int)s->surfaces.size();
+    lamp_index += (unsigned int)s->lamps.size();
+  }
+
+  parallel_for((unsigned int)segments.size(), 0, [&](unsigned int i) {
+    SceneSegment const& s = segments[i];
+    copy(s.surfaces.begin(), s.surfaces.end(), surf_dst[i]);
+    copy(s.lamps.begin(), s.lamps.end(), lamp_dst[i]);
+  });
+}
+
+vector<unsigned int>
+Scene::build_parallel(unsigned int parts,
+                      function<void(Scene&, unsigned int)> const& generator,
+                      unsigned int threads)
+{
+  vector<SceneSegment> segments(parts);
+  glm::mat4 const model = model_s.top();
+  parallel_for(parts, threads, [&](unsigned int p) {
+    Scene part(segments[p], model);
+    generator(part, p);
+    if(part.object_open)
+      throw logic_error("[Scene] Part ended inside an object.");
+  });
+
+  merge(segments);
+
+  vector<unsigned int> handles;
+  for(auto s = segments.begin(); s != segments.end(); s++)
+    handles.push_back(s->handle_base);
+  return handles;
+}
+
 /*
     case TRIANGLE_FAN:
         c_triangle[c_vertex_count] = performModelTransform(vertex);
@@ -3,7 +3,11 @@
 
 #include <glm/glm.hpp>
 #include <cstdint>
+#include <functional>
 #include <stack>
+#include <vector>
+
+#include "octree.hpp"
 
 /** SURFACE TYPE **/
 #define DIFFUSE ((uint8_t)1)
@@ -11,6 +15,10 @@
 #define MIRROR ((uint8_t)3)
 #define GLASS ((uint8_t)4)
 
+/** PRIMITIVE TYPE **/
+#define TRIANGLE ((uint8_t)1)
+#define SPHERE ((uint8_t)2)
+
 struct Material
 {
   Material(uint8_t type,
@@ -23,6 +31,12 @@ struct Material
   glm::vec3 const color;
 };
 
+/**
+ * Every primitive occupies PRIM_SIZE floats, the first six being the material
+ * header (type, shape, roughness, luminescence, color).
+ * TRIANGLE: a, b, c :: Float3, normal :: Float3
+ * SPHERE: center :: Float3, radius :: Float, (unused)
+ */
 #define PRIM_SIZE 18 // floats
 
 struct Camera
@@ -43,7 +57,7 @@ struct ObjectsBuffer
   ObjectsBuffer(float* b, unsigned int m) : buffer(b), max_count(m)
   {
     surf_float_index = 0;
-    lamp_float_index = max_count;
+    lamp_float_index = max_count * PRIM_SIZE;
     surf_count = 0;
     lamp_count = 0;
   }
@@ -56,6 +70,38 @@ struct ObjectsBuffer
   unsigned int lamp_count;
 };
 
+/**
+ * A group of primitives that can be moved after the scene was built.
+ * Lamps and surfaces live in different parts of the objects buffer,
+ * so an object covers one range of each (float indices, end exclusive).
+ */
+struct SceneObject
+{
+  unsigned int surf_begin;
+  unsigned int surf_end;
+  unsigned int lamp_begin;
+  unsigned int lamp_end;
+
+  /** Model matrix at begin_object **/
+  glm::mat4 base;
+  /** The records as emitted, surfaces followed by lamps **/
+  std::vector<float> original;
+};
+
+/**
+ * Geometry emitted by one thread, see Scene::build_parallel. Surfaces and
+ * lamps are kept apart in emission order, object ranges are float indices
+ * into them.
+ */
+struct SceneSegment
+{
+  std::vector<float> surfaces;
+  std::vector<float> lamps;
+  std::vector<SceneObject> objects;
+  /** Handle of the first object once merged **/
+  unsigned int handle_base = 0;
+};
+
 /**
  * Used to define the scene in a
  */
@@ -63,20 +109,57 @@ class Scene
 {
 private:
   /**
-   * ObjectsBuffer
+   * ObjectsBuffer, or the segment this scene is building
    */
-  ObjectsBuffer buf;
+  ObjectsBuffer* buf;
+  SceneSegment* segment;
 
   /**
    * Matrix stack for model matrix
    */
   std::stack<glm::mat4> model_s;
 
-  void push_vec3(glm::vec3 const& v, unsigned int const& index);
-  void push_vertex(glm::vec3 const& v, unsigned int const& index);
+  /**
+   * Movable objects, indexed by handle
+   */
+  std::vector<SceneObject> objects;
+  bool object_open;
+
+  void push_vec3(glm::vec3 const& v, float* dst);
+  void push_vertex(glm::vec3 const& v, float* dst);
+
+  /**
+   * Reserves space for *count* consecutive primitives (lamps grow from the
+   * end of the buffer). Throws std::length_error if the buffer is full.
+   * Segments grow instead.
+   * @return The first new primitive, valid until the next reserve
+   */
+  float* reserve(Material const& material, unsigned int count = 1);
+
+  /**
+   * Float indices where the next surface and lamp will be written.
+   */
+  unsigned int surf_cursor(void) const;
+  unsigned int lamp_cursor(void) const;
+
+  /**
+   * Writes the material header of the primitive at *record*.
+   */
+  void push_header(Material const& material, uint8_t shape, float* record);
+
+  /**
+   * Inverse-transpose of the model matrix, for transforming normals.
+   */
+  glm::mat3 normal_matrix(void) const;
 
 public:
   Scene(ObjectsBuffer& obuf);
+
+  /**
+   * A scene that emits into *seg*, starting with *model* as its matrix.
+   * Octrees and transforms are only available after merging it.
+   */
+  Scene(SceneSegment& seg, glm::mat4 const& model = glm::mat4(1.0f));
   virtual ~Scene(void) {}
 
   /**
@@ -94,6 +177,26 @@ public:
 
   void printInfo(void);
 
+  /**
+   * The objects buffer the scene is built in.
+   * Throws std::logic_error on a segment scene.
+   */
+  ObjectsBuffer const& get_buffer(void) const;
+
+  /**
+   * Returns the bounding box of the primitive at index *prim*
+   * (in PRIM_SIZE units from the beginning of the buffer).
+   * Throws std::logic_error on a segment scene.
+   */
+  AABB bounds(unsigned int prim) const;
+
+  /**
+   * Builds an octree over all surfaces and lamps.
+   * The primitive ids are the PRIM_SIZE indices into the objects buffer.
+   * Throws std::logic_error on a segment scene.
+   */
+  Octree* build_octree(OctreeOptions const& options = OctreeOptions()) const;
+
   //----------------------
 
   void rotate(float angle, glm::vec3 rotv);
@@ -112,6 +215,74 @@ public:
             glm::vec3 const& b,
             glm::vec3 const& c,
             glm::vec3 const& d);
+
+  void sphere(Material const& material, glm::vec3 const& center, float radius);
+
+  /* OBJECTS */
+  /**
+   * Everything emitted until end_object forms one object. Objects can't be
+   * nested.
+   */
+  void begin_object(void);
+
+  /**
+   * @return The handle of the object
+   */
+  unsigned int end_object(void);
+
+  SceneObject const& object(unsigned int handle) const;
+
+  /**
+   * Rewrites the primitives of an object in place, moved by *transform*
+   * relative to the model matrix it was created with.
+   * @param changed - Receives the ids of the rewritten primitives
+   */
+  void set_transform(unsigned int handle,
+                     glm::mat4 const& transform,
+                     std::vector<unsigned int>& changed);
+
+  /**
+   * Bulk version of triangle(). Every three *indices* into *vertices* form a
+   * triangle. Space is reserved once, vertices and face normals are
+   * transformed in batches and the records are written in a single pass.
+   * Throws std::out_of_range for an index past the vertices and
+   * std::invalid_argument for a trailing partial triangle, before anything
+   * is written.
+   */
+  void mesh(Material const& material,
+            std::vector<glm::vec3> const& vertices,
+            std::vector<unsigned int> const& indices);
+
+  /* PARALLEL CONSTRUCTION */
+  /**
+   * Appends the *segments* in order: their surfaces and lamps are copied
+   * once, each into its final place in the objects buffer, and their
+   * objects get handles from segment.handle_base on.
+   * Throws std::length_error if they don't fit.
+   */
+  void merge(std::vector<SceneSegment>& segments);
+
+  /**
+   * Runs *generator* for parts 0 to *parts* - 1 on up to *threads* threads,
+   * each on a scene of its own that starts with the current model matrix,
+   * then merges the parts in order. The result doesn't depend on the
+   * number of threads.
+   * @param threads - 0 for one per core
+   * @return The handle of the first object of every part
+   */
+  std::vector<unsigned int>
+  build_parallel(unsigned int parts,
+                 std::function<void(Scene&, unsigned int)> const& generator,
+                 unsigned int threads = 0);
 };
 
+/**
+ * Calls *body* for 0 to *count* - 1 on up to *threads* threads (0 for one
+ * per core), handing out one index at a time. The first exception stops
+ * the remaining calls and is rethrown.
+ */
+void parallel_for(unsigned int count,
+                  unsigned int threads,
+                  std::function<void(unsigned int)> const& body);
+
 #endif
@@ -0,0 +1,205 @@
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file.hpp"
+#include "scene_cache.hpp"
+
+using namespace std;
+
+#define PAGE_SIZE 4096
+
+__attribute__((pure)) uint64_t checksum(void const* data, size_t bytes)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL ^ bytes;
+  uint64_t const* words = (uint64_t const*)data;
+  size_t const count = bytes / 8;
+  for(size_t i = 0; i < count; i++)
+  {
+    hash ^= words[i];
+    hash *= 0x100000001b3ULL;
+    hash ^= hash >> 29;
+  }
+
+  uint8_t const* tail = (uint8_t const*)(words + count);
+  for(size_t i = 0; i < bytes % 8; i++)
+  {
+    hash ^= tail[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+__attribute__((pure)) uint64_t scene_key(string const& generator,
+                                         OctreeOptions const& options,
+                                         unsigned int max_count)
+{
+  float const opts[3] = {
+      options.looseness, (float)options.max_refs, options.ref_cost};
+  uint64_t const parts[3] = {checksum(generator.data(), generator.size()),
+                             checksum(opts, sizeof(opts)),
+                             max_count};
+  uint64_t const key = checksum(parts, sizeof(parts));
+  return key != 0 ? key : 1;
+}
+
+__attribute__((const)) static uint64_t page_align(uint64_t offset)
+{
+  return (offset + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+}
+
+SceneCache::SceneCache(void) : mapping(nullptr), mapping_size(0) {}
+
+SceneCache::~SceneCache(void) { unmap(); }
+
+void SceneCache::unmap(void)
+{
+  if(mapping != nullptr)
+    munmap(mapping, mapping_size);
+  mapping = nullptr;
+  mapping_size = 0;
+}
+
+bool SceneCache::load(string const& path,
+                      unsigned int max_count,
+                      uint64_t key)
+{
+  unmap();
+
+  int fd = open(path.c_str(), O_RDONLY);
+  if(fd < 0)
+    return false;
+
+  struct stat st;
+  if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SceneCacheHeader))
+  {
+    close(fd);
+    cerr << "[SceneCache] " << path << " is truncated." << endl;
+    return false;
+  }
+
+  mapping_size = (size_t)st.st_size;
+  mapping = mmap(nullptr, mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(mapping == MAP_FAILED)
+  {
+    mapping = nullptr;
+    mapping_size = 0;
+    cerr << "[SceneCache] Could not map " << path << "." << endl;
+    return false;
+  }
+
+  SceneCacheHeader const& h = header();
+  char const* reason = nullptr;
+  if(memcmp(h.magic, SCENE_CACHE_MAGIC, sizeof(SCENE_CACHE_MAGIC)) != 0)
+    reason = "not a scene cache";
+  else if(h.version != SCENE_CACHE_VERSION || h.prim_size != PRIM_SIZE)
+    reason = "outdated format";
+  else if(h.header_checksum !=
+          checksum(&h, offsetof(SceneCacheHeader, header_checksum)))
+    reason = "corrupt header";
+  else if(h.max_count != max_count)
+    reason = "different buffer capacity";
+  /* The counts are uploaded as they are, they have to fit the buffer */
+  else if((uint64_t)h.surf_count + h.lamp_count > h.max_count ||
+          (uint64_t)h.lamp_float_index !=
+              (uint64_t)(h.max_count - h.lamp_count) * PRIM_SIZE)
+    reason = "primitives don't fit the buffer";
+  else if(h.file_size != mapping_size ||
+          h.surf_offset + h.surf_count * PRIM_SIZE * sizeof(float) >
+              mapping_size ||
+          h.lamp_offset + h.lamp_count * PRIM_SIZE * sizeof(float) >
+              mapping_size ||
+          h.octree_offset + h.octree_size * sizeof(float) > mapping_size)
+    reason = "truncated";
+  else if(key != 0 && h.source_key != key)
+    reason = "built from another scene";
+
+  if(reason != nullptr)
+  {
+    cerr << "[SceneCache] Ignoring " << path << ": " << reason << "." << endl;
+    unmap();
+    return false;
+  }
+
+  cout << "[SceneCache] Mapped " << path << " (" << h.surf_count
+       << " surfaces, " << h.lamp_count << " lamps)." << endl;
+  return true;
+}
+
+bool SceneCache::store(string const& path,
+                       ObjectsBuffer const& obj,
+                       float const* octree_data,
+                       unsigned int octree_size,
+                       uint64_t key)
+{
+  size_t const surf_bytes = obj.surf_count * PRIM_SIZE * sizeof(float);
+  size_t const lamp_bytes = obj.lamp_count * PRIM_SIZE * sizeof(float);
+  size_t const octree_bytes = octree_size * sizeof(float);
+  float const* lamp_data = obj.buffer + obj.lamp_float_index;
+
+  SceneCacheHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, SCENE_CACHE_MAGIC, sizeof(SCENE_CACHE_MAGIC));
+  h.version = SCENE_CACHE_VERSION;
+  h.prim_size = PRIM_SIZE;
+  h.max_count = obj.max_count;
+  h.surf_count = obj.surf_count;
+  h.lamp_count = obj.lamp_count;
+  h.lamp_float_index = obj.lamp_float_index;
+  h.octree_size = octree_size;
+
+  h.surf_offset = page_align(sizeof(SceneCacheHeader));
+  h.lamp_offset = page_align(h.surf_offset + surf_bytes);
+  h.octree_offset = page_align(h.lamp_offset + lamp_bytes);
+  h.file_size = h.octree_offset + octree_bytes;
+
+  h.surf_checksum = checksum(obj.buffer, surf_bytes);
+  h.lamp_checksum = checksum(lamp_data, lamp_bytes);
+  h.octree_checksum = checksum(octree_data, octree_bytes);
+  h.source_key = key;
+  h.header_checksum = checksum(&h, offsetof(SceneCacheHeader, header_checksum));
+
+  bool const ok = write_atomically(path, [&](int fd) {
+    return write_all(fd, &h, sizeof(h)) &&
+           write_at(fd, h.surf_offset, obj.buffer, surf_bytes) &&
+           write_at(fd, h.lamp_offset, lamp_data, lamp_bytes) &&
+           write_at(fd, h.octree_offset, octree_data, octree_bytes) &&
+           ftruncate(fd, (off_t)h.file_size) == 0;
+  });
+  if(!ok)
+  {
+    cerr << "[SceneCache] Could not write " << path << "." << endl;
+    return false;
+  }
+
+  cout << "[SceneCache] Stored " << path << " (" << h.file_size << " byte)."
+       << endl;
+  return true;
+}
+
+__attribute__((pure)) SceneCacheHeader const& SceneCache::header(void) const
+{
+  return *(SceneCacheHeader const*)mapping;
+}
+
+__attribute__((pure)) float const* SceneCache::surfaces(void) const
+{
+  return (float const*)((char const*)mapping + header().surf_offset);
+}
+
+__attribute__((pure)) float const* SceneCache::lamps(void) const
+{
+  return (float const*)((char const*)mapping + header().lamp_offset);
+}
+
+__attribute__((pure)) float const* SceneCache::octree(void) const
+{
+  return (float const*)((char const*)mapping + header().octree_offset);
+}
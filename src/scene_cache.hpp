@@ -0,0 +1,111 @@
+#ifndef __SCENE_CACHE_H__
+#define __SCENE_CACHE_H__
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+#include "scene.hpp"
+
+#define SCENE_CACHE_MAGIC "HBSCENE"
+#define SCENE_CACHE_VERSION 2
+
+/**
+ * Compiled scene file. All sections start at page boundaries, so a mapped
+ * file can be handed to the device as is.
+ *
+ * header
+ * surfaces :: (surf_count * PRIM_SIZE) floats
+ * lamps    :: (lamp_count * PRIM_SIZE) floats
+ * octree   :: octree_size floats, see Octree::print_to_array
+ */
+struct SceneCacheHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t prim_size;
+  uint32_t max_count;
+  uint32_t surf_count;
+  uint32_t lamp_count;
+  uint32_t lamp_float_index;
+  uint32_t octree_size;
+  uint32_t padding;
+
+  /** Byte offsets from the beginning of the file **/
+  uint64_t surf_offset;
+  uint64_t lamp_offset;
+  uint64_t octree_offset;
+  uint64_t file_size;
+
+  uint64_t surf_checksum;
+  uint64_t lamp_checksum;
+  uint64_t octree_checksum;
+  /** What the scene was built from, see scene_key **/
+  uint64_t source_key;
+  /** Over all of the above **/
+  uint64_t header_checksum;
+};
+
+/**
+ * Read-only memory mapping of a compiled scene.
+ */
+class SceneCache
+{
+private:
+  void* mapping;
+  size_t mapping_size;
+
+  void unmap(void);
+
+public:
+  SceneCache(void);
+  virtual ~SceneCache(void);
+
+  /**
+   * Maps the file at *path* and validates its header: version, layout and
+   * that the counts fit an objects buffer of *max_count* primitives. The
+   * sections are not read, that is left to the upload, so a cold start
+   * costs no more than the upload itself.
+   * @param max_count - The capacity the objects buffer is allocated with
+   * @param key - scene_key of the scene the file has to be built from, 0
+   *              to take any scene
+   * @return false if the file is missing, stale or malformed
+   */
+  bool load(std::string const& path, unsigned int max_count, uint64_t key = 0);
+
+  /**
+   * Writes the scene to *path*. The file is replaced atomically, so
+   * processes storing the same scene at once don't corrupt it.
+   * @param key - scene_key of the scene
+   * @return false on I/O errors
+   */
+  static bool store(std::string const& path,
+                    ObjectsBuffer const& obj,
+                    float const* octree,
+                    unsigned int octree_size,
+                    uint64_t key);
+
+  SceneCacheHeader const& header(void) const;
+  float const* surfaces(void) const;
+  float const* lamps(void) const;
+  float const* octree(void) const;
+};
+
+/**
+ * 64-bit checksum over *bytes* bytes, processed word-wise.
+ */
+uint64_t checksum(void const* data, size_t bytes);
+
+/**
+ * Identifies a generated scene before it is built: by its *generator*, the
+ * options of its octree and the capacity of its objects buffer, which
+ * places the lamps. Never 0.
+ * @param generator - Name and version of the generator and whatever else
+ *                    it builds the scene from. It has to change whenever
+ *                    the generator builds something else.
+ */
+uint64_t scene_key(std::string const& generator,
+                   OctreeOptions const& options,
+                   unsigned int max_count);
+
+#endif
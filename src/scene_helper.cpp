@@ -1,4 +1,6 @@
 
+#include <random>
+
 #include "scene_helper.hpp"
 
 void box(Scene& scene, float x, float y, float z, Material const& mat)
@@ -9,22 +11,28 @@ void box(Scene& scene, float x, float y, float z, Material const& mat)
 
   /* left/right bottom/top back/front */
 
-  glm::vec3 lbb(-x, -y, -z);
-  glm::vec3 rbb(x, -y, -z);
-  glm::vec3 rbf(x, -y, z);
-  glm::vec3 lbf(-x, -y, z);
-
-  glm::vec3 ltb(-x, y, -z);
-  glm::vec3 rtb(x, y, -z);
-  glm::vec3 rtf(x, y, z);
-  glm::vec3 ltf(-x, y, z);
-
-  /*front */ scene.quad(mat, lbf, rbf, rtf, ltf);
-  /*left  */ scene.quad(mat, lbf, ltf, ltb, lbb);
-  /*back  */ scene.quad(mat, lbb, ltb, rtb, rbb);
-  /*right */ scene.quad(mat, rtf, rbf, rbb, rtb);
-  /*top   */ scene.quad(mat, rtf, rtb, ltb, ltf);
-  /*bottom*/ scene.quad(mat, lbb, rbb, rbf, lbf);
+  std::vector<glm::vec3> const vertices = {
+      glm::vec3(-x, -y, -z), // lbb 0
+      glm::vec3(x, -y, -z),  // rbb 1
+      glm::vec3(x, -y, z),   // rbf 2
+      glm::vec3(-x, -y, z),  // lbf 3
+      glm::vec3(-x, y, -z),  // ltb 4
+      glm::vec3(x, y, -z),   // rtb 5
+      glm::vec3(x, y, z),    // rtf 6
+      glm::vec3(-x, y, z)    // ltf 7
+  };
+
+  /* Same winding as quad(a, b, c, d) => (a, b, c), (a, c, d) */
+  static std::vector<unsigned int> const indices = {
+      3, 2, 6, 3, 6, 7, // front
+      3, 7, 4, 3, 4, 0, // left
+      0, 4, 5, 0, 5, 1, // back
+      6, 2, 1, 6, 1, 5, // right
+      6, 5, 4, 6, 4, 7, // top
+      0, 1, 2, 0, 2, 3  // bottom
+  };
+
+  scene.mesh(mat, vertices, indices);
 }
 
 void room(Scene& scene, float x, float y, float z, Material const& mat)
@@ -32,6 +40,37 @@ void room(Scene& scene, float x, float y, float z, Material const& mat)
   box(scene, -x, -y, -z, mat);
 }
 
+void random_scene(Scene& scene, unsigned int triangles)
+{
+  unsigned int const parts = 16;
+  Material const white(DIFFUSE, 1.0f, 0.0f, glm::vec3(1.0f));
+  Material const mirror(MIRROR, 0.0f, 0.0f, glm::vec3(1.0f));
+  Material const lamp(DIFFUSE, 0.0f, 30.0f, glm::vec3(1.0f));
+
+  scene.build_parallel(parts, [&](Scene& part, unsigned int p) {
+    std::mt19937 rng(p);
+    std::uniform_real_distribution<float> pos(0.0f, 10.0f);
+    std::uniform_real_distribution<float> offset(-0.15f, 0.15f);
+    auto const jitter = [&](glm::vec3 const& c) {
+      return c + glm::vec3(offset(rng), offset(rng), offset(rng));
+    };
+
+    unsigned int const count =
+        triangles / parts + (p < triangles % parts ? 1 : 0);
+    for(unsigned int i = 0; i < count; i++)
+    {
+      glm::vec3 const c(pos(rng), pos(rng), pos(rng));
+      part.triangle(white, jitter(c), jitter(c), jitter(c));
+    }
+    /* RANDOM_SCENE_EXTRA spheres */
+    if(p < RANDOM_SCENE_EXTRA / 2)
+    {
+      part.sphere(mirror, glm::vec3(pos(rng), pos(rng), pos(rng)), 0.5f);
+      part.sphere(lamp, glm::vec3(pos(rng), pos(rng), pos(rng)), 0.2f);
+    }
+  });
+}
+
 namespace Monitor
 {
 // w 58 h 35 d 7
@@ -3,9 +3,20 @@
 
 #include"scene.hpp"
 
+/** Primitives random_scene adds besides its triangles **/
+#define RANDOM_SCENE_EXTRA 8
+
 void box(Scene& scene, float x, float y, float z, Material const& mat);
 void room(Scene& scene, float x, float y, float z, Material const& mat);
 
+/**
+ * *triangles* small random triangles in a 10^3 cube at the origin and
+ * RANDOM_SCENE_EXTRA spheres, half of them lamps. Built with
+ * build_parallel, the same on any number of threads. For benchmarks and
+ * test scenes of any size.
+ */
+void random_scene(Scene& scene, unsigned int triangles);
+
 namespace Table
 {
   void render(Scene& scene);
@@ -25,6 +25,8 @@ namespace SDL
 
 	bool die = false;
 
+	Motion motion = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+
 	int init(unsigned int w, unsigned int h)
 	{
 		cout << "[SDL] Initializing." << endl;
@@ -57,6 +59,9 @@ namespace SDL
 			return 1;
 		}
 
+		/* Upscale reduced resolutions linearly */
+		SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "1");
+
 		renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
 		if(renderer == nullptr)
 		{
@@ -105,11 +110,31 @@ namespace SDL
 			case SDL_KEYDOWN:
 				if(event.key.keysym.sym == SDLK_ESCAPE)
 					die = true;
-				return;
+				break;
+			case SDL_MOUSEMOTION:
+				if(event.motion.state & SDL_BUTTON_LMASK)
+				{
+					motion.yaw += (float)event.motion.xrel;
+					motion.pitch += (float)event.motion.yrel;
+				}
+				break;
 			default:
 				break;
 			}
 		}
+
+		Uint8 const* keys = SDL_GetKeyboardState(nullptr);
+		motion.forward = (float)(keys[SDL_SCANCODE_W] - keys[SDL_SCANCODE_S]);
+		motion.right = (float)(keys[SDL_SCANCODE_D] - keys[SDL_SCANCODE_A]);
+		motion.up = (float)(keys[SDL_SCANCODE_E] - keys[SDL_SCANCODE_Q]);
+	}
+
+	Motion takeMotion(void)
+	{
+		Motion current = motion;
+		motion.yaw = 0.0f;
+		motion.pitch = 0.0f;
+		return current;
 	}
 
 	void wait(uint32_t ms)
@@ -117,11 +142,17 @@ namespace SDL
 	  SDL_Delay(ms);
 	}
 
-	void drawFrame(uint32_t* pixels)
+	void drawFrame(uint32_t const* pixels)
+	{
+		drawFrame(pixels, image_w, image_h);
+	}
+
+	void drawFrame(uint32_t const* pixels, int w, int h)
 	{
+		SDL_Rect const src = {0, 0, w, h};
 		SDL_RenderClear(renderer);
-		SDL_UpdateTexture(texture, 0, pixels, image_w * (int)sizeof(uint32_t));
-		SDL_RenderCopy(renderer, texture, 0, 0);
+		SDL_UpdateTexture(texture, &src, pixels, w * (int)sizeof(uint32_t));
+		SDL_RenderCopy(renderer, texture, &src, 0);
 		SDL_RenderPresent(renderer);
 	}
 }
@@ -8,10 +8,33 @@ namespace SDL
   int init(unsigned int w, unsigned int h);
   void close(void);
 
-  void drawFrame(uint32_t* pixels);
+  void drawFrame(uint32_t const* pixels);
+  /**
+   * Draws a w x h image (at most the init size) stretched to the window.
+   */
+  void drawFrame(uint32_t const* pixels, int w, int h);
   void handleEvents(void);
   void wait(uint32_t);
 
+  /**
+   * Camera input collected by handleEvents.
+   * forward/right/up are the held movement keys (-1, 0 or 1),
+   * yaw/pitch the mouse movement in pixels while the left button is down.
+   */
+  struct Motion
+  {
+    float forward;
+    float right;
+    float up;
+    float yaw;
+    float pitch;
+  };
+
+  /**
+   * Returns the current motion and resets the mouse part of it.
+   */
+  Motion takeMotion(void);
+
   extern bool die;
 }
 
@@ -0,0 +1,236 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <glm/gtc/constants.hpp>
+
+#include "image.hpp"
+#include "sequence.hpp"
+
+/** Frames a pool holds per encoder thread before submit blocks **/
+#define FRAMES_PER_ENCODER 2
+
+using namespace std;
+
+namespace Sequence
+{
+
+bool load_path(string const& path, vector<Keyframe>& keyframes)
+{
+  ifstream file(path);
+  if(!file.is_open())
+    return false;
+
+  keyframes.clear();
+  string line;
+  while(getline(file, line))
+  {
+    if(line.empty() || line[0] == '#')
+      continue;
+
+    istringstream fields(line);
+    Keyframe k;
+    float degrees;
+    if(!(fields >> k.time >> k.pos.x >> k.pos.y >> k.pos.z >> k.dir.x >>
+         k.dir.y >> k.dir.z >> degrees) ||
+       glm::length(k.dir) <= 0.0f ||
+       (!keyframes.empty() && k.time < keyframes.back().time))
+      return false;
+    k.dir = glm::normalize(k.dir);
+    k.fov = glm::radians(degrees);
+    keyframes.push_back(k);
+  }
+  return !keyframes.empty();
+}
+
+/**
+ * Uniform Catmull-Rom spline through *p1* and *p2* at *u* in [0, 1].
+ */
+__attribute__((const)) static glm::vec3 catmull_rom(glm::vec3 p0,
+                                                    glm::vec3 p1,
+                                                    glm::vec3 p2,
+                                                    glm::vec3 p3,
+                                                    float u)
+{
+  float const u2 = u * u;
+  float const u3 = u2 * u;
+  return 0.5f * (2.0f * p1 + (p2 - p0) * u +
+                 (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3) * u2 +
+                 (3.0f * p1 - p0 - 3.0f * p2 + p3) * u3);
+}
+
+Camera camera_at(vector<Keyframe> const& keyframes, float time)
+{
+  size_t const last = keyframes.size() - 1;
+  size_t k = 0;
+  while(k < last && keyframes[k + 1].time <= time)
+    k++;
+
+  Keyframe const& a = keyframes[k];
+  Keyframe const& b = keyframes[min(k + 1, last)];
+  Keyframe const& before = keyframes[k > 0 ? k - 1 : 0];
+  Keyframe const& after = keyframes[min(k + 2, last)];
+
+  float const span = b.time - a.time;
+  float const u =
+      span > 0.0f ? glm::clamp((time - a.time) / span, 0.0f, 1.0f) : 0.0f;
+
+  Camera c;
+  c.pos = catmull_rom(before.pos, a.pos, b.pos, after.pos, u);
+  c.dir = catmull_rom(before.dir, a.dir, b.dir, after.dir, u);
+  c.fov = a.fov + (b.fov - a.fov) * u;
+
+  /* Opposite directions pass through zero, keep the nearer keyframe's */
+  if(glm::length(c.dir) < 1e-4f)
+    c.dir = u < 0.5f ? a.dir : b.dir;
+  c.dir = glm::normalize(c.dir);
+
+  glm::vec3 const world_up(0.0f, 1.0f, 0.0f);
+  glm::vec3 left = glm::cross(world_up, c.dir);
+  if(glm::length(left) < 1e-4f)
+    left = glm::vec3(1.0f, 0.0f, 0.0f);
+  c.left = glm::normalize(left);
+  c.up = glm::cross(c.dir, c.left);
+  return c;
+}
+
+string frame_path(string const& pattern, unsigned int frame)
+{
+  string number = to_string(frame);
+  size_t const end = pattern.find_last_of('#');
+  if(end == string::npos)
+  {
+    size_t const dot = pattern.find_last_of('.');
+    size_t const at = dot == string::npos ? pattern.size() : dot;
+    return frame_path(pattern.substr(0, at) + "-####" + pattern.substr(at),
+                      frame);
+  }
+
+  size_t begin = end;
+  while(begin > 0 && pattern[begin - 1] == '#')
+    begin--;
+  size_t const width = end + 1 - begin;
+  if(number.size() < width)
+    number.insert(0, width - number.size(), '0');
+  return pattern.substr(0, begin) + number + pattern.substr(end + 1);
+}
+
+/**
+ * One encoder per core that is not driving the device.
+ */
+static unsigned int encoder_count(unsigned int threads)
+{
+  if(threads > 0)
+    return threads;
+  unsigned int const cores = thread::hardware_concurrency();
+  return cores > 1 ? cores - 1 : 1;
+}
+
+EncoderPool::EncoderPool(unsigned int threads)
+    : capacity(FRAMES_PER_ENCODER * encoder_count(threads)), closing(false),
+      failures(0)
+{
+  for(unsigned int t = 0; t < encoder_count(threads); t++)
+    workers.push_back(thread(&EncoderPool::work, this));
+}
+
+EncoderPool::~EncoderPool(void) { finish(); }
+
+void EncoderPool::work(void)
+{
+  while(true)
+  {
+    Task task;
+    {
+      unique_lock<mutex> guard(lock);
+      queued.wait(guard, [this] { return closing || !tasks.empty(); });
+      if(tasks.empty())
+        return;
+      task = move(tasks.front());
+      tasks.pop_front();
+    }
+    taken.notify_one();
+
+    Image const image = resolve(task.rgbw.data(), task.width, task.height);
+    if(!write_png(task.path, image))
+    {
+      cerr << "[Sequence] Could not write " << task.path << "." << endl;
+      lock_guard<mutex> guard(lock);
+      failures++;
+    }
+  }
+}
+
+void EncoderPool::submit(string const& path,
+                         vector<float>&& rgbw,
+                         unsigned int width,
+                         unsigned int height)
+{
+  {
+    unique_lock<mutex> guard(lock);
+    taken.wait(guard, [this] { return tasks.size() < capacity; });
+    tasks.push_back(Task{path, move(rgbw), width, height});
+  }
+  queued.notify_one();
+}
+
+unsigned int EncoderPool::finish(void)
+{
+  {
+    lock_guard<mutex> guard(lock);
+    closing = true;
+  }
+  queued.notify_all();
+  for(auto w = workers.begin(); w != workers.end(); w++)
+    w->join();
+  workers.clear();
+  return failures;
+}
+
+int run(Renderer& renderer, Job const& job)
+{
+  float const start = job.path.front().time;
+  float const length = job.path.back().time - start;
+  size_t const pixels = (size_t)renderer.width() * renderer.height();
+
+  auto const begin = chrono::steady_clock::now();
+  double render_seconds = 0.0;
+  EncoderPool encoders(job.encoders);
+  for(unsigned int f = 0; f < job.frames; f++)
+  {
+    float const u = job.frames > 1 ? (float)f / (float)(job.frames - 1) : 0.0f;
+    renderer.seed(job.seed + f);
+    renderer.set_camera(camera_at(job.path, start + u * length));
+
+    auto const frame_begin = chrono::steady_clock::now();
+    for(unsigned int s = 0; s < job.samples; s++)
+      renderer.render();
+    vector<float> rgbw(pixels * 4);
+    renderer.read_accumulation(rgbw.data());
+    double const frame_seconds =
+        chrono::duration<double>(chrono::steady_clock::now() - frame_begin)
+            .count();
+    render_seconds += frame_seconds;
+
+    /* Encoded in the background while the next frame renders */
+    string const path = frame_path(job.output, f);
+    encoders.submit(
+        path, move(rgbw), renderer.width(), renderer.height());
+    cout << "[Sequence] Frame " << f + 1 << "/" << job.frames << ": "
+         << frame_seconds << " s -> " << path << endl;
+  }
+
+  auto const rendered = chrono::steady_clock::now();
+  unsigned int const failures = encoders.finish();
+  auto const end = chrono::steady_clock::now();
+
+  cout << "[Sequence] " << job.frames << " frames in "
+       << chrono::duration<double>(end - begin).count() << " s, "
+       << render_seconds << " s rendering, "
+       << chrono::duration<double>(end - rendered).count()
+       << " s waiting for the encoders" << endl;
+  return failures > 0 ? 1 : 0;
+}
+}
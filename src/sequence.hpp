@@ -0,0 +1,126 @@
+#ifndef __SEQUENCE_H__
+#define __SEQUENCE_H__
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "renderer.hpp"
+
+namespace Sequence
+{
+
+/**
+ * Camera at a point in time. The up vector follows from the world up.
+ */
+struct Keyframe
+{
+  float time;
+  glm::vec3 pos;
+  glm::vec3 dir;
+  /** Vertical field of view in radians **/
+  float fov;
+};
+
+/**
+ * An animation rendered to numbered PNGs.
+ */
+struct Job
+{
+  /** At least one keyframe, by increasing time **/
+  std::vector<Keyframe> path;
+  unsigned int frames;
+  /** Samples per pixel of every frame **/
+  unsigned int samples;
+  /** Encoder threads, 0 for one per spare core **/
+  unsigned int encoders;
+  /** Seed of the first frame, every frame gets the next one **/
+  uint64_t seed;
+  /** File name, its run of '#' is replaced by the frame number **/
+  std::string output;
+};
+
+/**
+ * Reads keyframes from plain lines "time px py pz dx dy dz fov", the field
+ * of view in degrees. Lines starting with '#' are comments.
+ * @return false if the file is missing, malformed or not sorted by time
+ */
+bool load_path(std::string const& path, std::vector<Keyframe>& keyframes);
+
+/**
+ * Camera at *time*: Catmull-Rom through the positions and directions,
+ * the field of view linear. Clamped to the first and last keyframe.
+ */
+Camera camera_at(std::vector<Keyframe> const& keyframes, float time);
+
+/**
+ * *pattern* with its last run of '#' replaced by *frame*, zero-padded to
+ * the length of the run. Without '#' four digits are put before the
+ * extension.
+ */
+std::string frame_path(std::string const& pattern, unsigned int frame);
+
+/**
+ * Threads that resolve accumulation buffers and write them as PNGs, so the
+ * device renders the next frame meanwhile. Holds at most two frames per
+ * thread, submit blocks beyond that.
+ */
+class EncoderPool
+{
+private:
+  struct Task
+  {
+    std::string path;
+    std::vector<float> rgbw;
+    unsigned int width;
+    unsigned int height;
+  };
+
+  std::vector<std::thread> workers;
+  std::mutex lock;
+  std::condition_variable queued;
+  std::condition_variable taken;
+  std::deque<Task> tasks;
+  size_t const capacity;
+  bool closing;
+  unsigned int failures;
+
+  void work(void);
+
+public:
+  /**
+   * @param threads - 0 for one per spare core
+   */
+  EncoderPool(unsigned int threads);
+  virtual ~EncoderPool(void);
+
+  /**
+   * Queues one frame.
+   * @param rgbw - width * height * 4 floats, see Renderer::read_accumulation
+   */
+  void submit(std::string const& path,
+              std::vector<float>&& rgbw,
+              unsigned int width,
+              unsigned int height);
+
+  /**
+   * Writes everything queued and stops the threads.
+   * @return The number of frames that could not be written
+   */
+  unsigned int finish(void);
+};
+
+/**
+ * Renders job.frames frames evenly spread over the keyframe times.
+ * @return The exit status: nonzero if a frame could not be written
+ */
+int run(Renderer& renderer, Job const& job);
+}
+
+#endif